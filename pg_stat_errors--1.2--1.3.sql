@@ -0,0 +1,423 @@
+/* pg_stat_errors/pg_stat_errors--1.2--1.3.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_stat_errors UPDATE TO '1.3'" to load this file. \quit
+
+/* pg_stat_errors: durations of failed statements */
+DROP VIEW dba_stat_errors;
+DROP VIEW pg_stat_errors;
+DROP FUNCTION pg_stat_errors();
+
+/* pg_stat_errors */
+CREATE FUNCTION pg_stat_errors(
+    OUT userid              oid,
+    OUT dbid                oid,
+    OUT error_level         text,
+    OUT error_class         text,
+    OUT error_class_message text,
+    OUT error_state         text,
+    OUT error_state_message text,
+    ouT errors              bigint,
+    OUT last_time           timestamp with time zone,
+    OUT duration_p50        double precision,
+    OUT duration_p95        double precision,
+    OUT duration_p99        double precision,
+    OUT wasted_seconds      double precision,
+    OUT distinct_sessions   bigint,
+    OUT distinct_clients    bigint,
+    OUT parallel_errors     bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors AS
+  SELECT * FROM pg_stat_errors();
+
+GRANT SELECT ON pg_stat_errors TO PUBLIC;
+
+
+/* dba_stat_errors */
+CREATE VIEW dba_stat_errors AS
+SELECT 
+    userid,
+    ( SELECT pg_user.usename
+        FROM pg_user
+       WHERE pg_user.usesysid = pg_stat_errors.userid) AS usename,
+    dbid,
+    ( SELECT pg_database.datname
+        FROM pg_database
+       WHERE pg_database.oid = pg_stat_errors.dbid) AS datname,
+    error_level,
+    error_class,
+    error_class_message,
+    error_state,
+    error_state_message,
+    errors,
+    last_time,
+    duration_p50,
+    duration_p95,
+    duration_p99,
+    wasted_seconds,
+    distinct_sessions,
+    distinct_clients,
+    parallel_errors
+FROM pg_stat_errors;
+
+GRANT SELECT ON dba_stat_errors TO PUBLIC;
+
+
+/* pg_stat_errors_alert_rules */
+CREATE TABLE pg_stat_errors_alert_rules (
+    rule_name       text PRIMARY KEY CHECK (length(rule_name) < 64),
+    error_class     text CHECK (error_class ~ '^[0-9A-Z]{2}$'),
+    error_levels    text[] CHECK (error_levels <@ ARRAY['WARNING', 'ERROR', 'FATAL', 'PANIC']),
+    dbid            oid,
+    threshold       float8 NOT NULL DEFAULT 0,
+    duration        interval NOT NULL DEFAULT '0',
+    channel         text,
+    enabled         boolean NOT NULL DEFAULT true,
+    CHECK (error_class IS NULL OR dbid IS NULL)
+);
+
+SELECT pg_catalog.pg_extension_config_dump('pg_stat_errors_alert_rules', '');
+
+
+/* pg_stat_errors_topk */
+CREATE FUNCTION pg_stat_errors_topk(
+    OUT queryid             bigint,
+    OUT userid              oid,
+    OUT dbid                oid,
+    OUT error_state         text,
+    OUT errors              bigint,
+    OUT error_bound         bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors_topk AS
+  SELECT * FROM pg_stat_errors_topk();
+
+GRANT SELECT ON pg_stat_errors_topk TO PUBLIC;
+
+
+/* pg_stat_errors_sketch */
+CREATE FUNCTION pg_stat_errors_sketch(dimension text, value text)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_stat_errors_sketch_top(
+    OUT dimension           text,
+    OUT value               text,
+    OUT errors              bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors_sketch_top AS
+  SELECT * FROM pg_stat_errors_sketch_top();
+
+GRANT SELECT ON pg_stat_errors_sketch_top TO PUBLIC;
+
+
+/* pg_stat_errors_export */
+CREATE FUNCTION pg_stat_errors_export(include_last boolean DEFAULT false)
+RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_stat_errors_merge_accum(internal, bytea)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION pg_stat_errors_merge_combine(internal, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION pg_stat_errors_merge_serialize(internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION pg_stat_errors_merge_deserialize(bytea, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION pg_stat_errors_merge_final(internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE pg_stat_errors_merge(bytea) (
+    SFUNC = pg_stat_errors_merge_accum,
+    STYPE = internal,
+    FINALFUNC = pg_stat_errors_merge_final,
+    COMBINEFUNC = pg_stat_errors_merge_combine,
+    SERIALFUNC = pg_stat_errors_merge_serialize,
+    DESERIALFUNC = pg_stat_errors_merge_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE FUNCTION pg_stat_errors_decode(
+    IN  export              bytea,
+    OUT rolname             text,
+    OUT datname             text,
+    OUT error_level         text,
+    OUT error_state         text,
+    OUT errors              bigint,
+    OUT first_time          timestamp with time zone,
+    OUT last_time           timestamp with time zone,
+    OUT duration_p50        double precision,
+    OUT duration_p95        double precision,
+    OUT duration_p99        double precision,
+    OUT wasted_seconds      double precision,
+    OUT distinct_sessions   bigint,
+    OUT distinct_clients    bigint,
+    OUT parallel_errors     bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION pg_stat_errors_decode_last(
+    IN  export              bytea,
+    OUT error_time          timestamp with time zone,
+    OUT rolname             text,
+    OUT datname             text,
+    OUT query               text,
+    OUT error_level         text,
+    OUT error_state         text,
+    OUT error_message       text,
+    OUT repeat_count        bigint,
+    OUT last_time           timestamp with time zone
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE;
+
+
+/* pg_stat_errors_databases */
+CREATE FUNCTION pg_stat_errors_databases(
+    OUT dbid                oid,
+    OUT entries             bigint,
+    OUT entries_evicted     bigint,
+    OUT last_errors         bigint,
+    OUT last_replaced       bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors_databases AS
+  SELECT * FROM pg_stat_errors_databases();
+
+GRANT SELECT ON pg_stat_errors_databases TO PUBLIC;
+
+
+/* pg_stat_errors_history */
+CREATE FUNCTION pg_stat_errors_history(
+    IN  resolution          text,
+    IN  since               timestamp with time zone DEFAULT '-infinity',
+    OUT bucket_time         timestamp with time zone,
+    OUT error_class         text,
+    OUT dbid                oid,
+    OUT errors              bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+
+/* pg_stat_errors_last: repeats of the same error */
+DROP VIEW dba_stat_errors_last;
+DROP VIEW pg_stat_errors_last;
+DROP FUNCTION pg_stat_errors_last();
+
+/* pg_stat_errors_last */
+CREATE FUNCTION pg_stat_errors_last(
+    OUT error_time          timestamp with time zone,
+    OUT userid              oid,
+    OUT dbid                oid,
+    ouT query               text,
+    OUT error_level         text,
+    OUT error_state         text,
+    ouT error_message       text,
+    OUT repeat_count        bigint,
+    OUT last_time           timestamp with time zone,
+    OUT lock_relations      oid[],
+    OUT lock_mode           text,
+    OUT blocking_pids       integer[],
+    OUT lock_wait_time      double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors_last AS
+  SELECT * FROM pg_stat_errors_last();
+
+GRANT SELECT ON pg_stat_errors_last TO PUBLIC;
+
+
+/* dba_stat_errors_last */
+CREATE VIEW dba_stat_errors_last AS
+SELECT
+    error_time,
+    userid,
+    ( SELECT pg_user.usename
+        FROM pg_user
+       WHERE pg_user.usesysid = pg_stat_errors_last.userid) AS usename,
+    dbid,
+    ( SELECT pg_database.datname
+        FROM pg_database
+       WHERE pg_database.oid = pg_stat_errors_last.dbid) AS datname,
+    query,
+    error_level,
+    error_state,
+    error_message,
+    repeat_count,
+    last_time,
+    lock_relations,
+    lock_mode,
+    blocking_pids,
+    lock_wait_time
+FROM pg_stat_errors_last;
+
+GRANT SELECT ON dba_stat_errors_last TO PUBLIC;
+
+
+/* pg_stat_errors_info: compression of the queries, overhead governor */
+DROP VIEW pg_stat_errors_info;
+DROP FUNCTION pg_stat_errors_info();
+
+/* pg_stat_errors_info */
+CREATE FUNCTION pg_stat_errors_info(
+    OUT dealloc               bigint,
+    OUT stats_reset           timestamp with time zone,
+    OUT compression_ratio     double precision,
+    OUT compression_time      double precision,
+    OUT governor_tier         text,
+    OUT governor_transitions  bigint,
+    OUT governor_changed      timestamp with time zone,
+    OUT governor_cost         double precision,
+    OUT governor_degraded     bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors_info AS
+  SELECT * FROM pg_stat_errors_info();
+
+GRANT SELECT ON pg_stat_errors_info TO PUBLIC;
+
+
+/* pg_stat_errors_functions */
+CREATE FUNCTION pg_stat_errors_functions(
+    OUT funcid              oid,
+    OUT dbid                oid,
+    OUT error_state         text,
+    OUT errors              bigint,
+    OUT last_time           timestamp with time zone
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors_functions AS
+  SELECT * FROM pg_stat_errors_functions();
+
+GRANT SELECT ON pg_stat_errors_functions TO PUBLIC;
+
+
+/* pg_stat_errors_relations */
+CREATE FUNCTION pg_stat_errors_relations(
+    OUT relid               oid,
+    OUT dbid                oid,
+    OUT error_state         text,
+    OUT errors              bigint,
+    OUT total_wait_time     double precision,
+    OUT mean_wait_time      double precision,
+    OUT last_time           timestamp with time zone
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors_relations AS
+  SELECT * FROM pg_stat_errors_relations();
+
+GRANT SELECT ON pg_stat_errors_relations TO PUBLIC;
+
+
+/* pg_stat_errors_by_class */
+CREATE FUNCTION pg_stat_errors_by_class(
+    OUT error_level         text,
+    OUT error_class         text,
+    OUT error_class_message text,
+    OUT errors              bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors_by_class AS
+  SELECT * FROM pg_stat_errors_by_class();
+
+GRANT SELECT ON pg_stat_errors_by_class TO PUBLIC;
+
+
+/* pg_stat_errors_by_level */
+CREATE FUNCTION pg_stat_errors_by_level(
+    OUT error_level         text,
+    OUT errors              bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors_by_level AS
+  SELECT * FROM pg_stat_errors_by_level();
+
+GRANT SELECT ON pg_stat_errors_by_level TO PUBLIC;
+
+
+/* pg_stat_errors_by_database */
+CREATE FUNCTION pg_stat_errors_by_database(
+    OUT dbid                oid,
+    OUT error_level         text,
+    OUT errors              bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors_by_database AS
+  SELECT * FROM pg_stat_errors_by_database();
+
+GRANT SELECT ON pg_stat_errors_by_database TO PUBLIC;
+
+
+/* pg_stat_errors_messages */
+CREATE FUNCTION pg_stat_errors_messages(
+    OUT error_level         text,
+    OUT error_state         text,
+    OUT message_id          text,
+    OUT errors              bigint,
+    OUT last_time           timestamp with time zone,
+    OUT example_message     text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_stat_errors_messages AS
+  SELECT * FROM pg_stat_errors_messages();
+
+GRANT SELECT ON pg_stat_errors_messages TO PUBLIC;
@@ -14,24 +14,66 @@
  */
 #include "postgres.h"
 
+#include <fcntl.h>
+#include <math.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 #include <unistd.h>
 #include <time.h>
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
 
 #include "access/hash.h"
 #include "access/htup_details.h"
+#include "access/parallel.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/pg_language.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "common/pg_lzcompress.h"
+#include "commands/dbcommands.h"
+#include "executor/spi.h"
 #include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "libpq/libpq-be.h"
+#include "libpq/pqformat.h"
+#include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "portability/instr_time.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lwlock.h"
+#include "storage/proc.h"
 #include "storage/shmem.h"
 #include "storage/spin.h"
 #include "storage/fd.h"
 #include "tcop/utility.h"
+#include "utils/guc.h"
+#include "utils/json.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
 #include "utils/syscache.h"	/* for check the database and role exists */
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/timeout.h"
 #include "utils/timestamp.h"
 
+#include "pg_stat_errors.h"
+#include "pg_stat_errors_snapshot.h"
+#if PG_VERSION_NUM >= 170000
+#include "storage/procnumber.h"
+#else
+#include "storage/backendid.h"
+#endif
+
 
 PG_MODULE_MAGIC;
 
@@ -39,7 +81,7 @@ PG_MODULE_MAGIC;
 #define PGSE_DUMP_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/pg_stat_errors.stat"
 
 /* Magic number identifying the stats file format */
-static const uint32 PGSE_FILE_HEADER = 0x20210909;
+static const uint32 PGSE_FILE_HEADER = 0x20261025;
 
 /* PostgreSQL major version number, changes in which invalidate all entries */
 static const uint32 PGSE_PG_MAJOR_VERSION = PG_VERSION_NUM / 100;
@@ -47,9 +89,61 @@ static const uint32 PGSE_PG_MAJOR_VERSION = PG_VERSION_NUM / 100;
 /* PGSE */
 #define PGSE_DEALLOC_PERCENT       5    /* free this % of entries at once */
 #define SQLSTATE_LEN              20
-#define ERROR_MESSAGE_LEN        160
-#define MAX_QUERY_LEN           1024
-#define MAX_LAST_ERRORS         1000
+#define ERROR_MESSAGE_LEN        160    /* default of message_max_len */
+#define MAX_QUERY_LEN           1024    /* default of query_max_len */
+#define MAX_LAST_ERRORS        10000
+#define PGSE_EXPORT_MAX_LAST    1000    /* last errors kept by an export */
+#define PGSE_COMPRESSION_RATIO     4    /* query_max_len / area of compressed query */
+#define PGSE_NUM_SHARDS           64    /* shards of the global counters */
+#define PGSE_HIST_BUCKETS         32    /* log2 buckets of durations, in us */
+#define PGSE_HLL_BITS              7    /* 2^7 registers, about 9% error */
+#define PGSE_HLL_REGISTERS      (1 << PGSE_HLL_BITS)
+#define PGSE_NUM_TIERS             4    /* see pgseTier */
+#define PGSE_NUM_LOCKS             6    /* pgse->lock, topk_lock, history_lock,
+                                         * function_lock, relation_lock and
+                                         * message_lock */
+#define PGSE_MAX_TOPK          10000
+#define PGSE_FUNCTION_DEPTH       64    /* tracked depth of nested functions */
+#define PGSE_LOCK_MAX_RELATIONS    4    /* relations kept for a lock conflict */
+#define PGSE_LOCK_MAX_BLOCKERS     4    /* blocking processes kept for a lock conflict */
+#define PGSE_DEADLOCK_LINE_LEN   512    /* longest line of a deadlock report parsed */
+#define PGSE_FORMAT_MAX_ARGS       4    /* arguments of the formats matched */
+#define PGSE_MESSAGE_LEN         256    /* message template and example */
+
+/* Rollups of errors by level, class and database */
+#define PGSE_NUM_LEVELS            4    /* WARNING, ERROR, FATAL, PANIC */
+#define PGSE_MAX_CLASSES          64    /* there are less than 50 classes */
+#define PGSE_MAX_DATABASES        64
+#define PGSE_NUM_ECLASS         4096    /* 2 six-bit characters of a class */
+#define PGSE_NO_SLOT            0xFF    /* the cached slot: all slots are used */
+#define PGSE_QUOTA_SCAN         1024    /* oldest last errors searched over quota */
+
+/* History of the rollups */
+#define PGSE_HISTORY_MINUTES    1440    /* 24 hours of minutes */
+#define PGSE_HISTORY_HOURS       720    /* 30 days of hours */
+#define PGSE_HISTORY_SERIES     (PGSE_MAX_CLASSES + PGSE_MAX_DATABASES)
+#define PGSE_HISTORY_NAPTIME    5000    /* ms between roll-ups */
+
+/* Overhead governor */
+#define PGSE_GOVERNOR_WINDOW  1000000   /* us over which the cost is measured */
+#define PGSE_GOVERNOR_SAMPLE      16    /* time 1 call of the hook in this many */
+#define PGSE_GOVERNOR_LAST_SAMPLE 16    /* keep 1 last error in this many, when sampled */
+#define PGSE_GOVERNOR_STEP_UP    0.8    /* fraction of the budget to step up */
+
+/* Filters of errors */
+#define PGSE_FILTER_MAX_ITEMS     64    /* per kind of items */
+
+/* Count-min sketch of secondary dimensions */
+#define PGSE_SKETCH_DIMS           3    /* relation, constraint, client */
+#define PGSE_SKETCH_DEPTH          4    /* rows, i.e. hash functions */
+#define PGSE_SKETCH_VALUE_LEN    128
+#define PGSE_SKETCH_RECENT       256    /* recent values for the candidates */
+#define PGSE_SKETCH_CANDIDATES    16    /* top estimates per dimension */
+#define PGSE_SKETCH_NAPTIME     1000    /* ms between updates of candidates */
+
+/* Export of the last errors into files */
+#define PGSE_EXPORT_FILE_PREFIX  "pg_stat_errors"
+#define PGSE_EXPORT_FLUSH_SIZE   (64 * 1024)    /* write buffered lines at once */
 
 
 /*
@@ -72,6 +166,15 @@ typedef struct pgseHashKey
 typedef struct Counters
 {
 	int64           errors;         /* all errors except cancel and terminate */
+	int64           wasted_time;    /* total duration of failed statements, in us */
+	int64           parallel_errors;    /* errors raised by parallel workers */
+	uint32          duration_hist[PGSE_HIST_BUCKETS];   /* durations of failed
+	                                 * statements: bucket 0 is 0 us, bucket b
+	                                 * is [2^(b-1), 2^b) us, the last one is
+	                                 * open-ended */
+	uint8           sessions[PGSE_HLL_REGISTERS];   /* HyperLogLog of sessions */
+	uint8           clients[PGSE_HLL_REGISTERS];    /* HyperLogLog of client
+	                                 * addresses */
 	/* internal usage */
 	TimestampTz     _first_change;
 	TimestampTz     _last_change;   /* also use as last_time column */
@@ -79,17 +182,52 @@ typedef struct Counters
 
 
 /*
- * The last errors kept within pgsqEntryError
+ * Lock waited for by a statement failed with a lock conflict: a deadlock,
+ * a lock timeout or a serialization failure.  See get_lock_info().
+ */
+typedef struct pgseLockInfo
+{
+	int             lockmode;                       /* mode waited for, NoLock if unknown */
+	int64           wait_time;                      /* duration of the wait in us, -1 if unknown */
+	int16           nrelations;
+	int16           nblockers;
+	Oid             relations[PGSE_LOCK_MAX_RELATIONS];
+	int32           blockers[PGSE_LOCK_MAX_BLOCKERS];  /* PIDs of the blocking processes */
+} pgseLockInfo;
+
+/*
+ * Argument of a format matched by match_format(): the value of a %d or a
+ * %u, the text of a %s, which is not null-terminated.
+ */
+typedef struct pgseFormatArg
+{
+	long            value;
+	const char      *str;
+	size_t          len;
+} pgseFormatArg;
+
+/*
+ * The last errors kept within pgseEntryError.  The texts of the query and
+ * of the message follow it in the slot, they are not null-terminated.
  */
 typedef struct ErrorInfo
 {
+	uint64          seqno;                          /* sequence number of error */
 	TimestampTz     etime;                          /* timestamp of error */
 	Oid             userid;                         /* user OID */
 	Oid             dbid;                           /* database OID */
-	char            query[MAX_QUERY_LEN];
 	int             elevel;                         /* error level */
 	int             ecode;                          /* encoded ERRSTATE */
-	char            message[ERROR_MESSAGE_LEN];     /* primary error message (translated) */
+	uint32          query_len;                      /* length of the query */
+	uint32          message_len;                    /* length of primary error message (translated) */
+	uint32          query_raw_len;                  /* length of the query before compression */
+	int             query_method;                   /* compression of the query */
+	uint32          hash;                           /* hash of the error, see get_error_hash() */
+	uint32          repeat_count;                   /* # of the same error in a row */
+	TimestampTz     last_time;                      /* timestamp of the last repeat */
+	bool            exported;                       /* written by pgse_export_errors(), no
+	                                                 * more repeats are counted in it */
+	pgseLockInfo    lock;                           /* lock conflict, see is_lock_error() */
 } ErrorInfo;
 
 
@@ -102,13 +240,84 @@ typedef struct pgseGlobalStats
 	TimestampTz     stats_reset;    /* timestamp with all stats reset */
 } pgseGlobalStats;
 
-typedef struct pgseGlobalEID
+/*
+ * A shard of the global counters.  A backend updates the shard of its
+ * backend slot only, each shard takes a whole cache line, so the backends
+ * failing at the same time do not bounce the cache lines between CPUs.
+ * The readers sum all the shards.
+ */
+typedef union pgseShard
+{
+	struct
+	{
+		pg_atomic_uint64    total_errors;
+		pg_atomic_uint64    dealloc;
+		pg_atomic_uint64    query_raw_bytes;    /* queries before compression */
+		pg_atomic_uint64    query_stored_bytes; /* queries after compression */
+		pg_atomic_uint64    compress_time;      /* us */
+		pg_atomic_uint64    hook_cost;          /* ns of the timed calls of the hook */
+		pg_atomic_uint64    hook_samples;       /* # of timed calls of the hook */
+		pg_atomic_uint64    degraded;           /* errors with less detail kept */
+	}                   c;
+	char                pad[PG_CACHE_LINE_SIZE];
+} pgseShard;
+
+/*
+ * The head of the ring buffer of the last errors: the sequence number of
+ * the last claimed slot.  It takes a whole cache line too.
+ */
+typedef union pgseRingHead
+{
+	pg_atomic_uint64    seqno;
+	char                pad[PG_CACHE_LINE_SIZE];
+} pgseRingHead;
+
+/*
+ * Counters of errors by level and class and by database and level.
+ *
+ * The counters are updated with atomic operations and read without any lock,
+ * they are never removed by the eviction of the entries of the hashtable.
+ * The slots of classes and databases are claimed under pgse->mutex once and
+ * never released; a reader scans only the first nclasses/ndatabases slots.
+ */
+typedef struct pgseRollups
+{
+	int32               nclasses;       /* claimed slots of classes */
+	int32               ndatabases;     /* claimed slots of databases */
+	int                 classes[PGSE_MAX_CLASSES];      /* ERRCODE_TO_CATEGORY */
+	Oid                 databases[PGSE_MAX_DATABASES];
+	pg_atomic_uint64    class_errors[PGSE_NUM_LEVELS][PGSE_MAX_CLASSES];
+	pg_atomic_uint64    db_errors[PGSE_MAX_DATABASES][PGSE_NUM_LEVELS];
+	/* quotas of the databases */
+	pg_atomic_uint32    db_entries[PGSE_MAX_DATABASES];     /* entries of pgse_hash held,
+	                                                         * under pgse->lock */
+	pg_atomic_uint32    db_last[PGSE_MAX_DATABASES];        /* slots of the ring held */
+	pg_atomic_uint64    db_evicted[PGSE_MAX_DATABASES];     /* entries evicted by quota */
+	pg_atomic_uint64    db_last_replaced[PGSE_MAX_DATABASES];   /* last errors replaced
+	                                                             * over quota */
+	/* totals, and the errors of the classes and databases without a slot */
+	pg_atomic_uint64    level_errors[PGSE_NUM_LEVELS];
+	pg_atomic_uint64    class_other_errors[PGSE_NUM_LEVELS];
+	pg_atomic_uint64    db_other_errors[PGSE_NUM_LEVELS];
+} pgseRollups;
+
+/*
+ * History of the rollups
+ *
+ * A series is a slot of class of the rollups, or PGSE_MAX_CLASSES plus a
+ * slot of database.  The background worker adds the difference of the
+ * cumulative rollups since its last roll-up to the buckets of the current
+ * minute and hour; a bucket is zeroed when its ring wraps.  The start of a
+ * bucket is its number of minutes or hours since the epoch, -1 if unused.
+ */
+typedef struct pgseHistory
 {
-	uint32          curr_eid;       /* current index of errors array */
-	uint32          next_eid;       /* next index of errors array */
-	uint32          max_eid;        /* actual number of last errors if the number
-	                                 * of errors is less than pgse_max_last */
-} pgseGlobalEID;
+	uint64          prev[PGSE_HISTORY_SERIES];      /* rollups at last roll-up */
+	int64           minute_start[PGSE_HISTORY_MINUTES];
+	int64           hour_start[PGSE_HISTORY_HOURS];
+	uint32          minutes[PGSE_HISTORY_MINUTES][PGSE_HISTORY_SERIES];
+	uint32          hours[PGSE_HISTORY_HOURS][PGSE_HISTORY_SERIES];
+} pgseHistory;
 
 /*
  * Statistics per key
@@ -118,31 +327,355 @@ typedef struct pgseEntry
 {
 	pgseHashKey     key;            /* hash key of entry - MUST BE FIRST */
 	Counters        counters;       /* the statistics for this key */
-	slock_t         mutex;          /* protects the counters only */
+	slock_t         mutex;          /* serializes the writers of counters */
+	uint32          changecount;    /* seqlock of counters, see pgse_begin_write() */
 } pgseEntry;
 
 /*
  * Last Errors. The simple ring buffer.
+ *
+ * The size of a slot depends on pg_stat_errors.query_max_len and
+ * pg_stat_errors.message_max_len and is rounded up to the cache line, so
+ * the backends writing adjacent slots do not share a cache line.  Use
+ * pgse_error_slot() to address a slot.
  */
 typedef struct pgseEntryError
 {
+	slock_t         mutex;          /* serializes the writers of the error */
+	uint32          changecount;    /* seqlock of the error and the texts */
 	ErrorInfo       error;          /* the error for this key */
-	slock_t         mutex;          /* protects the error only */
+	char            text[FLEXIBLE_ARRAY_MEMBER];    /* query, then message */
 } pgseEntryError;
 
+#define pgse_error_query(e)     ((e)->text)
+#define pgse_error_message(e)   ((e)->text + get_query_area())
+
+/*
+ * Seqlock of the counters of the entries and of the slots of last errors.
+ *
+ * A writer holds the spinlock of the entry or the slot, so the writers are
+ * serialized, and makes changecount odd while it writes.  A reader takes no
+ * lock and writes nothing into shared memory: it copies the data and
+ * retries if changecount was odd or has changed meanwhile.
+ */
+#define pgse_begin_write(e) \
+	do { \
+		(e)->changecount++; \
+		pg_write_barrier(); \
+	} while (0)
+
+#define pgse_end_write(e) \
+	do { \
+		pg_write_barrier(); \
+		(e)->changecount++; \
+	} while (0)
+
+#define pgse_begin_read(e, before) \
+	do { \
+		(before) = (e)->changecount; \
+		pg_read_barrier(); \
+	} while (0)
+
+#define pgse_end_read(e, before) \
+	(pg_read_barrier(), ((before) & 1) == 0 && (e)->changecount == (before))
+
+/*
+ * Heavy hitters, tracked by the Space-Saving algorithm over a key wider
+ * than the key of pgse_hash.  With k items, the count of an item exceeds
+ * its true number of errors by at most its error bound, and every key with
+ * more than total / k errors is tracked.
+ *
+ * The items never move, a min-heap of their indexes by count gives the item
+ * to replace, and a hashtable maps a key to its item.  A tracked key is
+ * counted under a shared lock, the heap is only maintained under the
+ * exclusive lock taken for a new key: it is rebuilt first if counts have
+ * changed since, see pgse_topk_add().
+ */
+typedef struct pgseTopKKey
+{
+	uint64          queryid;        /* query identifier, 0 if not computed */
+	Oid             userid;         /* user OID */
+	Oid             dbid;           /* database OID */
+	int             ecode;          /* encoded ERRSTATE */
+} pgseTopKKey;
+
+typedef struct pgseTopKItem
+{
+	pgseTopKKey     key;
+	pg_atomic_uint64 count;         /* estimated number of errors */
+	int64           error;          /* max overestimation of count */
+	int32           heap_pos;       /* position in the heap */
+} pgseTopKItem;
+
+typedef struct pgseTopKSlot
+{
+	pgseTopKKey     key;            /* hash key of slot - MUST BE FIRST */
+	int32           item;           /* index of the item */
+} pgseTopKSlot;
+
+typedef struct pgseTopK
+{
+	int32           nitems;         /* used items */
+	pg_atomic_uint32 dirty;         /* counts changed since the heap was built */
+	pgseTopKItem    items[FLEXIBLE_ARRAY_MEMBER];   /* followed by the heap */
+} pgseTopK;
+
+/*
+ * Count-min sketch of the errors by relation, constraint and client address.
+ *
+ * Each dimension has PGSE_SKETCH_DEPTH rows of pg_stat_errors.sketch_width
+ * atomic counters; an error increments one counter per row and the estimate
+ * of a value is the minimum of its counters, never below the true count.
+ *
+ * The sketch cannot list its values, so the backends also put the values
+ * into a small ring, and the background worker keeps the values with the
+ * highest estimates as candidates.
+ */
+typedef enum pgseSketchDim
+{
+	PGSE_DIM_RELATION,
+	PGSE_DIM_CONSTRAINT,
+	PGSE_DIM_CLIENT
+} pgseSketchDim;
+
+static const char *const pgse_sketch_dims[PGSE_SKETCH_DIMS] =
+{
+	"relation",
+	"constraint",
+	"client"
+};
+
+typedef struct pgseSketchValue
+{
+	slock_t         mutex;          /* protects the fields below */
+	uint64          seqno;          /* sequence number of the value */
+	int             dim;            /* pgseSketchDim */
+	char            value[PGSE_SKETCH_VALUE_LEN];
+} pgseSketchValue;
+
+typedef struct pgseSketch
+{
+	pg_atomic_uint64    head;       /* seqno of the last recent value */
+	uint64              drained;    /* last recent value seen by the worker,
+	                                 * owned by the background worker */
+	slock_t             mutex;      /* protects the candidates */
+	int32               ncandidates[PGSE_SKETCH_DIMS];
+	char                candidates[PGSE_SKETCH_DIMS][PGSE_SKETCH_CANDIDATES][PGSE_SKETCH_VALUE_LEN];
+	pgseSketchValue     recent[PGSE_SKETCH_RECENT];
+	pg_atomic_uint64    counters[FLEXIBLE_ARRAY_MEMBER];    /* [dim][row][column] */
+} pgseSketch;
+
+#define pgse_sketch_counter(dim, row, column) \
+	(&pgse_sketch->counters[((dim) * PGSE_SKETCH_DEPTH + (row)) * pgse_sketch_width + (column)])
+
+/*
+ * State of the overhead governor.  The backends add the cost of the timed
+ * calls of the hook to their shard; the backend which closes a window, see
+ * pgse_governor_update(), sums and clears the shards and moves the tier.
+ */
+typedef struct pgseGovernor
+{
+	pg_atomic_uint32    tier;           /* pgseTier */
+	pg_atomic_uint64    window_start;   /* TimestampTz, 0 before the first error */
+	pg_atomic_uint64    transitions;    /* # of changes of tier */
+	pg_atomic_uint64    changed;        /* TimestampTz of the last change */
+	pg_atomic_uint64    cost;           /* mean cost of the hook in the last window, ns */
+	pg_atomic_uint64    tier_cost[PGSE_NUM_TIERS];  /* last mean cost by tier, ns */
+} pgseGovernor;
+
 /*
  * Global shared state
+ *
+ * The fields updated on every error come first, each in its own cache line
+ * (the shared memory is allocated at a cache line boundary), the rarely
+ * written fields follow.
  */
 typedef struct pgseSharedState
 {
+	pgseRingHead    eid;            /* head of the last errors */
+	pgseShard       shards[PGSE_NUM_SHARDS];    /* global counters */
 	LWLock          *lock;          /* protects hashtable search/modification */
+	LWLock          *topk_lock;     /* protects the heavy hitters */
+	LWLock          *history_lock;  /* protects the history */
+	LWLock          *function_lock; /* protects the errors by function */
+	LWLock          *relation_lock; /* protects the lock conflicts by relation */
+	LWLock          *message_lock;  /* protects the errors by message template */
 	slock_t         mutex;          /* protects following fields only: */
-	int64           total_errors;
-	int64           last_skipped;
-	pgseGlobalEID   eid;
-	pgseGlobalStats stats;          /* global statistics for pgse */
+	TimestampTz     stats_reset;    /* timestamp with all stats reset */
+	uint64          export_seqno;   /* last error written by the exporter,
+	                                 * owned by the background worker */
+	pgseRollups     rollups;        /* claiming of slots is protected by mutex */
+	pgseGovernor    governor;
 } pgseSharedState;
 
+/*
+ * Errors by function
+ *
+ * The errors are attributed to the innermost function in a procedural
+ * language executing when they occur.  The entries are evicted
+ * by the time of their last error, like the entries of pgse_hash.
+ */
+typedef struct pgseFunctionKey
+{
+	Oid             funcid;
+	Oid             dbid;
+	int             ecode;
+} pgseFunctionKey;
+
+typedef struct pgseFunction
+{
+	pgseFunctionKey key;            /* hash key of entry - MUST BE FIRST */
+	slock_t         mutex;          /* protects the counters only */
+	int64           errors;
+	TimestampTz     last_time;
+} pgseFunction;
+
+/*
+ * Errors by message template
+ *
+ * The key is the hash of the untranslated format string of the primary
+ * message, edata->message_id; the entry keeps the template and the first
+ * message rendered from it.  The entries are evicted by the time of their
+ * last error, like the entries of pgse_hash.
+ */
+typedef struct pgseMessageKey
+{
+	int             elevel;
+	int             ecode;
+	uint32          hash;           /* hash of message_id */
+} pgseMessageKey;
+
+typedef struct pgseMessage
+{
+	pgseMessageKey  key;            /* hash key of entry - MUST BE FIRST */
+	slock_t         mutex;          /* protects the counters only */
+	int64           errors;
+	TimestampTz     last_time;
+	char            message_id[PGSE_MESSAGE_LEN];   /* clipped template */
+	char            example[PGSE_MESSAGE_LEN];      /* clipped first message */
+} pgseMessage;
+
+/*
+ * Lock conflicts by relation
+ *
+ * They are rare, the entries are updated under an exclusive lock on
+ * pgse->relation_lock, without spinlock.
+ */
+typedef struct pgseRelationKey
+{
+	Oid             relid;
+	Oid             dbid;
+	int             ecode;
+} pgseRelationKey;
+
+typedef struct pgseRelation
+{
+	pgseRelationKey key;            /* hash key of entry - MUST BE FIRST */
+	int64           errors;
+	int64           waits;          /* # of errors with a known lock wait */
+	int64           wait_time;      /* total duration of the lock waits, in us */
+	TimestampTz     last_time;
+} pgseRelation;
+
+/*
+ * Copy of an entry made by pg_stat_errors()
+ */
+typedef struct pgseEntrySnapshot
+{
+	pgseHashKey     key;
+	Counters        counters;
+} pgseEntrySnapshot;
+
+/*
+ * Compiled filter of errors, see pgse_filter_check().
+ *
+ * Codes of errors are kept as a bitmap of classes and a sorted array of
+ * SQLSTATEs, databases and roles given as OIDs as sorted arrays.  Names of
+ * databases are matched against the session once per backend, names of
+ * roles are resolved into OIDs once per backend, at the end of a transaction
+ * as the error hook cannot look up the catalogs.
+ */
+typedef struct pgseFilter
+{
+	bool            has_codes;      /* any class or SQLSTATE is given */
+	uint32          levels;         /* bits of get_level_index() */
+	bits8           classes[PGSE_NUM_ECLASS / 8];
+	int             nsqlstates;
+	int             sqlstates[PGSE_FILTER_MAX_ITEMS];
+	int             ndatabases;
+	Oid             databases[PGSE_FILTER_MAX_ITEMS];
+	int             nroles;
+	Oid             roles[PGSE_FILTER_MAX_ITEMS];
+	int             ndbnames;
+	char            dbnames[PGSE_FILTER_MAX_ITEMS][NAMEDATALEN];
+	int             nrolenames;
+	char            rolenames[PGSE_FILTER_MAX_ITEMS][NAMEDATALEN];
+	/* backend local state of names */
+	bool            names_resolved;
+	bool            dbname_match;
+	bool            roles_resolved;
+	int             nroleids;
+	Oid             roleids[PGSE_FILTER_MAX_ITEMS];
+} pgseFilter;
+
+/*
+ * Compression of the queries of the last errors
+ */
+typedef enum
+{
+	PGSE_COMPRESSION_OFF,
+	PGSE_COMPRESSION_PGLZ,
+	PGSE_COMPRESSION_LZ4
+} pgseCompression;
+
+static const struct config_enum_entry pgse_compression_options[] =
+{
+	{"off", PGSE_COMPRESSION_OFF, false},
+	{"pglz", PGSE_COMPRESSION_PGLZ, false},
+#ifdef USE_LZ4
+	{"lz4", PGSE_COMPRESSION_LZ4, false},
+#endif
+	{NULL, 0, false}
+};
+
+/*
+ * Formats of the export files
+ */
+typedef enum
+{
+	PGSE_EXPORT_OFF,
+	PGSE_EXPORT_JSONL,
+	PGSE_EXPORT_CSV
+} pgseExportFormat;
+
+static const struct config_enum_entry pgse_export_options[] =
+{
+	{"off", PGSE_EXPORT_OFF, false},
+	{"jsonl", PGSE_EXPORT_JSONL, false},
+	{"csv", PGSE_EXPORT_CSV, false},
+	{NULL, 0, false}
+};
+
+/*
+ * Tiers of the overhead governor, from the most detailed capture to the
+ * cheapest one
+ */
+typedef enum
+{
+	PGSE_TIER_FULL,             /* everything */
+	PGSE_TIER_SAMPLED,          /* 1 in PGSE_GOVERNOR_LAST_SAMPLE last errors */
+	PGSE_TIER_COUNTERS,         /* no last errors */
+	PGSE_TIER_SHARDED           /* global counters and rollups only */
+} pgseTier;
+
+static const char *const pgse_tier_names[PGSE_NUM_TIERS] =
+{
+	"full",
+	"sampled",
+	"counters",
+	"sharded"
+};
+
 
 /*---- Local variables ----*/
 static bool sysinit = false;
@@ -153,19 +686,115 @@ static shmem_request_hook_type prev_shmem_request_hook = NULL;
 #endif
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static emit_log_hook_type prev_emit_log_hook = NULL;
+static needs_fmgr_hook_type prev_needs_fmgr_hook = NULL;
+static fmgr_hook_type prev_fmgr_hook = NULL;
 
 /* Links to shared memory state */
 static pgseSharedState *pgse = NULL;
 static HTAB *pgse_hash = NULL;
 static pgseEntryError *pgse_errors = NULL;
+static Size pgse_slot_size = 0;         /* size of a slot of pgse_errors */
+static pgseTopK *pgse_topk_state = NULL;
+static pgseSketch *pgse_sketch = NULL;
+static pgseHistory *pgse_history = NULL;
+static HTAB *pgse_functions = NULL;
+static HTAB *pgse_relations = NULL;
+static HTAB *pgse_messages = NULL;
+
+/* Subscribers of the error events of this process, see pg_stat_errors.h */
+typedef struct pgseSubscriber
+{
+	pgseSqlstateMask    mask;
+	pgse_error_callback callback;       /* NULL if the slot is free */
+	void                *arg;
+} pgseSubscriber;
+
+static pgseSubscriber subscribers[PGSE_MAX_SUBSCRIBERS];
+static int      num_subscribers = 0;    /* highest slot in use + 1 */
+static bool     in_subscribers = false;
+
+/* Stack of the executing functions of this backend */
+static Oid      function_stack[PGSE_FUNCTION_DEPTH];
+static int      function_depth = 0;
+static Oid      function_failed = InvalidOid;  /* innermost function aborted */
+
+/* # of calls of the hook seen by the governor in this backend */
+static uint64   governor_calls = 0;
+/* # of last errors seen in the sampled tier, not to draw from random() */
+static uint64   governor_last_calls = 0;
+static int32 *pgse_topk_heap = NULL;   /* min-heap of indexes of items by count */
+static HTAB *pgse_topk_hash = NULL;
 
 /*---- GUC variables ----*/
 static int      pgse_max;               /* max # errors type to track */
 static int      pgse_max_last;          /* max # of last errors */
+static int      pgse_max_per_database;  /* max # error types per database */
+static int      pgse_max_last_per_database; /* max # of last errors per database */
+static int      pgse_dedup_window;      /* # of slots searched for repeats */
+static int      pgse_topk;              /* # of tracked heavy hitters */
+static int      pgse_max_functions;     /* max # of tracked function errors */
+static int      pgse_max_relations;     /* max # of tracked relation lock conflicts */
+static int      pgse_max_messages;      /* max # of tracked message templates */
+static int      pgse_sketch_width;      /* columns of the count-min sketch */
+static int      pgse_query_max_len;     /* max length of query in last errors */
+static int      pgse_message_max_len;   /* max length of message in last errors */
+static int      pgse_query_compression; /* compression of queries in last errors */
 static bool     pgse_save;              /* whether to save stats across shutdown */
+static int      pgse_export;            /* format of the export files */
+static char    *pgse_export_directory;  /* directory of the export files */
+static int      pgse_export_rotation_size;  /* kB */
+static int      pgse_export_rotation_age;   /* minutes */
+static int      pgse_export_naptime;    /* ms */
+static bool     pgse_alerts;            /* whether to evaluate alert rules */
+static bool     pgse_history_enabled;   /* whether to keep the history */
+static bool     pgse_snapshot;          /* whether to write the snapshot file */
+static int      pgse_snapshot_naptime;  /* delay between snapshots, in ms */
+static int      pgse_governor_budget;   /* ms of CPU per second, 0 if off */
+static char    *pgse_alert_database;    /* database of the alert rules */
+static int      pgse_alert_naptime;     /* ms */
+static char    *pgse_include;           /* filters of the counters */
+static char    *pgse_exclude;
+static char    *pgse_include_last;      /* filters of the last errors */
+static char    *pgse_exclude_last;
+
+/* Compiled filters, NULL if not set */
+static pgseFilter *include_filter = NULL;
+static pgseFilter *exclude_filter = NULL;
+static pgseFilter *include_last_filter = NULL;
+static pgseFilter *exclude_last_filter = NULL;
+
+/* Backend local cache of the slots of rollups, stored as slot + 1 */
+static uint8    class_slots[PGSE_NUM_ECLASS];
+static int      db_slot = 0;
+static Oid      db_slot_dbid = InvalidOid;
+
+/*---- Background worker variables ----*/
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+/* the export file currently written by the background worker */
+static int          export_fd = -1;
+static pg_time_t    export_file_ctime = 0;
+static off_t        export_file_size = 0;
+
+/* the snapshot file mapped by the background worker */
+static pgseSnapshotFile *snapshot_file = NULL;
+
+/* the state of an alert rule, kept by the background worker between runs */
+typedef struct pgseAlertState
+{
+	char            rule_name[NAMEDATALEN];     /* hash key - MUST BE FIRST */
+	uint64          prev_errors;
+	TimestampTz     prev_time;
+	TimestampTz     breach_start;   /* 0 if the threshold is not exceeded */
+	bool            fired;          /* fired during the current breach */
+	bool            seen;           /* still present in the rules table */
+} pgseAlertState;
+
+static HTAB *alert_states = NULL;
 
-#define _snprintf(_str_dst, _str_src, _len, _max_len)\
-	memcpy((void *)_str_dst, _str_src, _len < _max_len ? _len : _max_len)
+#define pgse_error_slot(i) \
+	((pgseEntryError *) ((char *) pgse_errors + (Size) (i) * pgse_slot_size))
 
 #define isInitialized() \
 	( pgse && pgse_hash && pgse_errors && sysinit )
@@ -173,14 +802,22 @@ static bool     pgse_save;              /* whether to save stats across shutdown
 #define pgse_reset() \
 	do { \
 		volatile pgseSharedState *s = (volatile pgseSharedState *) pgse; \
+		int     shard; \
+		for (shard = 0; shard < PGSE_NUM_SHARDS; shard++) \
+		{ \
+			pg_atomic_write_u64(&pgse->shards[shard].c.total_errors, 0); \
+			pg_atomic_write_u64(&pgse->shards[shard].c.dealloc, 0); \
+			pg_atomic_write_u64(&pgse->shards[shard].c.query_raw_bytes, 0); \
+			pg_atomic_write_u64(&pgse->shards[shard].c.query_stored_bytes, 0); \
+			pg_atomic_write_u64(&pgse->shards[shard].c.compress_time, 0); \
+			pg_atomic_write_u64(&pgse->shards[shard].c.hook_cost, 0); \
+			pg_atomic_write_u64(&pgse->shards[shard].c.hook_samples, 0); \
+			pg_atomic_write_u64(&pgse->shards[shard].c.degraded, 0); \
+		} \
+		pg_atomic_write_u64(&pgse->eid.seqno, 0); \
+		pg_atomic_write_u64(&pgse->governor.transitions, 0); \
 		SpinLockAcquire(&s->mutex); \
-		s->last_skipped = 0; \
-		s->total_errors = 0; \
-		s->eid.curr_eid = 0; \
-		s->eid.next_eid = 0; \
-		s->eid.max_eid = 0; \
-		s->stats.dealloc = 0; \
-		s->stats.stats_reset = GetCurrentTimestamp(); \
+		s->stats_reset = GetCurrentTimestamp(); \
 		SpinLockRelease(&s->mutex); \
 	} while(0)
 
@@ -189,11 +826,32 @@ static bool     pgse_save;              /* whether to save stats across shutdown
 void _PG_init(void);
 void _PG_fini(void);
 
+PGDLLEXPORT void pgse_worker_main(Datum main_arg);
+
 PG_FUNCTION_INFO_V1(pg_stat_errors_reset);
 PG_FUNCTION_INFO_V1(pg_stat_errors);
 PG_FUNCTION_INFO_V1(pg_stat_errors_total_errors);
 PG_FUNCTION_INFO_V1(pg_stat_errors_info);
 PG_FUNCTION_INFO_V1(pg_stat_errors_last);
+PG_FUNCTION_INFO_V1(pg_stat_errors_topk);
+PG_FUNCTION_INFO_V1(pg_stat_errors_sketch);
+PG_FUNCTION_INFO_V1(pg_stat_errors_sketch_top);
+PG_FUNCTION_INFO_V1(pg_stat_errors_databases);
+PG_FUNCTION_INFO_V1(pg_stat_errors_by_class);
+PG_FUNCTION_INFO_V1(pg_stat_errors_by_level);
+PG_FUNCTION_INFO_V1(pg_stat_errors_by_database);
+PG_FUNCTION_INFO_V1(pg_stat_errors_history);
+PG_FUNCTION_INFO_V1(pg_stat_errors_functions);
+PG_FUNCTION_INFO_V1(pg_stat_errors_messages);
+PG_FUNCTION_INFO_V1(pg_stat_errors_relations);
+PG_FUNCTION_INFO_V1(pg_stat_errors_export);
+PG_FUNCTION_INFO_V1(pg_stat_errors_merge_accum);
+PG_FUNCTION_INFO_V1(pg_stat_errors_merge_combine);
+PG_FUNCTION_INFO_V1(pg_stat_errors_merge_serialize);
+PG_FUNCTION_INFO_V1(pg_stat_errors_merge_deserialize);
+PG_FUNCTION_INFO_V1(pg_stat_errors_merge_final);
+PG_FUNCTION_INFO_V1(pg_stat_errors_decode);
+PG_FUNCTION_INFO_V1(pg_stat_errors_decode_last);
 
 #if PG_VERSION_NUM >= 150000
 static void pgse_shmem_request(void);
@@ -202,16 +860,88 @@ static void pgse_shmem_startup(void);
 static void pgse_shmem_shutdown(int code, Datum arg);
 static void pgse_emit_log_hook(ErrorData *edata);
 
-#if PG_VERSION_NUM < 90600
-static uint32 pgse_hash_fn(const void *key, Size keysize);
-static int pgse_match_fn(const void *key1, const void *key2, Size keysize);
-#endif
+static Size get_slot_size(void);
+static int get_query_area(void);
+static const char *pack_query(ErrorInfo *error, const char *query, char *buf);
+static char *unpack_query(const pgseEntryError *slot, uint32 *len);
+static char *get_compress_buffer(void);
+static uint32 get_clipped_len(const char *str, int max_len);
+static Size get_topk_size(void);
+static Size get_sketch_size(void);
+static void sketch_reset(void);
+static void pgse_sketch_add_error(const ErrorData *edata);
+static void pgse_sketch_update_candidates(void);
+static void topk_reset(void);
+static bool pgse_needs_fmgr_hook(Oid fn_oid);
+static void pgse_fmgr_hook(FmgrHookEventType event, FmgrInfo *flinfo, Datum *private);
+static void pgse_xact_callback(XactEvent event, void *arg);
+static void pgse_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                  SubTransactionId parentSubid, void *arg);
+static Oid get_error_function(const ErrorData *edata);
+static void pgse_function_add(Oid funcid, Oid dbid, int ecode, TimestampTz etm);
+static void functions_reset(void);
+static void pgse_message_add(const pgseHashKey *ekey, const ErrorData *edata, TimestampTz etm);
+static void messages_reset(void);
+static int pgse_subscribe(const pgseSqlstateMask *mask, pgse_error_callback callback, void *arg);
+static void pgse_unsubscribe(int id);
+static void pgse_notify_subscribers(const TimestampTz etm, const pgseHashKey *key, const char *query,
+                                    const ErrorData *edata, bool counters, bool last);
+
+/* API for the other extensions */
+static pgseApi pgse_api = {
+	PGSE_API_VERSION,
+	pgse_subscribe,
+	pgse_unsubscribe
+};
+static bool is_lock_error(int ecode);
+static bool get_lock_info(const TimestampTz etm, const ErrorData *edata, pgseLockInfo *lock);
+static void pgse_relations_add(const pgseHashKey *key, const pgseLockInfo *lock, TimestampTz etm);
+static void relations_reset(void);
+static void pgse_topk_add(const pgseHashKey *key);
+static int64 get_statement_duration(const TimestampTz etm, const ErrorData *edata);
+static bool is_parallel_error(const ErrorData *edata);
+static uint32 get_num_last(uint64 seqno);
+static void init_error_slots(void);
+static pgseShard *get_shard(void);
+static void get_global_stats(uint64 *total_errors, pgseGlobalStats *stats);
 static Size pgse_memsize(void);
 static pgseEntry *entry_alloc(pgseHashKey *key);
 static void entry_dealloc(void);
+static void entry_dealloc_database(Oid dbid);
+static void entry_count_database(Oid dbid, int32 delta);
+static int rollup_find_database(Oid dbid);
+static int rollup_claim(int eclass, Oid dbid);
+static int rollup_get_database(Oid dbid);
+static bool last_quota_full(Oid dbid);
+static bool last_quota_replace(uint32 c_eid, uint64 seqno, ErrorInfo *error,
+                               const char *query, const char *message);
+static void last_quota_move(Oid old_dbid, Oid dbid);
+static void pgse_history_roll(void);
+static void history_reset(void);
+static void init_history(void);
+static void rollups_map(const pgseRollups *rollups, int *map);
+static void rollups_load(pgseRollups *rollups, const int *map);
+static void history_load(const int *map, const pgseHistory *loaded);
 static void entry_reset(void);
-static void pgse_store(const TimestampTz etime, const char *query, const ErrorData *edata);
-static void pgse_store_errorinfo(const ErrorInfo *eInfo);
+static void pgse_governor_update(TimestampTz etm);
+static void pgse_governor_add(instr_time start);
+static void pgse_store(const TimestampTz etime, const char *query, const ErrorData *edata,
+                       const pgseHashKey *key, bool counters, bool last, int tier);
+static void pgse_store_errorinfo(const ErrorInfo *eInfo, const char *query, const char *message);
+static uint32 get_error_hash(const ErrorInfo *error, const char *query, const char *message);
+static bool pgse_repeat_error(const ErrorInfo *error, const char *query, const char *message);
+static bool same_packed_query(const pgseEntryError *slot, uint64 seqno, const ErrorInfo *error,
+                              const char *query);
+static void pgse_export_errors(void);
+static void pgse_export_close(void);
+static void pgse_snapshot_write(void);
+static void pgse_evaluate_alerts(void);
+static int get_level_index(int elevel);
+static bool pgse_filter_check(char **newval, void **extra, GucSource source);
+static void pgse_include_assign(const char *newval, void *extra);
+static void pgse_exclude_assign(const char *newval, void *extra);
+static void pgse_include_last_assign(const char *newval, void *extra);
+static void pgse_exclude_last_assign(const char *newval, void *extra);
 
 
 /*
@@ -260,6 +990,161 @@ _PG_init(void)
 	                        NULL,
 	                        NULL);
 
+	DefineCustomIntVariable("pg_stat_errors.max_per_database",
+	                        "Sets the maximum number of error types of a database.",
+	                        "Zero disables the quota.",
+	                        &pgse_max_per_database,
+	                        0,
+	                        0,
+	                        INT_MAX,
+	                        PGC_SIGHUP,
+	                        0,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.max_last_per_database",
+	                        "Sets the maximum number of last errors of a database.",
+	                        "Zero disables the quota.",
+	                        &pgse_max_last_per_database,
+	                        0,
+	                        0,
+	                        MAX_LAST_ERRORS,
+	                        PGC_SIGHUP,
+	                        0,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.dedup_window",
+	                        "Sets the number of the latest errors searched for a repeat of a new error.",
+	                        "A repeated error updates the count of its slot instead of taking a new one. Zero disables it.",
+	                        &pgse_dedup_window,
+	                        0,
+	                        0,
+	                        64,
+	                        PGC_SIGHUP,
+	                        0,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.topk",
+	                        "Sets the number of heavy hitters tracked by query, user, database and error code.",
+	                        "Zero disables the tracking of heavy hitters.",
+	                        &pgse_topk,
+	                        0,
+	                        0,
+	                        PGSE_MAX_TOPK,
+	                        PGC_POSTMASTER,
+	                        0,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.max_functions",
+	                        "Sets the maximum number of functions and error codes tracked.",
+	                        "Zero disables the tracking of errors by function.",
+	                        &pgse_max_functions,
+	                        0,
+	                        0,
+	                        INT_MAX,
+	                        PGC_POSTMASTER,
+	                        0,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.max_messages",
+	                        "Sets the maximum number of message templates and error codes tracked.",
+	                        "Zero disables the tracking of errors by message template.",
+	                        &pgse_max_messages,
+	                        0,
+	                        0,
+	                        INT_MAX,
+	                        PGC_POSTMASTER,
+	                        0,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.max_relations",
+	                        "Sets the maximum number of relations and error codes of deadlocks tracked.",
+	                        "Zero disables the tracking of deadlocks by relation.",
+	                        &pgse_max_relations,
+	                        0,
+	                        0,
+	                        INT_MAX,
+	                        PGC_POSTMASTER,
+	                        0,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.sketch_width",
+	                        "Sets the width of the count-min sketch of errors by relation, constraint and client.",
+	                        "Zero disables the sketch.",
+	                        &pgse_sketch_width,
+	                        0,
+	                        0,
+	                        1024 * 1024,
+	                        PGC_POSTMASTER,
+	                        0,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.query_max_len",
+	                        "Sets the maximum length of the query kept in the last errors.",
+	                        NULL,
+	                        &pgse_query_max_len,
+	                        MAX_QUERY_LEN,
+	                        0,
+	                        64 * 1024,
+	                        PGC_POSTMASTER,
+	                        0,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.message_max_len",
+	                        "Sets the maximum length of the message kept in the last errors.",
+	                        NULL,
+	                        &pgse_message_max_len,
+	                        ERROR_MESSAGE_LEN,
+	                        16,
+	                        8 * 1024,
+	                        PGC_POSTMASTER,
+	                        0,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomEnumVariable("pg_stat_errors.query_compression",
+	                         "Selects the compression of the queries of the last errors.",
+	                         "The area of the query in a slot shrinks to a quarter of pg_stat_errors.query_max_len.",
+	                         &pgse_query_compression,
+	                         PGSE_COMPRESSION_OFF,
+	                         pgse_compression_options,
+	                         PGC_POSTMASTER,
+	                         0,
+	                         NULL,
+	                         NULL,
+	                         NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.governor_budget",
+	                        "Sets the CPU time the error hook may use per second before capturing less.",
+	                        "Zero disables the governor.",
+	                        &pgse_governor_budget,
+	                        0,
+	                        0,
+	                        INT_MAX,
+	                        PGC_SIGHUP,
+	                        GUC_UNIT_MS,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
 	DefineCustomBoolVariable("pg_stat_errors.save",
 	                         "Save pg_stat_errors statistics across server shutdowns.",
 	                         NULL,
@@ -271,38 +1156,251 @@ _PG_init(void)
 	                         NULL,
 	                         NULL);
 
-#if PG_VERSION_NUM >= 150000
-	MarkGUCPrefixReserved("pg_stat_errors");
-#else
-	EmitWarningsOnPlaceholders("pg_stat_errors");
-#endif
+	DefineCustomEnumVariable("pg_stat_errors.export",
+	                         "Selects the format of the files the last errors are exported to.",
+	                         NULL,
+	                         &pgse_export,
+	                         PGSE_EXPORT_OFF,
+	                         pgse_export_options,
+	                         PGC_POSTMASTER,
+	                         0,
+	                         NULL,
+	                         NULL,
+	                         NULL);
 
-	/*
-	 * Request additional shared resources.  (These are no-ops if we're not in
-	 * the postmaster process.). PG15 uses a shmem_request hook.
-	 * We'll allocate or attach to the shared resources in pgse_shmem_startup().
-	 */
-#if PG_VERSION_NUM < 150000
-	RequestAddinShmemSpace(pgse_memsize());
-#if PG_VERSION_NUM >= 90600
-	RequestNamedLWLockTranche("pg_stat_errors", 1);
-#else
-	RequestAddinLWLocks(1);
-#endif
-#endif /* up to PG15 */
+	DefineCustomStringVariable("pg_stat_errors.export_directory",
+	                           "Sets the directory of the export files, relative to the data directory.",
+	                           NULL,
+	                           &pgse_export_directory,
+	                           "pg_stat_errors",
+	                           PGC_POSTMASTER,
+	                           0,
+	                           NULL,
+	                           NULL,
+	                           NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.export_rotation_size",
+	                        "Automatic export file rotation will occur after N kilobytes.",
+	                        NULL,
+	                        &pgse_export_rotation_size,
+	                        10 * 1024,
+	                        0,
+	                        INT_MAX / 1024,
+	                        PGC_SIGHUP,
+	                        GUC_UNIT_KB,
+	                        NULL,
+	                        NULL,
+	                        NULL);
 
-	/*
-	 * Install hooks.
-	 */
-#if PG_VERSION_NUM >= 150000
-        prev_shmem_request_hook = shmem_request_hook;
-        shmem_request_hook = pgse_shmem_request;
-#endif
-	prev_shmem_startup_hook = shmem_startup_hook;
+	DefineCustomIntVariable("pg_stat_errors.export_rotation_age",
+	                        "Automatic export file rotation will occur after N minutes.",
+	                        NULL,
+	                        &pgse_export_rotation_age,
+	                        60,
+	                        0,
+	                        INT_MAX / SECS_PER_MINUTE,
+	                        PGC_SIGHUP,
+	                        GUC_UNIT_MIN,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.export_naptime",
+	                        "Sets the delay between the exports of the last errors.",
+	                        NULL,
+	                        &pgse_export_naptime,
+	                        1000,
+	                        10,
+	                        INT_MAX,
+	                        PGC_SIGHUP,
+	                        GUC_UNIT_MS,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomBoolVariable("pg_stat_errors.history",
+	                         "Keep a history of errors by class and database, by minute and by hour.",
+	                         NULL,
+	                         &pgse_history_enabled,
+	                         false,
+	                         PGC_POSTMASTER,
+	                         0,
+	                         NULL,
+	                         NULL,
+	                         NULL);
+
+	DefineCustomBoolVariable("pg_stat_errors.snapshot",
+	                         "Publish the statistics into a snapshot file for the monitoring agents.",
+	                         NULL,
+	                         &pgse_snapshot,
+	                         false,
+	                         PGC_POSTMASTER,
+	                         0,
+	                         NULL,
+	                         NULL,
+	                         NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.snapshot_naptime",
+	                        "Sets the delay between the snapshots of the statistics.",
+	                        NULL,
+	                        &pgse_snapshot_naptime,
+	                        1000,
+	                        10,
+	                        INT_MAX,
+	                        PGC_SIGHUP,
+	                        GUC_UNIT_MS,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomBoolVariable("pg_stat_errors.alerts",
+	                         "Evaluate the alert rules in the background worker.",
+	                         NULL,
+	                         &pgse_alerts,
+	                         false,
+	                         PGC_POSTMASTER,
+	                         0,
+	                         NULL,
+	                         NULL,
+	                         NULL);
+
+	DefineCustomStringVariable("pg_stat_errors.alert_database",
+	                           "Sets the database which holds the alert rules.",
+	                           NULL,
+	                           &pgse_alert_database,
+	                           "postgres",
+	                           PGC_POSTMASTER,
+	                           0,
+	                           NULL,
+	                           NULL,
+	                           NULL);
+
+	DefineCustomIntVariable("pg_stat_errors.alert_naptime",
+	                        "Sets the delay between the evaluations of the alert rules.",
+	                        NULL,
+	                        &pgse_alert_naptime,
+	                        1000,
+	                        100,
+	                        INT_MAX,
+	                        PGC_SIGHUP,
+	                        GUC_UNIT_MS,
+	                        NULL,
+	                        NULL,
+	                        NULL);
+
+	DefineCustomStringVariable("pg_stat_errors.include",
+	                           "Errors counted by pg_stat_errors, all if empty.",
+	                           NULL,
+	                           &pgse_include,
+	                           "",
+	                           PGC_SIGHUP,
+	                           GUC_LIST_INPUT,
+	                           pgse_filter_check,
+	                           pgse_include_assign,
+	                           NULL);
+
+	DefineCustomStringVariable("pg_stat_errors.exclude",
+	                           "Errors not counted by pg_stat_errors.",
+	                           NULL,
+	                           &pgse_exclude,
+	                           "",
+	                           PGC_SIGHUP,
+	                           GUC_LIST_INPUT,
+	                           pgse_filter_check,
+	                           pgse_exclude_assign,
+	                           NULL);
+
+	DefineCustomStringVariable("pg_stat_errors.include_last",
+	                           "Errors kept in the last errors, all if empty.",
+	                           NULL,
+	                           &pgse_include_last,
+	                           "",
+	                           PGC_SIGHUP,
+	                           GUC_LIST_INPUT,
+	                           pgse_filter_check,
+	                           pgse_include_last_assign,
+	                           NULL);
+
+	DefineCustomStringVariable("pg_stat_errors.exclude_last",
+	                           "Errors not kept in the last errors.",
+	                           NULL,
+	                           &pgse_exclude_last,
+	                           "",
+	                           PGC_SIGHUP,
+	                           GUC_LIST_INPUT,
+	                           pgse_filter_check,
+	                           pgse_exclude_last_assign,
+	                           NULL);
+
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("pg_stat_errors");
+#else
+	EmitWarningsOnPlaceholders("pg_stat_errors");
+#endif
+
+	/*
+	 * Request additional shared resources.  (These are no-ops if we're not in
+	 * the postmaster process.). PG15 uses a shmem_request hook.
+	 * We'll allocate or attach to the shared resources in pgse_shmem_startup().
+	 */
+#if PG_VERSION_NUM < 150000
+	RequestAddinShmemSpace(pgse_memsize());
+	RequestNamedLWLockTranche("pg_stat_errors", PGSE_NUM_LOCKS);
+#endif /* up to PG15 */
+
+	/*
+	 * Install hooks.
+	 */
+#if PG_VERSION_NUM >= 150000
+        prev_shmem_request_hook = shmem_request_hook;
+        shmem_request_hook = pgse_shmem_request;
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = pgse_shmem_startup;
 	prev_emit_log_hook = emit_log_hook;
 	emit_log_hook = pgse_emit_log_hook;
 
+	/* the API for the other extensions, see pg_stat_errors.h */
+	*find_rendezvous_variable(PGSE_API_RENDEZVOUS) = &pgse_api;
+	RegisterXactCallback(pgse_xact_callback, NULL);
+	if (pgse_max_functions > 0)
+	{
+		prev_needs_fmgr_hook = needs_fmgr_hook;
+		needs_fmgr_hook = pgse_needs_fmgr_hook;
+		prev_fmgr_hook = fmgr_hook;
+		fmgr_hook = pgse_fmgr_hook;
+		RegisterSubXactCallback(pgse_subxact_callback, NULL);
+	}
+
+	/*
+	 * Register the background worker which writes the last errors into
+	 * files, evaluates the alert rules, maintains the candidates of the
+	 * sketch, publishes the snapshot file and moves the tier of the governor
+	 * when no error does.  The backends never touch the files nor the rules
+	 * themselves.
+	 */
+	if (pgse_export != PGSE_EXPORT_OFF || pgse_alerts || pgse_sketch_width > 0 ||
+	    pgse_history_enabled || pgse_snapshot || pgse_governor_budget > 0)
+	{
+		BackgroundWorker worker;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		if (pgse_alerts)
+			worker.bgw_flags |= BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = 10;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_stat_errors");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgse_worker_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_stat_errors worker");
+#if PG_VERSION_NUM >= 110000
+		snprintf(worker.bgw_type, BGW_MAXLEN, "pg_stat_errors worker");
+#endif
+		worker.bgw_main_arg = (Datum) 0;
+		worker.bgw_notify_pid = 0;
+		RegisterBackgroundWorker(&worker);
+	}
+
 	sysinit = true;
 }
 
@@ -321,6 +1419,14 @@ _PG_fini(void)
 #endif
 	shmem_startup_hook = prev_shmem_startup_hook;
 	emit_log_hook = prev_emit_log_hook;
+	*find_rendezvous_variable(PGSE_API_RENDEZVOUS) = NULL;
+	UnregisterXactCallback(pgse_xact_callback, NULL);
+	if (pgse_max_functions > 0)
+	{
+		needs_fmgr_hook = prev_needs_fmgr_hook;
+		fmgr_hook = prev_fmgr_hook;
+		UnregisterSubXactCallback(pgse_subxact_callback, NULL);
+	}
 }
 
 /*
@@ -335,7 +1441,7 @@ pgse_shmem_request(void)
                 prev_shmem_request_hook();
 
         RequestAddinShmemSpace(pgse_memsize());
-        RequestNamedLWLockTranche("pg_stat_errors", 1);
+        RequestNamedLWLockTranche("pg_stat_errors", PGSE_NUM_LOCKS);
 }
 #endif
 
@@ -353,6 +1459,11 @@ pgse_shmem_startup(void)
 	uint32          pgver;
 	int32           i, num;
 	uint32          j, num_last;
+	uint32          has_history;
+	uint64          total_errors;
+	pgseGlobalStats stats;
+	pgseRollups     *rollups;
+	int             map[PGSE_HISTORY_SERIES];
 
 	if (prev_shmem_startup_hook)
 		prev_shmem_startup_hook();
@@ -361,6 +1472,14 @@ pgse_shmem_startup(void)
 	pgse = NULL;
 	pgse_hash = NULL;
 	pgse_errors = NULL;
+	pgse_topk_state = NULL;
+	pgse_history = NULL;
+	pgse_functions = NULL;
+	pgse_relations = NULL;
+	pgse_messages = NULL;
+	pgse_topk_hash = NULL;
+	pgse_sketch = NULL;
+	pgse_topk_heap = NULL;
 
 	/*
 	 * Create or attach to the shared memory state, including hash table
@@ -374,43 +1493,173 @@ pgse_shmem_startup(void)
 	if (!found)
 	{
 		/* First time through ... */
-#if PG_VERSION_NUM >= 90600
-		pgse->lock = &(GetNamedLWLockTranche("pg_stat_errors"))->lock;
-#else
-		pgse->lock = LWLockAssign();
-#endif
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_stat_errors");
+
+		pgse->lock = &locks[0].lock;
+		pgse->topk_lock = &locks[1].lock;
+		pgse->history_lock = &locks[2].lock;
+		pgse->function_lock = &locks[3].lock;
+		pgse->relation_lock = &locks[4].lock;
+		pgse->message_lock = &locks[5].lock;
 		SpinLockInit(&pgse->mutex);
+		{
+			int     shard;
+
+			for (shard = 0; shard < PGSE_NUM_SHARDS; shard++)
+			{
+				pg_atomic_init_u64(&pgse->shards[shard].c.total_errors, 0);
+				pg_atomic_init_u64(&pgse->shards[shard].c.dealloc, 0);
+				pg_atomic_init_u64(&pgse->shards[shard].c.query_raw_bytes, 0);
+				pg_atomic_init_u64(&pgse->shards[shard].c.query_stored_bytes, 0);
+				pg_atomic_init_u64(&pgse->shards[shard].c.compress_time, 0);
+				pg_atomic_init_u64(&pgse->shards[shard].c.hook_cost, 0);
+				pg_atomic_init_u64(&pgse->shards[shard].c.hook_samples, 0);
+				pg_atomic_init_u64(&pgse->shards[shard].c.degraded, 0);
+			}
+			pg_atomic_init_u64(&pgse->eid.seqno, 0);
+		}
+		{
+			int     t;
+
+			pg_atomic_init_u32(&pgse->governor.tier, PGSE_TIER_FULL);
+			pg_atomic_init_u64(&pgse->governor.window_start, 0);
+			pg_atomic_init_u64(&pgse->governor.transitions, 0);
+			pg_atomic_init_u64(&pgse->governor.changed, 0);
+			pg_atomic_init_u64(&pgse->governor.cost, 0);
+			for (t = 0; t < PGSE_NUM_TIERS; t++)
+				pg_atomic_init_u64(&pgse->governor.tier_cost[t], 0);
+		}
 		pgse_reset();
+		pgse->export_seqno = 0;
+
+		memset(&pgse->rollups, 0, sizeof(pgseRollups));
+		{
+			int     l, c, d;
+
+			for (l = 0; l < PGSE_NUM_LEVELS; l++)
+				for (c = 0; c < PGSE_MAX_CLASSES; c++)
+					pg_atomic_init_u64(&pgse->rollups.class_errors[l][c], 0);
+			for (d = 0; d < PGSE_MAX_DATABASES; d++)
+			{
+				for (l = 0; l < PGSE_NUM_LEVELS; l++)
+					pg_atomic_init_u64(&pgse->rollups.db_errors[d][l], 0);
+				pg_atomic_init_u32(&pgse->rollups.db_entries[d], 0);
+				pg_atomic_init_u32(&pgse->rollups.db_last[d], 0);
+				pg_atomic_init_u64(&pgse->rollups.db_evicted[d], 0);
+				pg_atomic_init_u64(&pgse->rollups.db_last_replaced[d], 0);
+			}
+			for (l = 0; l < PGSE_NUM_LEVELS; l++)
+			{
+				pg_atomic_init_u64(&pgse->rollups.level_errors[l], 0);
+				pg_atomic_init_u64(&pgse->rollups.class_other_errors[l], 0);
+				pg_atomic_init_u64(&pgse->rollups.db_other_errors[l], 0);
+			}
+		}
 	}
 
 	memset(&info, 0, sizeof(info));
 	info.keysize = sizeof(pgseHashKey);
 	info.entrysize = sizeof(pgseEntry);
-#if PG_VERSION_NUM < 90600
-	info.hash = pgse_hash_fn;
-	info.match = pgse_match_fn;
-
 	pgse_hash = ShmemInitHash("pg_stat_errors hash",
 	                          pgse_max, pgse_max,
 	                          &info,
-	                          HASH_ELEM | HASH_FUNCTION | HASH_COMPARE);
-#else
-        pgse_hash = ShmemInitHash("pg_stat_errors hash",
-                                  pgse_max, pgse_max,
-                                  &info,
-                                  HASH_ELEM | HASH_BLOBS);
-#endif
+	                          HASH_ELEM | HASH_BLOBS);
 	{
-		int arr_size = sizeof(pgseEntryError) * pgse_max_last;
+		Size arr_size = mul_size(get_slot_size(), pgse_max_last);
+		char *arr;
 
 		/*
 		 * To delimit access to the array, a lock pgse->lock from the
 		 * pgseSharedState structure is used
 		 */
-		pgse_errors = ShmemInitStruct("pg_stat_errors last", arr_size, &found);
+		arr = ShmemInitStruct("pg_stat_errors last", add_size(arr_size, PG_CACHE_LINE_SIZE), &found);
+
+		/* The slots start at a cache line boundary */
+		pgse_slot_size = get_slot_size();
+		pgse_errors = (pgseEntryError *) TYPEALIGN(PG_CACHE_LINE_SIZE, arr);
 
 		/* Mark array as empty */
-		memset(pgse_errors, 0, arr_size);
+		if (!found)
+			init_error_slots();
+	}
+
+	if (pgse_topk > 0)
+	{
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgseTopKKey);
+		info.entrysize = sizeof(pgseTopKSlot);
+		pgse_topk_hash = ShmemInitHash("pg_stat_errors topk hash",
+		                               pgse_topk, pgse_topk,
+		                               &info,
+		                               HASH_ELEM | HASH_BLOBS);
+
+		pgse_topk_state = ShmemInitStruct("pg_stat_errors topk", get_topk_size(), &found);
+		if (!found)
+		{
+			pgse_topk_state->nitems = 0;
+			pg_atomic_init_u32(&pgse_topk_state->dirty, 0);
+		}
+
+		/* the heap follows the items */
+		pgse_topk_heap = (int32 *) &pgse_topk_state->items[pgse_topk];
+	}
+
+	if (pgse_max_functions > 0)
+	{
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgseFunctionKey);
+		info.entrysize = sizeof(pgseFunction);
+		pgse_functions = ShmemInitHash("pg_stat_errors functions hash",
+		                               pgse_max_functions, pgse_max_functions,
+		                               &info,
+		                               HASH_ELEM | HASH_BLOBS);
+	}
+
+	if (pgse_max_relations > 0)
+	{
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgseRelationKey);
+		info.entrysize = sizeof(pgseRelation);
+		pgse_relations = ShmemInitHash("pg_stat_errors relations hash",
+		                               pgse_max_relations, pgse_max_relations,
+		                               &info,
+		                               HASH_ELEM | HASH_BLOBS);
+	}
+
+	if (pgse_max_messages > 0)
+	{
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pgseMessageKey);
+		info.entrysize = sizeof(pgseMessage);
+		pgse_messages = ShmemInitHash("pg_stat_errors messages hash",
+		                              pgse_max_messages, pgse_max_messages,
+		                              &info,
+		                              HASH_ELEM | HASH_BLOBS);
+	}
+
+	if (pgse_sketch_width > 0)
+	{
+		pgse_sketch = ShmemInitStruct("pg_stat_errors sketch", get_sketch_size(), &found);
+		if (!found)
+		{
+			Size    ncounters = (Size) PGSE_SKETCH_DIMS * PGSE_SKETCH_DEPTH * pgse_sketch_width;
+			Size    c;
+
+			memset(pgse_sketch, 0, offsetof(pgseSketch, counters));
+			pg_atomic_init_u64(&pgse_sketch->head, 0);
+			SpinLockInit(&pgse_sketch->mutex);
+			for (i = 0; i < PGSE_SKETCH_RECENT; i++)
+				SpinLockInit(&pgse_sketch->recent[i].mutex);
+			for (c = 0; c < ncounters; c++)
+				pg_atomic_init_u64(&pgse_sketch->counters[c], 0);
+		}
+	}
+
+	if (pgse_history_enabled)
+	{
+		pgse_history = ShmemInitStruct("pg_stat_errors history", sizeof(pgseHistory), &found);
+		if (!found)
+			init_history();
 	}
 
 	LWLockRelease(AddinShmemInitLock);
@@ -448,7 +1697,7 @@ pgse_shmem_startup(void)
 
 	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
 	    fread(&pgver, sizeof(uint32), 1, file) != 1 ||
-	    fread(&(pgse->total_errors), sizeof(uint64), 1, file) != 1 ||
+	    fread(&total_errors, sizeof(uint64), 1, file) != 1 ||
 	    fread(&num, sizeof(int32), 1, file) != 1
 	   )
 		goto read_error;
@@ -479,10 +1728,14 @@ pgse_shmem_startup(void)
 			entry->counters = temp.counters;
 	}
 
-	/* Read global statistics for pg_stat_errors */
-	if (fread(&pgse->stats, sizeof(pgseGlobalStats), 1, file) != 1)
+	/* Read global statistics for pg_stat_errors, into the first shard */
+	if (fread(&stats, sizeof(pgseGlobalStats), 1, file) != 1)
 		goto read_error;
 
+	pg_atomic_write_u64(&pgse->shards[0].c.total_errors, total_errors);
+	pg_atomic_write_u64(&pgse->shards[0].c.dealloc, stats.dealloc);
+	pgse->stats_reset = stats.stats_reset;
+
 	/* load last errors */
 	if (fread(&num_last, sizeof(uint32), 1, file) != 1)
 		goto read_error;
@@ -490,13 +1743,58 @@ pgse_shmem_startup(void)
 	for (j = 0; j < num_last; j++)
 	{
 		ErrorInfo   temp;
+		char        *query;
+		char        *message;
 
 		if (fread(&temp, sizeof(ErrorInfo), 1, file) != 1)
 			goto read_error;
 
-		pgse_store_errorinfo(&temp);
+		/* the lengths may have been changed since the dump */
+		query = palloc(temp.query_len + 1);
+		message = palloc(temp.message_len + 1);
+
+		if (fread(query, 1, temp.query_len, file) != temp.query_len ||
+		    fread(message, 1, temp.message_len, file) != temp.message_len)
+			goto read_error;
+		query[temp.query_len] = '\0';
+		message[temp.message_len] = '\0';
+
+		pgse_store_errorinfo(&temp, query, message);
+
+		pfree(query);
+		pfree(message);
 	}
 
+	/* the loaded errors have already been exported before the shutdown */
+	pgse->export_seqno = pg_atomic_read_u64(&pgse->eid.seqno);
+
+	/* load the rollups, after the entries and the last errors held */
+	rollups = palloc(sizeof(pgseRollups));
+	if (fread(rollups, sizeof(pgseRollups), 1, file) != 1)
+		goto read_error;
+	if (rollups->nclasses < 0 || rollups->nclasses > PGSE_MAX_CLASSES ||
+	    rollups->ndatabases < 0 || rollups->ndatabases > PGSE_MAX_DATABASES)
+		goto data_error;
+
+	rollups_map(rollups, map);
+	rollups_load(rollups, map);
+	pfree(rollups);
+
+	/* load the history, even if it is not kept anymore to check the file */
+	if (fread(&has_history, sizeof(uint32), 1, file) != 1)
+		goto read_error;
+	if (has_history)
+	{
+		pgseHistory *history = palloc(sizeof(pgseHistory));
+
+		if (fread(history, sizeof(pgseHistory), 1, file) != 1)
+			goto read_error;
+
+		if (pgse_history)
+			history_load(map, history);
+
+		pfree(history);
+	}
 
 	FreeFile(file);
 
@@ -541,7 +1839,11 @@ pgse_shmem_shutdown(int code, Datum arg)
 	FILE             *file;
 	HASH_SEQ_STATUS  hash_seq;
 	int32            num_entries;
-	uint32           j, num_last, rbuf_indx;
+	uint32           j, num_last;
+	uint32           has_history;
+	uint64           seqno;
+	uint64           total_errors;
+	pgseGlobalStats  stats;
 	pgseEntry        *entry;
 
 	/* Don't try to dump during a crash. */
@@ -563,7 +1865,8 @@ pgse_shmem_shutdown(int code, Datum arg)
 		goto error;
 	if (fwrite(&PGSE_PG_MAJOR_VERSION, sizeof(uint32), 1, file) != 1)
 		goto error;
-	if (fwrite(&(pgse->total_errors), sizeof(uint64), 1, file) != 1)
+	get_global_stats(&total_errors, &stats);
+	if (fwrite(&total_errors, sizeof(uint64), 1, file) != 1)
 		goto error;
 
 	/* save statistics of errors */
@@ -583,34 +1886,44 @@ pgse_shmem_shutdown(int code, Datum arg)
 	}
 
 	/* Dump global statistics for pg_stat_errors */
-	if (fwrite(&pgse->stats, sizeof(pgseGlobalStats), 1, file) != 1)
+	if (fwrite(&stats, sizeof(pgseGlobalStats), 1, file) != 1)
 		goto error;
 
 	/* save last errors */
-	num_last = pgse->eid.max_eid;
+	seqno = pg_atomic_read_u64(&pgse->eid.seqno);
+	num_last = get_num_last(seqno);
 	if (fwrite(&num_last, sizeof(uint32), 1, file) != 1)
 		goto error;
 
 	/* store the latest errors in the order of occurrence */
-	if ( (pgse->eid.max_eid != pgse_max_last) ||
-	     (  (pgse->eid.max_eid == pgse_max_last) &&
-	        ((pgse->eid.curr_eid + 1) == pgse->eid.max_eid)  )
-	   )
-		rbuf_indx = 0;
-	else
-		rbuf_indx = pgse->eid.curr_eid + 1;
-
-	for (j=0; j<num_last; j++)
+	for (seqno = seqno - num_last + 1, j = 0; j < num_last; seqno++, j++)
 	{
-		if (fwrite(&pgse_errors[rbuf_indx].error, sizeof(ErrorInfo), 1, file) != 1)
+		pgseEntryError *e = pgse_error_slot((seqno - 1) % pgse_max_last);
+		ErrorInfo   error = e->error;
+		char        *query;
+
+		/* the queries are saved uncompressed */
+		query = unpack_query(e, &error.query_len);
+		error.query_raw_len = error.query_len;
+		error.query_method = PGSE_COMPRESSION_OFF;
+
+		if (fwrite(&error, sizeof(ErrorInfo), 1, file) != 1 ||
+		    fwrite(query, 1, error.query_len, file) != error.query_len ||
+		    fwrite(pgse_error_message(e), 1, error.message_len, file) != error.message_len)
 			goto error;
-
-		rbuf_indx++;
-
-		if (rbuf_indx >= pgse_max_last)
-			rbuf_indx = 0;
 	}
 
+	/* save the rollups, their slots also name the series of the history */
+	if (fwrite(&pgse->rollups, sizeof(pgseRollups), 1, file) != 1)
+		goto error;
+
+	/* save the history */
+	has_history = (pgse_history != NULL);
+	if (fwrite(&has_history, sizeof(uint32), 1, file) != 1)
+		goto error;
+	if (has_history &&
+	    fwrite(pgse_history, sizeof(pgseHistory), 1, file) != 1)
+		goto error;
 
 	if (FreeFile(file))
 	{
@@ -618,21 +1931,10 @@ pgse_shmem_shutdown(int code, Datum arg)
 		goto error;
 	}
 
-#if PG_VERSION_NUM >= 90407
 	/*
 	 * Rename file into place, so we atomically replace any old one.
 	 */
 	(void) durable_rename(PGSE_DUMP_FILE ".tmp", PGSE_DUMP_FILE, LOG);
-#else
-	/*
-	 * Rename file inplace
-	 */
-	if (rename(PGSE_DUMP_FILE ".tmp", PGSE_DUMP_FILE) != 0)
-		ereport(LOG,
-		        (errcode_for_file_access(),
-		         errmsg("could not rename pg_stat_errors file \"%s\": %m",
-		                        PGSE_DUMP_FILE ".tmp")));
-#endif
 
 	return;
 
@@ -648,743 +1950,6739 @@ error:
 
 
 /*
- * Error hook.
+ * Comparator of int and Oid values for qsort and bsearch
  */
-void
-pgse_emit_log_hook(ErrorData *edata)
+static int
+filter_cmp_int(const void *a, const void *b)
 {
-	if ( !isInitialized() || !edata )
-		goto exit;
+	int     l = *(const int *) a;
+	int     r = *(const int *) b;
 
-	if (edata->elevel >= WARNING)
-	{
-		pgse_store(GetCurrentTimestamp(), 
-		           debug_query_string ? debug_query_string : "",
-		           edata);
-	}
-exit:
-	if (prev_emit_log_hook)
-		prev_emit_log_hook(edata);
+	return (l > r) - (l < r);
+}
+
+static int
+filter_cmp_oid(const void *a, const void *b)
+{
+	Oid     l = *(const Oid *) a;
+	Oid     r = *(const Oid *) b;
+
+	return (l > r) - (l < r);
 }
 
 
-#if PG_VERSION_NUM < 90600
 /*
- * Calculate hash value for a key
+ * Check hook of the filters: parse the list and compile it.
+ *
+ * The list items are "sqlstate:XXXXX", "class:XX", "level:name",
+ * "database:name-or-oid" and "role:name-or-oid".  A bare five-character
+ * item is a SQLSTATE and a bare two-character item is a class.
  */
-static uint32
-pgse_hash_fn(const void *key, Size keysize)
+static bool
+pgse_filter_check(char **newval, void **extra, GucSource source)
+{
+	pgseFilter  *f;
+	char        *rawstring;
+	char        *item;
+	char        *next;
+	bool        empty = true;
+
+	if (*newval == NULL)
+		return true;
+
+#if PG_VERSION_NUM >= 160000
+	f = (pgseFilter *) guc_malloc(LOG, sizeof(pgseFilter));
+#else
+	f = (pgseFilter *) malloc(sizeof(pgseFilter));
+#endif
+	if (f == NULL)
+		return false;
+	memset(f, 0, sizeof(pgseFilter));
+
+	rawstring = pstrdup(*newval);
+
+	for (item = rawstring; item != NULL; item = next)
+	{
+		char    *kind = NULL;
+		char    *value;
+		char    *colon;
+		char    *end;
+		int     len;
+
+		next = strchr(item, ',');
+		if (next)
+			*next++ = '\0';
+
+		/* trim the item */
+		while (isspace((unsigned char) *item))
+			item++;
+		end = item + strlen(item);
+		while (end > item && isspace((unsigned char) end[-1]))
+			*--end = '\0';
+
+		if (*item == '\0')
+			continue;
+		empty = false;
+
+		colon = strchr(item, ':');
+		if (colon)
+		{
+			*colon = '\0';
+			kind = item;
+			value = colon + 1;
+			while (isspace((unsigned char) *value))
+				value++;
+		}
+		else
+			value = item;
+		len = strlen(value);
+
+		if (kind == NULL)
+			kind = (len == 2) ? "class" : "sqlstate";
+
+		if (pg_strcasecmp(kind, "sqlstate") == 0 || pg_strcasecmp(kind, "class") == 0)
+		{
+			bool    is_class = (pg_strcasecmp(kind, "class") == 0);
+			int     i;
+
+			if (len != (is_class ? 2 : 5))
+				goto bad_item;
+			for (i = 0; i < len; i++)
+			{
+				value[i] = pg_ascii_toupper((unsigned char) value[i]);
+				if (!isdigit((unsigned char) value[i]) && !isupper((unsigned char) value[i]))
+					goto bad_item;
+			}
+
+			if (is_class)
+			{
+				int     eclass = MAKE_SQLSTATE(value[0], value[1], '0', '0', '0');
+
+				f->classes[eclass / 8] |= (1 << (eclass % 8));
+			}
+			else
+			{
+				if (f->nsqlstates >= PGSE_FILTER_MAX_ITEMS)
+					goto too_many;
+				f->sqlstates[f->nsqlstates++] = MAKE_SQLSTATE(value[0], value[1], value[2], value[3], value[4]);
+			}
+			f->has_codes = true;
+		}
+		else if (pg_strcasecmp(kind, "level") == 0)
+		{
+			int     level;
+
+			if (pg_strcasecmp(value, "warning") == 0)
+				level = get_level_index(WARNING);
+			else if (pg_strcasecmp(value, "error") == 0)
+				level = get_level_index(ERROR);
+			else if (pg_strcasecmp(value, "fatal") == 0)
+				level = get_level_index(FATAL);
+			else if (pg_strcasecmp(value, "panic") == 0)
+				level = get_level_index(PANIC);
+			else
+				goto bad_item;
+
+			f->levels |= (1 << level);
+		}
+		else if (pg_strcasecmp(kind, "database") == 0 || pg_strcasecmp(kind, "role") == 0)
+		{
+			bool    is_db = (pg_strcasecmp(kind, "database") == 0);
+			char    *endptr;
+			unsigned long oid;
+
+			if (len == 0 || len >= NAMEDATALEN)
+				goto bad_item;
+
+			errno = 0;
+			oid = strtoul(value, &endptr, 10);
+			if (*endptr == '\0' && errno == 0 && oid <= PG_UINT32_MAX)
+			{
+				int     *n = is_db ? &f->ndatabases : &f->nroles;
+
+				if (*n >= PGSE_FILTER_MAX_ITEMS)
+					goto too_many;
+				if (is_db)
+					f->databases[(*n)++] = (Oid) oid;
+				else
+					f->roles[(*n)++] = (Oid) oid;
+			}
+			else
+			{
+				int     *n = is_db ? &f->ndbnames : &f->nrolenames;
+
+				if (*n >= PGSE_FILTER_MAX_ITEMS)
+					goto too_many;
+				if (is_db)
+					strlcpy(f->dbnames[(*n)++], value, NAMEDATALEN);
+				else
+					strlcpy(f->rolenames[(*n)++], value, NAMEDATALEN);
+			}
+		}
+		else
+			goto bad_item;
+
+		continue;
+
+bad_item:
+		GUC_check_errdetail("Invalid item \"%s%s%s\".",
+		                    colon ? kind : "", colon ? ":" : "", value);
+		goto fail;
+too_many:
+		GUC_check_errdetail("Too many items of kind \"%s\", the maximum is %d.",
+		                    kind, PGSE_FILTER_MAX_ITEMS);
+		goto fail;
+	}
+
+	pfree(rawstring);
+
+	/* an empty list means no filter at all */
+	if (empty)
+	{
+#if PG_VERSION_NUM >= 160000
+		guc_free(f);
+#else
+		free(f);
+#endif
+		*extra = NULL;
+		return true;
+	}
+
+	qsort(f->sqlstates, f->nsqlstates, sizeof(int), filter_cmp_int);
+	qsort(f->databases, f->ndatabases, sizeof(Oid), filter_cmp_oid);
+	qsort(f->roles, f->nroles, sizeof(Oid), filter_cmp_oid);
+
+	*extra = f;
+	return true;
+
+fail:
+	pfree(rawstring);
+#if PG_VERSION_NUM >= 160000
+	guc_free(f);
+#else
+	free(f);
+#endif
+	return false;
+}
+
+static void
+pgse_include_assign(const char *newval, void *extra)
 {
-	const pgseHashKey *k = (const pgseHashKey *) key;
+	include_filter = (pgseFilter *) extra;
+}
 
-	return hash_uint32((uint32) k->userid) ^
-	       hash_uint32((uint32) k->dbid) ^
-	       hash_uint32((uint32) k->elevel) ^
-	       hash_uint32((uint32) k->ecode);
+static void
+pgse_exclude_assign(const char *newval, void *extra)
+{
+	exclude_filter = (pgseFilter *) extra;
 }
 
-/*
- * Compare two keys - zero means match
- */
-static int
-pgse_match_fn(const void *key1, const void *key2, Size keysize)
+static void
+pgse_include_last_assign(const char *newval, void *extra)
 {
-	const pgseHashKey *k1 = (const pgseHashKey *) key1;
-	const pgseHashKey *k2 = (const pgseHashKey *) key2;
+	include_last_filter = (pgseFilter *) extra;
+}
 
-	if (k1->userid == k2->userid &&
-	    k1->dbid == k2->dbid &&
-	    k1->elevel == k2->elevel &&
-	    k1->ecode == k2->ecode
-	   )
-		return 0;
-	else
-		return 1;
+static void
+pgse_exclude_last_assign(const char *newval, void *extra)
+{
+	exclude_last_filter = (pgseFilter *) extra;
 }
-#endif
 
 
 /*
- * Estimate shared memory space needed.
+ * Match the names of databases of the filter against the session.  It is
+ * done once per backend, as soon as the session is known.
  */
-static Size
-pgse_memsize(void)
+static void
+filter_resolve_names(pgseFilter *f)
 {
-	Size       size;
+	int     i;
 
-	size = MAXALIGN(sizeof(pgseSharedState));
-	size = add_size(size, hash_estimate_size(pgse_max, sizeof(pgseEntry)));
-	size += MAXALIGN(sizeof(pgseEntryError)*pgse_max_last);
+	if (MyProcPort == NULL || MyProcPort->database_name == NULL)
+		return;
 
-	elog(DEBUG1, "pg_stat_errors: %s(): SharedState: [%lu] Entries: [%lu] EntryErrors: [%lu] total: [%lu] ", __FUNCTION__,
-	        sizeof(pgseSharedState), hash_estimate_size(pgse_max, sizeof(pgseEntry)), sizeof(pgseEntryError)*pgse_max_last, size);
+	for (i = 0; i < f->ndbnames; i++)
+		if (strcmp(f->dbnames[i], MyProcPort->database_name) == 0)
+			f->dbname_match = true;
 
-	return size;
+	f->names_resolved = true;
 }
 
-
 /*
- * Allocate a new hashtable entry.
- * Caller must hold an exclusive lock on pgse->lock
- * 
+ * Resolve the names of roles of the filter into OIDs, compared with the
+ * current user like the OIDs given in the filter.  Called inside a
+ * transaction, a role that does not exist never matches.
  */
-static pgseEntry *
-entry_alloc(pgseHashKey *key)
+static void
+filter_resolve_roles(pgseFilter *f)
 {
-	pgseEntry  *entry;
-	bool       found;
+	int     i;
 
-	/* Make space if needed */
-	while (hash_get_num_entries(pgse_hash) >= pgse_max)
-		entry_dealloc();
-
-	/* Find or create an entry with desired hash code */
-	entry = (pgseEntry *) hash_search(pgse_hash, key, HASH_ENTER, &found);
+	if (f == NULL || f->roles_resolved)
+		return;
 
-	if (!found)
+	f->nroleids = 0;
+	for (i = 0; i < f->nrolenames; i++)
 	{
-		/* New entry, initialize it */
+		Oid     roleid = get_role_oid(f->rolenames[i], true);
 
-		/* reset the statistics */
-		memset(&entry->counters, 0, sizeof(Counters));
-		/* marking the first change */
-		entry->counters._first_change = GetCurrentTimestamp();
-		/* re-initialize the mutex each time ... we assume no one using it */
-		SpinLockInit(&entry->mutex);
+		if (OidIsValid(roleid))
+			f->roleids[f->nroleids++] = roleid;
 	}
+	qsort(f->roleids, f->nroleids, sizeof(Oid), filter_cmp_oid);
 
-	return entry;
+	f->roles_resolved = true;
 }
 
-
 /*
- * qsort comparator for sorting into increasing timestamp order
+ * The names of roles of the filters are resolved at the end of the first
+ * transaction of the backend, the startup one, and after each reload of the
+ * filters.  An abort forgets the functions being executed, see
+ * get_error_function().
  */
-static int
-entry_cmp(const void *lhs, const void *rhs)
+static void
+pgse_xact_callback(XactEvent event, void *arg)
 {
-	TimestampTz  l_ts = (*(pgseEntry *const *) lhs)->counters._last_change;
-	TimestampTz  r_ts = (*(pgseEntry *const *) rhs)->counters._last_change;
-
-	/* first field - timestamp */
-	if (l_ts < r_ts)
-		return -1;
-	else if (l_ts > r_ts)
-		return +1;
-	else
-		return 0;
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+		case XACT_EVENT_PARALLEL_PRE_COMMIT:
+			filter_resolve_roles(include_filter);
+			filter_resolve_roles(exclude_filter);
+			filter_resolve_roles(include_last_filter);
+			filter_resolve_roles(exclude_last_filter);
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			function_failed = InvalidOid;
+			function_depth = 0;
+			break;
+		default:
+			break;
+	}
 }
 
-
 /*
- * Deallocate most oldest entries.
- *
- * Caller must hold an exclusive lock on pgse->lock.
+ * Whether the error matches the codes of the filter
  */
-static void
-entry_dealloc(void)
+static inline bool
+filter_match_codes(const pgseFilter *f, int ecode)
 {
-	HASH_SEQ_STATUS  hash_seq;
-	pgseEntry        **entries;
-	pgseEntry        *entry;
-	int              nvictims;
-	int              i;
+	int     eclass = ERRCODE_TO_CATEGORY(ecode);
 
-	/*
-	 * Sort entries by last error and deallocate PGSE_DEALLOC_PERCENT of them.
-	 */
-
-	entries = palloc(hash_get_num_entries(pgse_hash) * sizeof(pgseEntry *));
+	if (f->classes[eclass / 8] & (1 << (eclass % 8)))
+		return true;
 
-	i = 0;
+	return f->nsqlstates > 0 &&
+	       bsearch(&ecode, f->sqlstates, f->nsqlstates, sizeof(int), filter_cmp_int) != NULL;
+}
 
-	hash_seq_init(&hash_seq, pgse_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
-	{
-		entries[i++] = entry;
-	}
+static inline bool
+filter_match_database(const pgseFilter *f, Oid dbid)
+{
+	return f->dbname_match ||
+	       (f->ndatabases > 0 &&
+	        bsearch(&dbid, f->databases, f->ndatabases, sizeof(Oid), filter_cmp_oid) != NULL);
+}
 
-	/* Sort into increasing order by last time */
-	qsort(entries, i, sizeof(pgseEntry *), entry_cmp);
+static inline bool
+filter_match_role(const pgseFilter *f, Oid userid)
+{
+	return (f->nroleids > 0 &&
+	        bsearch(&userid, f->roleids, f->nroleids, sizeof(Oid), filter_cmp_oid) != NULL) ||
+	       (f->nroles > 0 &&
+	        bsearch(&userid, f->roles, f->nroles, sizeof(Oid), filter_cmp_oid) != NULL);
+}
 
-	/* Now zap an appropriate fraction of lowest-time entries */
-	nvictims = Max(2, i * PGSE_DEALLOC_PERCENT / 100);
-	nvictims = Min(nvictims, i);
+/*
+ * Whether the error passes the include and exclude filters.
+ *
+ * An error is included if it matches every kind of items given in the
+ * include list, and excluded if it matches any item of the exclude list.
+ */
+static bool
+pgse_filter_pass(pgseFilter *include, pgseFilter *exclude, const pgseHashKey *key)
+{
+	int     level = get_level_index(key->elevel);
+	uint32  level_bit = (level >= 0) ? (1 << level) : 0;
 
-	for (i = 0; i < nvictims; i++)
+	if (include)
 	{
-		hash_search(pgse_hash, &entries[i]->key, HASH_REMOVE, NULL);
+		if (!include->names_resolved)
+			filter_resolve_names(include);
+
+		if (include->has_codes && !filter_match_codes(include, key->ecode))
+			return false;
+		if (include->levels && !(include->levels & level_bit))
+			return false;
+		if ((include->ndatabases > 0 || include->ndbnames > 0) &&
+		    !filter_match_database(include, key->dbid))
+			return false;
+		if ((include->nroles > 0 || include->nrolenames > 0) &&
+		    !filter_match_role(include, key->userid))
+			return false;
 	}
 
-	pfree(entries);
-
-	/* Increment the number of times entries are deallocated */
+	if (exclude)
 	{
-		volatile pgseSharedState *s = (volatile pgseSharedState *) pgse;
-
-		SpinLockAcquire(&s->mutex);
-		s->stats.dealloc += 1;
-		SpinLockRelease(&s->mutex);
+		if (!exclude->names_resolved)
+			filter_resolve_names(exclude);
+
+		if ((exclude->has_codes && filter_match_codes(exclude, key->ecode)) ||
+		    (exclude->levels & level_bit) ||
+		    filter_match_database(exclude, key->dbid) ||
+		    filter_match_role(exclude, key->userid))
+			return false;
 	}
+
+	return true;
 }
 
 
 /*
- * Release all entries.
+ * Error hook.
+ *
+ * The filters are applied before any lock is taken and before the time of
+ * the error is read.
  */
-static void
-entry_reset(void)
+void
+pgse_emit_log_hook(ErrorData *edata)
 {
-	HASH_SEQ_STATUS  hash_seq;
-	pgseEntry         *entry;
+	pgseHashKey     key;
+	bool            counters;
+	bool            last;
+	Oid             funcid;
 
-	LWLockAcquire(pgse->lock, LW_EXCLUSIVE);
+	if (!edata)
+		goto exit;
 
-	hash_seq_init(&hash_seq, pgse_hash);
-	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	/* taken first, a failed function is forgotten whatever the error becomes */
+	funcid = get_error_function(edata);
+
+	if ( !isInitialized() )
+		goto exit;
+
+	/* The leader reports the errors of its parallel workers again */
+	if (IsParallelWorker())
+		goto exit;
+
+	if (edata->elevel >= WARNING)
 	{
-		hash_search(pgse_hash, &entry->key, HASH_REMOVE, NULL);
-	}
+		/* Set up key for hashtable search */
+		key.userid = GetUserId();
+		key.dbid = MyDatabaseId;
+		key.elevel = edata->elevel;
+		key.ecode = edata->sqlerrcode;
 
-	LWLockRelease(pgse->lock);
+		counters = pgse_filter_pass(include_filter, exclude_filter, &key);
+		last = pgse_filter_pass(include_last_filter, exclude_last_filter, &key);
+
+		if (counters || last || num_subscribers > 0)
+		{
+			TimestampTz etm = GetCurrentTimestamp();
+			const char *query = debug_query_string ? debug_query_string : "";
+			int         tier = PGSE_TIER_FULL;
+			bool        timed = false;
+			bool        degraded = false;
+			instr_time  start;
+
+			if (pgse_governor_budget > 0 && (counters || last))
+			{
+				pgse_governor_update(etm);
+				tier = pg_atomic_read_u32(&pgse->governor.tier);
+
+				/* the phase differs by backend, for the short sessions */
+				timed = ((++governor_calls + MyProcPid) % PGSE_GOVERNOR_SAMPLE) == 0;
+				if (timed)
+					INSTR_TIME_SET_CURRENT(start);
+
+				if (last && tier > PGSE_TIER_FULL &&
+				    (tier > PGSE_TIER_SAMPLED ||
+				     (++governor_last_calls + MyProcPid) % PGSE_GOVERNOR_LAST_SAMPLE != 0))
+				{
+					last = false;
+					degraded = true;
+				}
+				if (counters && tier == PGSE_TIER_SHARDED)
+					degraded = true;
+				if (degraded)
+					pg_atomic_fetch_add_u64(&get_shard()->c.degraded, 1);
+			}
+
+			if (counters || last)
+				pgse_store(etm, query, edata, &key, counters, last, tier);
+
+			if (counters && pgse_functions && OidIsValid(funcid) && tier < PGSE_TIER_SHARDED)
+				pgse_function_add(funcid, key.dbid, key.ecode, etm);
+
+			if (counters && pgse_messages && edata->message_id && tier < PGSE_TIER_SHARDED)
+				pgse_message_add(&key, edata, etm);
+
+			if (num_subscribers > 0)
+				pgse_notify_subscribers(etm, &key, query, edata, counters, last);
+
+			if (timed)
+				pgse_governor_add(start);
+		}
+	}
+exit:
+	if (prev_emit_log_hook)
+		prev_emit_log_hook(edata);
 }
 
+
 /*
- * Release all last errors.
+ * Size of a slot of the last errors, a multiple of the cache line size
  */
-static void
-errors_reset(void)
+static Size
+get_slot_size(void)
 {
-	LWLockAcquire(pgse->lock, LW_EXCLUSIVE);
-	memset(pgse_errors, 0, (sizeof(pgseEntryError) * pgse_max_last));
-	LWLockRelease(pgse->lock);
+	return CACHELINEALIGN(offsetof(pgseEntryError, text) +
+	                      get_query_area() + pgse_message_max_len);
 }
 
 /*
- * Reset all statistics of errors
+ * Size of the area of the query in a slot: with compression, it takes a
+ * fraction of pg_stat_errors.query_max_len
  */
-Datum
-pg_stat_errors_reset(PG_FUNCTION_ARGS)
+static int
+get_query_area(void)
 {
-	if ( !isInitialized() )
-		ereport(ERROR,
-		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
-	entry_reset();
-	errors_reset();
-	pgse_reset();
-	PG_RETURN_VOID();
-}
+	if (pgse_query_compression == PGSE_COMPRESSION_OFF)
+		return pgse_query_max_len;
 
+	return Max(pgse_query_max_len / PGSE_COMPRESSION_RATIO, 1);
+}
 
 /*
- * Get the next EID
- *
- * Caller must hold an exclusive lock on pgse->lock
+ * Prepare the query of an error for its slot, the query clipped by
+ * init_error_info().  A query longer than the area is compressed into buf;
+ * if it still does not fit, it is clipped to the area as is.  Sets the
+ * lengths and the method of the error and returns the bytes to store.
+ * It takes no lock, so it is called before pgse->lock.
  */
-static uint32
-get_next_eid(void)
+static const char *
+pack_query(ErrorInfo *error, const char *query, char *buf)
 {
-	pgseEntryError *last_entry;
-	uint32 result;
-
-	/* volatile block */
-	{
-		volatile pgseSharedState *s = (volatile pgseSharedState *) pgse;
+	uint32      raw_len = error->query_raw_len;
+	int         area = get_query_area();
+	int32       len = -1;
+	instr_time  start;
+	instr_time  duration;
+	pgseShard   *shard;
 
-		SpinLockAcquire(&s->mutex);
+	if (pgse_query_compression == PGSE_COMPRESSION_OFF)
+		return query;
 
-		s->eid.curr_eid = s->eid.next_eid;
-		s->eid.next_eid++;
+	shard = get_shard();
 
-		if (s->eid.next_eid >= pgse_max_last)
-			s->eid.next_eid = 0;
+	if (raw_len > (uint32) area)
+	{
+		INSTR_TIME_SET_CURRENT(start);
 
-		if (s->eid.max_eid < pgse_max_last)
+		switch (pgse_query_compression)
 		{
-			s->eid.max_eid++;
-
-			/* Allocate the entry of the last errors. Only once */
-			last_entry = (pgseEntryError *) &pgse_errors[s->eid.curr_eid];
-			SpinLockInit(&last_entry->mutex);
+			case PGSE_COMPRESSION_PGLZ:
+				len = pglz_compress(query, raw_len, buf, PGLZ_strategy_always);
+				break;
+#ifdef USE_LZ4
+			case PGSE_COMPRESSION_LZ4:
+				len = LZ4_compress_default(query, buf, raw_len, area);
+				if (len == 0)
+					len = -1;
+				break;
+#endif
+			default:
+				break;
 		}
 
-		result = s->eid.curr_eid;
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		pg_atomic_fetch_add_u64(&shard->c.compress_time, INSTR_TIME_GET_MICROSEC(duration));
 
-		SpinLockRelease(&s->mutex);
+		if (len < 0 || len > area)
+		{
+			/* does not compress enough, keep the beginning */
+			error->query_raw_len = error->query_len = pg_mbcliplen(query, raw_len, area);
+		}
+		else
+		{
+			error->query_method = pgse_query_compression;
+			error->query_len = len;
+			query = buf;
+		}
 	}
 
-	return result;
-}
+	/* a clipped query counts for what is kept, not for a compression */
+	pg_atomic_fetch_add_u64(&shard->c.query_raw_bytes, error->query_raw_len);
+	pg_atomic_fetch_add_u64(&shard->c.query_stored_bytes, error->query_len);
 
+	return query;
+}
 
 /*
- * Store last errors
- *
- * Caller must hold an exclusive lock on pgse->lock.
+ * The text of the query of a copy of a slot, decompressed if needed
  */
-static void
-pgse_store_error(const TimestampTz etm, const Oid dbid, const Oid userid, const char *query, const ErrorData *edata)
+static char *
+unpack_query(const pgseEntryError *slot, uint32 *len)
 {
-	uint32 c_eid = get_next_eid();
+	const ErrorInfo *error = &slot->error;
+	char        *raw;
+	int32       raw_len = -1;
 
-	/* volatile block */
+	if (error->query_method == PGSE_COMPRESSION_OFF)
 	{
-		int message_len = strlen (edata->message);
-		int query_len = strlen (query);
-		volatile pgseEntryError *e = (volatile pgseEntryError *) &pgse_errors[c_eid];
-
-		SpinLockAcquire(&e->mutex);
+		*len = error->query_len;
+		return (char *) pgse_error_query(slot);
+	}
 
-		/* reset old error */
-		memset(&pgse_errors[c_eid].error, 0, sizeof(ErrorInfo));
+	raw = palloc(error->query_raw_len + 1);
 
-		e->error.etime = etm;
-		e->error.userid = userid;
-		e->error.dbid = dbid;
-		e->error.elevel = edata->elevel;
-		e->error.ecode = edata->sqlerrcode;
-		_snprintf(e->error.query, query, query_len, MAX_QUERY_LEN);
-		_snprintf(e->error.message, edata->message, message_len, ERROR_MESSAGE_LEN);
+	switch (error->query_method)
+	{
+		case PGSE_COMPRESSION_PGLZ:
+#if PG_VERSION_NUM >= 120000
+			raw_len = pglz_decompress(pgse_error_query(slot), error->query_len,
+			                          raw, error->query_raw_len, true);
+#else
+			raw_len = pglz_decompress(pgse_error_query(slot), error->query_len,
+			                          raw, error->query_raw_len);
+#endif
+			break;
+#ifdef USE_LZ4
+		case PGSE_COMPRESSION_LZ4:
+			raw_len = LZ4_decompress_safe(pgse_error_query(slot), raw,
+			                              error->query_len, error->query_raw_len);
+			break;
+#endif
+		default:
+			break;
+	}
 
-		SpinLockRelease(&e->mutex);
+	if (raw_len != (int32) error->query_raw_len)
+	{
+		elog(LOG, "pg_stat_errors: could not decompress the query of error " UINT64_FORMAT,
+		     error->seqno);
+		raw_len = 0;
 	}
+
+	raw[raw_len] = '\0';
+	*len = raw_len;
+
+	return raw;
 }
 
-static void
-pgse_store_errorinfo(const ErrorInfo *eInfo)
+/*
+ * Buffer of the compressed queries of this backend
+ */
+static char *
+get_compress_buffer(void)
 {
-	uint32 c_eid = get_next_eid();
+	static char *buf = NULL;
 
-	/* volatile block */
-	{
-		volatile pgseEntryError *e = (volatile pgseEntryError *) &pgse_errors[c_eid];
+	if (buf == NULL && pgse_query_compression != PGSE_COMPRESSION_OFF)
+		buf = MemoryContextAlloc(TopMemoryContext, PGLZ_MAX_OUTPUT(pgse_query_max_len));
 
-		SpinLockAcquire(&e->mutex);
+	return buf;
+}
 
-		/* reset old error */
-		memset(&pgse_errors[c_eid].error, 0, sizeof(ErrorInfo));
-		memcpy((void *)&e->error, eInfo, sizeof(ErrorInfo));
 
-		SpinLockRelease(&e->mutex);
-	}
+/*
+ * Size of the count-min sketch with its recent values and candidates
+ */
+static Size
+get_sketch_size(void)
+{
+	return add_size(offsetof(pgseSketch, counters),
+	                mul_size((Size) PGSE_SKETCH_DIMS * PGSE_SKETCH_DEPTH * pgse_sketch_width,
+	                         sizeof(pg_atomic_uint64)));
 }
 
 
 /*
- * Update counters
- *
- * Caller must hold an exclusive lock on pgse->lock.
+ * Size of the heavy hitters: the items, then the heap
  */
-static void
-pgse_update_counters(const TimestampTz etm, const pgseEntry *entry, const ErrorData *edata)
+static Size
+get_topk_size(void)
 {
-	/* volatile block */
-	{	
-		/*
-		 * Grab the spinlock while updating the counters (see comment about
-		 * locking rules at the head of the file)
-		 */
-		volatile pgseEntry *e = (volatile pgseEntry *) entry;
+	return add_size(offsetof(pgseTopK, items),
+	                mul_size(pgse_topk, sizeof(pgseTopKItem) + sizeof(int32)));
+}
 
-		SpinLockAcquire(&e->mutex);
 
-		if (edata->sqlerrcode != ERRCODE_SUCCESSFUL_COMPLETION)
-		{
-			e->counters.errors++;
-		}
-		e->counters._last_change = etm;
+/*
+ * Estimate shared memory space needed.
+ */
+static Size
+pgse_memsize(void)
+{
+	Size       size;
 
-		SpinLockRelease(&e->mutex);
+	size = MAXALIGN(sizeof(pgseSharedState));
+	size = add_size(size, hash_estimate_size(pgse_max, sizeof(pgseEntry)));
+	size = add_size(size, PG_CACHE_LINE_SIZE + mul_size(get_slot_size(), pgse_max_last));
+	if (pgse_topk > 0)
+	{
+		size = add_size(size, hash_estimate_size(pgse_topk, sizeof(pgseTopKSlot)));
+		size = add_size(size, get_topk_size());
 	}
+	if (pgse_sketch_width > 0)
+		size = add_size(size, get_sketch_size());
+	if (pgse_history_enabled)
+		size = add_size(size, sizeof(pgseHistory));
+	if (pgse_max_functions > 0)
+		size = add_size(size, hash_estimate_size(pgse_max_functions, sizeof(pgseFunction)));
+	if (pgse_max_relations > 0)
+		size = add_size(size, hash_estimate_size(pgse_max_relations, sizeof(pgseRelation)));
+	if (pgse_max_messages > 0)
+		size = add_size(size, hash_estimate_size(pgse_max_messages, sizeof(pgseMessage)));
 
-	pgse->total_errors++;
+	elog(DEBUG1, "pg_stat_errors: %s(): SharedState: [%lu] Entries: [%lu] EntryErrors: [%lu] total: [%lu] ", __FUNCTION__,
+	        sizeof(pgseSharedState), hash_estimate_size(pgse_max, sizeof(pgseEntry)), get_slot_size()*pgse_max_last, size);
+
+	return size;
 }
 
+
 /*
- * Store some statistics for key and whole database cluster
+ * Allocate a new hashtable entry.
+ * Caller must hold an exclusive lock on pgse->lock
+ * 
  */
-static void
-pgse_store(const TimestampTz etm, const char *query, const ErrorData *edata)
+static pgseEntry *
+entry_alloc(pgseHashKey *key)
 {
-	pgseHashKey      key;
-	pgseEntry        *entry;
-
-	/* Safety check ... */
-	if ( !isInitialized() || !edata )
-		return;
+	pgseEntry  *entry;
+	bool       found;
 
-	/* Set up key for hashtable search */
-	key.userid = GetUserId();
-	key.dbid = MyDatabaseId;
-	key.elevel = edata->elevel;
-	key.ecode = edata->sqlerrcode;
+	/* Keep the database within its quota */
+	if (pgse_max_per_database > 0 &&
+	    hash_search(pgse_hash, key, HASH_FIND, NULL) == NULL)
+		entry_dealloc_database(key->dbid);
 
-	/* Lookup the hash table entry with shared lock. */
-	LWLockAcquire(pgse->lock, LW_SHARED);
+	/* Make space if needed */
+	while (hash_get_num_entries(pgse_hash) >= pgse_max)
+		entry_dealloc();
 
-	entry = (pgseEntry *) hash_search(pgse_hash, &key, HASH_FIND, NULL);
+	/* Find or create an entry with desired hash code */
+	entry = (pgseEntry *) hash_search(pgse_hash, key, HASH_ENTER, &found);
 
-	/* Create new entry, if not present */
-	if (!entry)
+	if (!found)
 	{
-		/* Need exclusive lock to make a new hashtable entry - promote */
-		LWLockRelease(pgse->lock);
-		LWLockAcquire(pgse->lock, LW_EXCLUSIVE);
+		/* New entry, initialize it */
 
-		/* OK to create a new hashtable entry */
-		entry = entry_alloc(&key);
-	}
+		/* reset the statistics */
+		memset(&entry->counters, 0, sizeof(Counters));
+		/* marking the first change */
+		entry->counters._first_change = GetCurrentTimestamp();
+		/* re-initialize the mutex each time ... we assume no one using it */
+		SpinLockInit(&entry->mutex);
+		entry->changecount = 0;
 
-	pgse_update_counters(etm, entry, edata);
-	/* store last errors */
-	pgse_store_error(etm, key.dbid, key.userid, query, edata);
+		entry_count_database(key->dbid, 1);
+	}
 
-	LWLockRelease(pgse->lock);
+	return entry;
 }
 
 
-
-
 /*
- * Total errors
+ * qsort comparator for sorting into increasing timestamp order
  */
-Datum
-pg_stat_errors_total_errors(PG_FUNCTION_ARGS)
+static int
+entry_cmp(const void *lhs, const void *rhs)
 {
-	int64 result;
+	TimestampTz  l_ts = (*(pgseEntry *const *) lhs)->counters._last_change;
+	TimestampTz  r_ts = (*(pgseEntry *const *) rhs)->counters._last_change;
 
-	volatile pgseSharedState *s = (volatile pgseSharedState *) pgse;
-	SpinLockAcquire(&s->mutex);
-	result = s->total_errors;
-	SpinLockRelease(&s->mutex);
+	/* first field - timestamp */
+	if (l_ts < r_ts)
+		return -1;
+	else if (l_ts > r_ts)
+		return +1;
+	else
+		return 0;
+}
+
+
+/*
+ * Deallocate most oldest entries.
+ *
+ * Caller must hold an exclusive lock on pgse->lock.
+ */
+static void
+entry_dealloc(void)
+{
+	HASH_SEQ_STATUS  hash_seq;
+	pgseEntry        **entries;
+	pgseEntry        *entry;
+	int              nvictims;
+	int              i;
+
+	/*
+	 * Sort entries by last error and deallocate PGSE_DEALLOC_PERCENT of them.
+	 */
+
+	entries = palloc(hash_get_num_entries(pgse_hash) * sizeof(pgseEntry *));
+
+	i = 0;
+
+	hash_seq_init(&hash_seq, pgse_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		entries[i++] = entry;
+	}
+
+	/* Sort into increasing order by last time */
+	qsort(entries, i, sizeof(pgseEntry *), entry_cmp);
+
+	/* Now zap an appropriate fraction of lowest-time entries */
+	nvictims = Max(2, i * PGSE_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, i);
+
+	for (i = 0; i < nvictims; i++)
+	{
+		entry_count_database(entries[i]->key.dbid, -1);
+		hash_search(pgse_hash, &entries[i]->key, HASH_REMOVE, NULL);
+	}
+
+	pfree(entries);
+
+	/* Increment the number of times entries are deallocated */
+	pg_atomic_fetch_add_u64(&get_shard()->c.dealloc, 1);
+}
+
+
+/*
+ * Deallocate the oldest entries of a database holding its quota of entries,
+ * so that a database with many error types does not evict the statistics
+ * of the other ones.  The entries of the database are counted in its slot
+ * of rollups, the hashtable is only scanned when the quota is reached.  A
+ * database without a slot, beyond the first PGSE_MAX_DATABASES, has no
+ * quota: only pg_stat_errors.max bounds its entries.
+ *
+ * Caller must hold an exclusive lock on pgse->lock.
+ */
+static void
+entry_dealloc_database(Oid dbid)
+{
+	HASH_SEQ_STATUS  hash_seq;
+	pgseEntry        **entries;
+	pgseEntry        *entry;
+	int              nvictims;
+	int              slot;
+	int              i;
+
+	slot = rollup_get_database(dbid);
+	if (slot < 0 ||
+	    pg_atomic_read_u32(&pgse->rollups.db_entries[slot]) < (uint32) pgse_max_per_database)
+		return;
+
+	entries = palloc(Max(hash_get_num_entries(pgse_hash), 1) * sizeof(pgseEntry *));
+
+	i = 0;
+
+	hash_seq_init(&hash_seq, pgse_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->key.dbid == dbid)
+			entries[i++] = entry;
+	}
+
+	/* the count was behind, e.g. entries loaded before the slot was claimed */
+	if (i < pgse_max_per_database)
+	{
+		pg_atomic_write_u32(&pgse->rollups.db_entries[slot], i);
+		pfree(entries);
+		return;
+	}
+
+	/* Sort into increasing order by last time */
+	qsort(entries, i, sizeof(pgseEntry *), entry_cmp);
+
+	/* Make room for one entry, or PGSE_DEALLOC_PERCENT of the database */
+	nvictims = Max(i - pgse_max_per_database + 1, i * PGSE_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, i);
+
+	for (i = 0; i < nvictims; i++)
+	{
+		hash_search(pgse_hash, &entries[i]->key, HASH_REMOVE, NULL);
+	}
+
+	pfree(entries);
+
+	pg_atomic_fetch_sub_u32(&pgse->rollups.db_entries[slot], nvictims);
+	pg_atomic_fetch_add_u64(&pgse->rollups.db_evicted[slot], nvictims);
+}
+
+/*
+ * Account the entries of pgse_hash created or removed for a database, in
+ * its slot of rollups if it has one.
+ *
+ * Caller must hold an exclusive lock on pgse->lock.
+ */
+static void
+entry_count_database(Oid dbid, int32 delta)
+{
+	int     slot;
+
+	slot = (delta > 0) ? rollup_get_database(dbid) : rollup_find_database(dbid);
+	if (slot >= 0)
+		pg_atomic_fetch_add_u32(&pgse->rollups.db_entries[slot], delta);
+}
+
+
+/*
+ * Release all entries.
+ */
+static void
+entry_reset(void)
+{
+	HASH_SEQ_STATUS  hash_seq;
+	pgseEntry         *entry;
+	int               d;
+
+	LWLockAcquire(pgse->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, pgse_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		hash_search(pgse_hash, &entry->key, HASH_REMOVE, NULL);
+	}
+	for (d = 0; d < PGSE_MAX_DATABASES; d++)
+		pg_atomic_write_u32(&pgse->rollups.db_entries[d], 0);
+
+	LWLockRelease(pgse->lock);
+}
+
+/*
+ * Release all last errors.
+ */
+static void
+errors_reset(void)
+{
+	int     d;
+
+	LWLockAcquire(pgse->lock, LW_EXCLUSIVE);
+	init_error_slots();
+	for (d = 0; d < PGSE_MAX_DATABASES; d++)
+		pg_atomic_write_u32(&pgse->rollups.db_last[d], 0);
+	LWLockRelease(pgse->lock);
+}
+
+/*
+ * Zero the rollups.  The slots stay claimed, so the caches of backends
+ * remain valid.
+ */
+static void
+rollups_reset(void)
+{
+	int     l, c, d;
+
+	for (l = 0; l < PGSE_NUM_LEVELS; l++)
+		for (c = 0; c < PGSE_MAX_CLASSES; c++)
+			pg_atomic_write_u64(&pgse->rollups.class_errors[l][c], 0);
+	for (d = 0; d < PGSE_MAX_DATABASES; d++)
+	{
+		for (l = 0; l < PGSE_NUM_LEVELS; l++)
+			pg_atomic_write_u64(&pgse->rollups.db_errors[d][l], 0);
+		pg_atomic_write_u64(&pgse->rollups.db_evicted[d], 0);
+		pg_atomic_write_u64(&pgse->rollups.db_last_replaced[d], 0);
+	}
+	for (l = 0; l < PGSE_NUM_LEVELS; l++)
+	{
+		pg_atomic_write_u64(&pgse->rollups.level_errors[l], 0);
+		pg_atomic_write_u64(&pgse->rollups.class_other_errors[l], 0);
+		pg_atomic_write_u64(&pgse->rollups.db_other_errors[l], 0);
+	}
+}
+
+/*
+ * Reset all statistics of errors
+ */
+Datum
+pg_stat_errors_reset(PG_FUNCTION_ARGS)
+{
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+	entry_reset();
+	errors_reset();
+	rollups_reset();
+	history_reset();
+	functions_reset();
+	relations_reset();
+	messages_reset();
+	topk_reset();
+	sketch_reset();
+	pgse_reset();
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * Get the next EID and the sequence number of the error stored there
+ *
+ * The head of the ring is advanced by a single atomic operation, so the
+ * backends storing errors at the same time get distinct slots.
+ */
+static uint32
+get_next_eid(uint64 *seqno)
+{
+	uint64 result = pg_atomic_fetch_add_u64(&pgse->eid.seqno, 1) + 1;
+
+	if (seqno)
+		*seqno = result;
+
+	return (uint32) ((result - 1) % pgse_max_last);
+}
+
+/*
+ * Number of the last errors kept when the head of the ring is at seqno
+ */
+static uint32
+get_num_last(uint64 seqno)
+{
+	return (uint32) Min(seqno, (uint64) pgse_max_last);
+}
+
+/*
+ * Mark the last errors as empty
+ */
+static void
+init_error_slots(void)
+{
+	int     i;
+
+	memset(pgse_errors, 0, pgse_slot_size * pgse_max_last);
+	for (i = 0; i < pgse_max_last; i++)
+		SpinLockInit(&pgse_error_slot(i)->mutex);
+}
+
+/*
+ * The shard of the global counters updated by this backend
+ */
+static pgseShard *
+get_shard(void)
+{
+#if PG_VERSION_NUM >= 170000
+	int     id = MyProcNumber;
+#else
+	int     id = MyBackendId;
+#endif
+
+	/* processes without a backend slot, e.g. the postmaster */
+	if (id < 0)
+		id = MyProcPid;
+
+	return &pgse->shards[id % PGSE_NUM_SHARDS];
+}
+
+/*
+ * Sum the shards of the global counters
+ */
+static void
+get_global_stats(uint64 *total_errors, pgseGlobalStats *stats)
+{
+	int     shard;
+
+	*total_errors = 0;
+	stats->dealloc = 0;
+	for (shard = 0; shard < PGSE_NUM_SHARDS; shard++)
+	{
+		*total_errors += pg_atomic_read_u64(&pgse->shards[shard].c.total_errors);
+		stats->dealloc += pg_atomic_read_u64(&pgse->shards[shard].c.dealloc);
+	}
+
+	/* volatile block */
+	{
+		volatile pgseSharedState *s = (volatile pgseSharedState *) pgse;
+
+		SpinLockAcquire(&s->mutex);
+		stats->stats_reset = s->stats_reset;
+		SpinLockRelease(&s->mutex);
+	}
+}
+
+
+/*
+ * Copy the counters of an entry, without any lock
+ */
+static void
+read_entry_counters(const pgseEntry *entry, Counters *counters)
+{
+	volatile const pgseEntry *e = (volatile const pgseEntry *) entry;
+
+	for (;;)
+	{
+		uint32  before;
+
+		pgse_begin_read(e, before);
+		memcpy(counters, (const void *) &e->counters, sizeof(Counters));
+		if (pgse_end_read(e, before))
+			break;
+		SPIN_DELAY();
+	}
+}
+
+/*
+ * Copy a slot of the last errors, without any lock
+ */
+static void
+read_error_slot(const pgseEntryError *slot, pgseEntryError *copy)
+{
+	volatile const pgseEntryError *e = (volatile const pgseEntryError *) slot;
+
+	for (;;)
+	{
+		uint32  before;
+
+		pgse_begin_read(e, before);
+		memcpy(copy, slot, pgse_slot_size);
+		if (pgse_end_read(e, before))
+			break;
+		SPIN_DELAY();
+	}
+}
+
+/*
+ * Length of the text to keep, at most max_len bytes.  Never looks beyond
+ * max_len bytes of the text, however long it is, and does not cut a
+ * multibyte character.
+ */
+static uint32
+get_clipped_len(const char *str, int max_len)
+{
+	int     len = strnlen(str, max_len);
+
+	if (len == max_len && len > 0)
+		len = pg_mbcliplen(str, len, max_len);
+
+	return len;
+}
+
+/*
+ * Describe an error for the last errors, its query and message clipped but
+ * the query not compressed yet, see pack_query()
+ */
+static void
+init_error_info(ErrorInfo *error, const TimestampTz etm, const Oid dbid, const Oid userid,
+                const char *query, const char *message, const ErrorData *edata,
+                const pgseLockInfo *lock)
+{
+	memset(error, 0, sizeof(ErrorInfo));
+	error->etime = etm;
+	error->last_time = etm;
+	error->repeat_count = 1;
+	error->userid = userid;
+	error->dbid = dbid;
+	error->elevel = edata->elevel;
+	error->ecode = edata->sqlerrcode;
+	if (lock)
+		error->lock = *lock;
+	error->query_method = PGSE_COMPRESSION_OFF;
+	error->query_raw_len = error->query_len = get_clipped_len(query, pgse_query_max_len);
+	error->message_len = get_clipped_len(message, pgse_message_max_len);
+	error->hash = get_error_hash(error, query, message);
+}
+
+/*
+ * Store last errors, the query packed by pack_query()
+ *
+ * Caller must hold a lock on pgse->lock.
+ */
+static void
+pgse_store_error(ErrorInfo *error, const char *query, const char *message)
+{
+	uint64      seqno;
+	uint32      c_eid;
+	bool        full = last_quota_full(error->dbid);
+
+	c_eid = get_next_eid(&seqno);
+
+	/* a database holding its quota replaces its own oldest error */
+	if (full && last_quota_replace(c_eid, seqno, error, query, message))
+		return;
+
+	/* volatile block */
+	{
+		pgseEntryError *slot = pgse_error_slot(c_eid);
+		volatile pgseEntryError *e = (volatile pgseEntryError *) slot;
+		Oid         old_dbid;
+
+		SpinLockAcquire(&e->mutex);
+		old_dbid = (e->error.seqno != 0) ? e->error.dbid : InvalidOid;
+		pgse_begin_write(e);
+
+		error->seqno = seqno;
+		memcpy((void *) &e->error, error, sizeof(ErrorInfo));
+		memcpy(pgse_error_query(slot), query, error->query_len);
+		memcpy(pgse_error_message(slot), message, error->message_len);
+
+		pgse_end_write(e);
+		SpinLockRelease(&e->mutex);
+
+		last_quota_move(old_dbid, error->dbid);
+	}
+}
+
+/*
+ * Hash of the user, database, code, query and message of an error, which
+ * must be clipped already.  The query is the one before compression.
+ */
+static uint32
+get_error_hash(const ErrorInfo *error, const char *query, const char *message)
+{
+	uint32  hash;
+
+	hash = hash_uint32((uint32) error->userid) ^
+	       hash_uint32((uint32) error->dbid ^ (uint32) error->ecode);
+	hash = (hash << 1 | hash >> 31) ^
+	       DatumGetUInt32(hash_any((const unsigned char *) query, error->query_raw_len));
+	hash = (hash << 1 | hash >> 31) ^
+	       DatumGetUInt32(hash_any((const unsigned char *) message, error->message_len));
+
+	return hash;
+}
+
+/*
+ * Whether the compressed query of a slot is the query of an error, not
+ * compressed yet.  It is compared on a copy of the slot, decompressed out
+ * of its spinlock, which must still hold the error seqno.
+ */
+static bool
+same_packed_query(const pgseEntryError *slot, uint64 seqno, const ErrorInfo *error,
+                  const char *query)
+{
+	pgseEntryError  *copy = palloc(pgse_slot_size);
+	bool            result;
+
+	read_error_slot(slot, copy);
+
+	result = (copy->error.seqno == seqno &&
+	          copy->error.query_method != PGSE_COMPRESSION_OFF &&
+	          copy->error.query_raw_len == error->query_raw_len);
+	if (result)
+	{
+		uint32  len;
+		char    *raw = unpack_query(copy, &len);
+
+		result = (len == error->query_raw_len && memcmp(raw, query, len) == 0);
+		pfree(raw);
+	}
+
+	pfree(copy);
+
+	return result;
+}
+
+/*
+ * Look for the same error in the pg_stat_errors.dedup_window latest slots,
+ * and count one more repeat of it.  Returns false if it is not found, or if
+ * the slot has already been written into the export files.  The
+ * query of the error is not compressed yet: a query stored as is matches
+ * on its beginning, which is the whole query unless it was clipped to the
+ * area of the slot, the hash of the error covering the rest; a compressed
+ * query is decompressed.
+ *
+ * Caller must hold a lock on pgse->lock.
+ */
+static bool
+pgse_repeat_error(const ErrorInfo *error, const char *query, const char *message)
+{
+	uint64  head = pg_atomic_read_u64(&pgse->eid.seqno);
+	uint64  window = (uint64) Min(pgse_dedup_window, pgse_max_last);
+	uint64  s;
+
+	for (s = head; s > 0 && head - s < window; s--)
+	{
+		pgseEntryError *slot = pgse_error_slot((s - 1) % pgse_max_last);
+		volatile pgseEntryError *e = (volatile pgseEntryError *) slot;
+		bool    packed_found = false;
+		bool    found;
+
+		/* cheap check without the spinlock */
+		if (e->error.hash != error->hash)
+			continue;
+
+		if (e->error.query_method != PGSE_COMPRESSION_OFF)
+			packed_found = same_packed_query(slot, s, error, query);
+
+		SpinLockAcquire(&e->mutex);
+
+		found = (e->error.seqno == s &&
+		         !e->error.exported &&
+		         e->error.hash == error->hash &&
+		         e->error.userid == error->userid &&
+		         e->error.dbid == error->dbid &&
+		         e->error.elevel == error->elevel &&
+		         e->error.ecode == error->ecode &&
+		         e->error.message_len == error->message_len &&
+		         (e->error.query_method == PGSE_COMPRESSION_OFF ?
+		          (e->error.query_len <= error->query_raw_len &&
+		           memcmp(pgse_error_query(slot), query, e->error.query_len) == 0) :
+		          packed_found) &&
+		         memcmp(pgse_error_message(slot), message, error->message_len) == 0);
+		if (found)
+		{
+			pgse_begin_write(e);
+			e->error.repeat_count++;
+			if (error->etime > e->error.last_time)
+				e->error.last_time = error->etime;
+			pgse_end_write(e);
+		}
+
+		SpinLockRelease(&e->mutex);
+
+		if (found)
+			return true;
+	}
+
+	return false;
+}
+
+static void
+pgse_store_errorinfo(const ErrorInfo *eInfo, const char *query, const char *message)
+{
+	ErrorInfo   error = *eInfo;
+	uint64      seqno;
+	uint32      c_eid = get_next_eid(&seqno);
+
+	/* the loaded errors have already been exported before the shutdown */
+	error.exported = (pgse_export != PGSE_EXPORT_OFF);
+
+	/* the settings of the lengths and the compression may have changed */
+	error.query_method = PGSE_COMPRESSION_OFF;
+	error.query_raw_len = error.query_len = get_clipped_len(query, pgse_query_max_len);
+	error.message_len = get_clipped_len(message, pgse_message_max_len);
+	error.hash = get_error_hash(&error, query, message);
+	query = pack_query(&error, query, get_compress_buffer());
+
+	/* volatile block */
+	{
+		pgseEntryError *slot = pgse_error_slot(c_eid);
+		volatile pgseEntryError *e = (volatile pgseEntryError *) slot;
+		Oid         old_dbid;
+
+		SpinLockAcquire(&e->mutex);
+		old_dbid = (e->error.seqno != 0) ? e->error.dbid : InvalidOid;
+		pgse_begin_write(e);
+
+		error.seqno = seqno;
+		memcpy((void *) &e->error, &error, sizeof(ErrorInfo));
+		memcpy(pgse_error_query(slot), query, error.query_len);
+		memcpy(pgse_error_message(slot), message, error.message_len);
+
+		pgse_end_write(e);
+		SpinLockRelease(&e->mutex);
+
+		last_quota_move(old_dbid, eInfo->dbid);
+	}
+}
+
+
+/*
+ * Hash a value for a HyperLogLog.  The registers are merged across clusters
+ * and architectures by pg_stat_errors_merge, so the hash must not depend on
+ * the byte order like hash_any(): FNV-1a over the bytes, then the finalizer
+ * of MurmurHash3 to mix the first bits, which select the register.
+ */
+static uint32
+hll_hash(const unsigned char *data, size_t len)
+{
+	uint32  h = 2166136261U;
+	size_t  i;
+
+	for (i = 0; i < len; i++)
+	{
+		h ^= data[i];
+		h *= 16777619U;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/*
+ * Add a hashed value to the registers of a HyperLogLog: the first bits of
+ * the hash select the register, which keeps the highest position of the
+ * first 1 bit in the rest of the hash.
+ */
+static void
+hll_add(uint8 *registers, uint32 hash)
+{
+	uint32  index = hash >> (32 - PGSE_HLL_BITS);
+	uint32  rest = hash << PGSE_HLL_BITS;
+	uint8   rank = 1;
+
+	while (rank <= 32 - PGSE_HLL_BITS && (rest & 0x80000000) == 0)
+	{
+		rest <<= 1;
+		rank++;
+	}
+
+	if (registers[index] < rank)
+		registers[index] = rank;
+}
+
+/*
+ * Estimate the number of distinct values of a HyperLogLog, with the linear
+ * counting for the small cardinalities
+ */
+static int64
+hll_estimate(const uint8 *registers)
+{
+	double  alpha = 0.7213 / (1.0 + 1.079 / PGSE_HLL_REGISTERS);
+	double  sum = 0.0;
+	double  estimate;
+	int     zeros = 0;
+	int     i;
+
+	for (i = 0; i < PGSE_HLL_REGISTERS; i++)
+	{
+		sum += ldexp(1.0, -registers[i]);
+		if (registers[i] == 0)
+			zeros++;
+	}
+
+	estimate = alpha * PGSE_HLL_REGISTERS * PGSE_HLL_REGISTERS / sum;
+	if (estimate <= 2.5 * PGSE_HLL_REGISTERS && zeros > 0)
+		estimate = PGSE_HLL_REGISTERS * log((double) PGSE_HLL_REGISTERS / zeros);
+
+	return (int64) rint(estimate);
+}
+
+/*
+ * Whether the error was raised by a parallel worker and is reported again
+ * by its leader: HandleParallelMessage() adds a line "parallel worker" to
+ * the context, the error context callbacks of the leader follow it.
+ */
+static bool
+is_parallel_error(const ErrorData *edata)
+{
+	const char  *marker = _("parallel worker");
+	size_t      len = strlen(marker);
+	const char  *line = edata->context;
+
+	while (line)
+	{
+		if (strncmp(line, marker, len) == 0 && (line[len] == '\n' || line[len] == '\0'))
+			return true;
+
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+
+	return false;
+}
+
+/*
+ * How long the failed statement ran before the error, in microseconds.
+ * Returns -1 if there is no statement, or for a warning: the statement
+ * goes on after it.
+ */
+static int64
+get_statement_duration(const TimestampTz etm, const ErrorData *edata)
+{
+	TimestampTz start;
+	long        secs;
+	int         usecs;
+
+	if (edata->elevel < ERROR || debug_query_string == NULL)
+		return -1;
+
+	start = GetCurrentStatementStartTimestamp();
+	if (start == 0)
+		return -1;
+
+	TimestampDifference(start, etm, &secs, &usecs);
+
+	return (int64) secs * USECS_PER_SEC + usecs;
+}
+
+/*
+ * Update counters
+ *
+ * Caller must hold an exclusive lock on pgse->lock.
+ */
+static void
+pgse_update_counters(const TimestampTz etm, const pgseEntry *entry, const ErrorData *edata)
+{
+	int64   duration = get_statement_duration(etm, edata);
+	int     bucket = 0;
+	uint32  session_hash;
+	uint32  client_hash = 0;
+	bool    parallel = is_parallel_error(edata);
+	unsigned char session[12];
+	int     b;
+
+	/*
+	 * A session is a backend PID with its start time, PIDs are reused.  Both
+	 * are hashed in little-endian order.
+	 */
+	for (b = 0; b < 4; b++)
+		session[b] = (unsigned char) ((uint32) MyProcPid >> (8 * b));
+	for (b = 0; b < 8; b++)
+		session[4 + b] = (unsigned char) ((uint64) MyStartTime >> (8 * b));
+	session_hash = hll_hash(session, sizeof(session));
+	if (MyProcPort && MyProcPort->remote_host)
+		client_hash = hll_hash((const unsigned char *) MyProcPort->remote_host,
+		                       strlen(MyProcPort->remote_host));
+
+	if (duration > 0)
+	{
+		int64   d = duration;
+
+		while (d > 0 && bucket < PGSE_HIST_BUCKETS - 1)
+		{
+			d >>= 1;
+			bucket++;
+		}
+	}
+
+	/* volatile block */
+	{	
+		/*
+		 * Grab the spinlock while updating the counters (see comment about
+		 * locking rules at the head of the file)
+		 */
+		volatile pgseEntry *e = (volatile pgseEntry *) entry;
+
+		SpinLockAcquire(&e->mutex);
+		pgse_begin_write(e);
+
+		if (edata->sqlerrcode != ERRCODE_SUCCESSFUL_COMPLETION)
+		{
+			e->counters.errors++;
+			if (parallel)
+				e->counters.parallel_errors++;
+		}
+		if (duration >= 0)
+		{
+			e->counters.duration_hist[bucket]++;
+			e->counters.wasted_time += duration;
+		}
+		hll_add((uint8 *) e->counters.sessions, session_hash);
+		if (MyProcPort && MyProcPort->remote_host)
+			hll_add((uint8 *) e->counters.clients, client_hash);
+		e->counters._last_change = etm;
+
+		pgse_end_write(e);
+		SpinLockRelease(&e->mutex);
+	}
+
+	pg_atomic_fetch_add_u64(&get_shard()->c.total_errors, 1);
+}
+
+static inline uint64
+topk_count(pgseTopK *t, int32 i)
+{
+	return pg_atomic_read_u64(&t->items[i].count);
+}
+
+/*
+ * Restore the heap property from the position pos down to the leaves, after
+ * the count of the item there has been increased.
+ *
+ * Caller must hold an exclusive lock on pgse->topk_lock.
+ */
+static void
+topk_sift_down(int pos)
+{
+	pgseTopK    *t = pgse_topk_state;
+	int32       *heap = pgse_topk_heap;
+
+	for (;;)
+	{
+		int     child = 2 * pos + 1;
+		int32   tmp;
+
+		if (child >= t->nitems)
+			break;
+		if (child + 1 < t->nitems &&
+		    topk_count(t, heap[child + 1]) < topk_count(t, heap[child]))
+			child++;
+		if (topk_count(t, heap[pos]) <= topk_count(t, heap[child]))
+			break;
+
+		tmp = heap[pos];
+		heap[pos] = heap[child];
+		heap[child] = tmp;
+		t->items[heap[pos]].heap_pos = pos;
+		t->items[heap[child]].heap_pos = child;
+		pos = child;
+	}
+}
+
+/*
+ * Restore the heap property from the position pos up to the root, after
+ * an item has been appended.
+ *
+ * Caller must hold an exclusive lock on pgse->topk_lock.
+ */
+static void
+topk_sift_up(int pos)
+{
+	pgseTopK    *t = pgse_topk_state;
+	int32       *heap = pgse_topk_heap;
+
+	while (pos > 0)
+	{
+		int     parent = (pos - 1) / 2;
+		int32   tmp;
+
+		if (topk_count(t, heap[parent]) <= topk_count(t, heap[pos]))
+			break;
+
+		tmp = heap[pos];
+		heap[pos] = heap[parent];
+		heap[parent] = tmp;
+		t->items[heap[pos]].heap_pos = pos;
+		t->items[heap[parent]].heap_pos = parent;
+		pos = parent;
+	}
+}
+
+/*
+ * Count an error of a tracked key, under a shared or an exclusive lock on
+ * pgse->topk_lock.  The heap is left to be rebuilt by the next new key.
+ */
+static inline void
+topk_count_hit(pgseTopK *t, int32 i)
+{
+	pg_atomic_fetch_add_u64(&t->items[i].count, 1);
+	if (pg_atomic_read_u32(&t->dirty) == 0)
+		pg_atomic_write_u32(&t->dirty, 1);
+}
+
+/*
+ * Count an error in the heavy hitters.  A tracked key is counted under a
+ * shared lock.  A new key takes a free item or replaces the item with the
+ * smallest count, inheriting that count as its error bound, under an
+ * exclusive lock.
+ */
+static void
+pgse_topk_add(const pgseHashKey *key)
+{
+	pgseTopK        *t = pgse_topk_state;
+	pgseTopKKey     tkey;
+	pgseTopKSlot    *slot;
+	pgseTopKItem    *item;
+	int32           i;
+
+	memset(&tkey, 0, sizeof(tkey));
+#if PG_VERSION_NUM >= 140000
+	tkey.queryid = (uint64) pgstat_get_my_query_id();
+#endif
+	tkey.userid = key->userid;
+	tkey.dbid = key->dbid;
+	tkey.ecode = key->ecode;
+
+	LWLockAcquire(pgse->topk_lock, LW_SHARED);
+	slot = (pgseTopKSlot *) hash_search(pgse_topk_hash, &tkey, HASH_FIND, NULL);
+	if (slot)
+	{
+		topk_count_hit(t, slot->item);
+		LWLockRelease(pgse->topk_lock);
+		return;
+	}
+	LWLockRelease(pgse->topk_lock);
+
+	/* the key may have been added since the shared lock was released */
+	LWLockAcquire(pgse->topk_lock, LW_EXCLUSIVE);
+
+	slot = (pgseTopKSlot *) hash_search(pgse_topk_hash, &tkey, HASH_FIND, NULL);
+	if (slot)
+	{
+		topk_count_hit(t, slot->item);
+		LWLockRelease(pgse->topk_lock);
+		return;
+	}
+
+	/* rebuild the heap if tracked keys were counted since */
+	if (pg_atomic_read_u32(&t->dirty) != 0)
+	{
+		for (i = t->nitems / 2 - 1; i >= 0; i--)
+			topk_sift_down(i);
+		pg_atomic_write_u32(&t->dirty, 0);
+	}
+
+	if (t->nitems < pgse_topk)
+	{
+		i = t->nitems++;
+		item = &t->items[i];
+		item->key = tkey;
+		pg_atomic_init_u64(&item->count, 1);
+		item->error = 0;
+		item->heap_pos = i;
+		pgse_topk_heap[i] = i;
+		topk_sift_up(i);
+	}
+	else
+	{
+		i = pgse_topk_heap[0];
+		item = &t->items[i];
+		hash_search(pgse_topk_hash, &item->key, HASH_REMOVE, NULL);
+
+		item->key = tkey;
+		item->error = (int64) topk_count(t, i);
+		pg_atomic_write_u64(&item->count, item->error + 1);
+		topk_sift_down(0);
+	}
+
+	slot = (pgseTopKSlot *) hash_search(pgse_topk_hash, &tkey, HASH_ENTER, NULL);
+	slot->item = i;
+
+	LWLockRelease(pgse->topk_lock);
+}
+
+/*
+ * Forget all heavy hitters
+ */
+static void
+topk_reset(void)
+{
+	pgseTopK        *t = pgse_topk_state;
+	int             i;
+
+	if (!t)
+		return;
+
+	LWLockAcquire(pgse->topk_lock, LW_EXCLUSIVE);
+	for (i = 0; i < t->nitems; i++)
+		hash_search(pgse_topk_hash, &t->items[i].key, HASH_REMOVE, NULL);
+	t->nitems = 0;
+	pg_atomic_write_u32(&t->dirty, 0);
+	LWLockRelease(pgse->topk_lock);
+}
+
+/*
+ * Whether the function is written in a procedural language, whose errors
+ * are attributed to it.  A hooked function is never inlined, so the
+ * functions in SQL are left alone: their errors go to the function calling
+ * them, if any.
+ */
+static bool
+is_tracked_function(Oid fn_oid)
+{
+	HeapTuple   tuple;
+	Oid         lang;
+
+	tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(fn_oid));
+	if (!HeapTupleIsValid(tuple))
+		return false;
+	lang = ((Form_pg_proc) GETSTRUCT(tuple))->prolang;
+	ReleaseSysCache(tuple);
+
+	return lang != INTERNALlanguageId && lang != ClanguageId && lang != SQLlanguageId;
+}
+
+/*
+ * needs_fmgr_hook: hook the functions in a procedural language
+ */
+static bool
+pgse_needs_fmgr_hook(Oid fn_oid)
+{
+	if (prev_needs_fmgr_hook && prev_needs_fmgr_hook(fn_oid))
+		return true;
+
+	return pgse_functions != NULL && is_tracked_function(fn_oid);
+}
+
+/*
+ * fmgr_hook: keep the stack of the executing functions of the backend.
+ * An error unwinds the stack before it is reported, so the innermost
+ * function aborted by the error is remembered for the report.
+ */
+static void
+pgse_fmgr_hook(FmgrHookEventType event, FmgrInfo *flinfo, Datum *private)
+{
+	switch (event)
+	{
+		case FHET_START:
+			function_failed = InvalidOid;
+			if (function_depth < PGSE_FUNCTION_DEPTH)
+				function_stack[function_depth] = flinfo->fn_oid;
+			function_depth++;
+			break;
+
+		case FHET_END:
+			if (function_depth > 0)
+				function_depth--;
+			break;
+
+		case FHET_ABORT:
+			if (!OidIsValid(function_failed))
+				function_failed = flinfo->fn_oid;
+			if (function_depth > 0)
+				function_depth--;
+			break;
+	}
+
+	if (prev_fmgr_hook)
+		(*prev_fmgr_hook) (event, flinfo, private);
+}
+
+/*
+ * An error caught by an exception block is not reported, forget its
+ * function
+ */
+static void
+pgse_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                      SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		function_failed = InvalidOid;
+}
+
+/*
+ * The function an error is attributed to, InvalidOid if none.  A warning
+ * is reported while its function executes.  Called for every error
+ * reported, so the failed function is never left for a later error.
+ */
+static Oid
+get_error_function(const ErrorData *edata)
+{
+	Oid     result = InvalidOid;
+
+	if (edata->elevel >= ERROR)
+	{
+		result = function_failed;
+		function_failed = InvalidOid;
+	}
+	else if (function_depth > 0 && function_depth <= PGSE_FUNCTION_DEPTH)
+		result = function_stack[function_depth - 1];
+
+	return result;
+}
+
+/*
+ * qsort comparator for sorting functions into increasing timestamp order
+ */
+static int
+function_cmp(const void *lhs, const void *rhs)
+{
+	TimestampTz  l_ts = (*(pgseFunction *const *) lhs)->last_time;
+	TimestampTz  r_ts = (*(pgseFunction *const *) rhs)->last_time;
+
+	if (l_ts < r_ts)
+		return -1;
+	else if (l_ts > r_ts)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * Deallocate the functions with the oldest errors.
+ *
+ * Caller must hold an exclusive lock on pgse->function_lock.
+ */
+static void
+function_dealloc(void)
+{
+	HASH_SEQ_STATUS  hash_seq;
+	pgseFunction     **functions;
+	pgseFunction     *function;
+	int              nvictims;
+	int              i;
+
+	functions = palloc(hash_get_num_entries(pgse_functions) * sizeof(pgseFunction *));
+
+	i = 0;
+
+	hash_seq_init(&hash_seq, pgse_functions);
+	while ((function = hash_seq_search(&hash_seq)) != NULL)
+	{
+		functions[i++] = function;
+	}
+
+	qsort(functions, i, sizeof(pgseFunction *), function_cmp);
+
+	nvictims = Max(2, i * PGSE_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, i);
+
+	for (i = 0; i < nvictims; i++)
+	{
+		hash_search(pgse_functions, &functions[i]->key, HASH_REMOVE, NULL);
+	}
+
+	pfree(functions);
+}
+
+/*
+ * Count an error of a function
+ */
+static void
+pgse_function_add(Oid funcid, Oid dbid, int ecode, TimestampTz etm)
+{
+	pgseFunctionKey key;
+	pgseFunction    *function;
+
+	memset(&key, 0, sizeof(key));
+	key.funcid = funcid;
+	key.dbid = dbid;
+	key.ecode = ecode;
+
+	LWLockAcquire(pgse->function_lock, LW_SHARED);
+
+	function = (pgseFunction *) hash_search(pgse_functions, &key, HASH_FIND, NULL);
+	if (!function)
+	{
+		bool    found;
+
+		/* Need exclusive lock to make a new hashtable entry - promote */
+		LWLockRelease(pgse->function_lock);
+		LWLockAcquire(pgse->function_lock, LW_EXCLUSIVE);
+
+		function = (pgseFunction *) hash_search(pgse_functions, &key, HASH_FIND, NULL);
+		if (!function)
+		{
+			while (hash_get_num_entries(pgse_functions) >= pgse_max_functions)
+				function_dealloc();
+
+			function = (pgseFunction *) hash_search(pgse_functions, &key, HASH_ENTER, &found);
+			SpinLockInit(&function->mutex);
+			function->errors = 0;
+			function->last_time = 0;
+		}
+	}
+
+	/* volatile block */
+	{
+		volatile pgseFunction *f = (volatile pgseFunction *) function;
+
+		SpinLockAcquire(&f->mutex);
+		f->errors++;
+		if (etm > f->last_time)
+			f->last_time = etm;
+		SpinLockRelease(&f->mutex);
+	}
+
+	LWLockRelease(pgse->function_lock);
+}
+
+/*
+ * Release all functions
+ */
+static void
+functions_reset(void)
+{
+	HASH_SEQ_STATUS  hash_seq;
+	pgseFunction     *function;
+
+	if (!pgse_functions)
+		return;
+
+	LWLockAcquire(pgse->function_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, pgse_functions);
+	while ((function = hash_seq_search(&hash_seq)) != NULL)
+	{
+		hash_search(pgse_functions, &function->key, HASH_REMOVE, NULL);
+	}
+
+	LWLockRelease(pgse->function_lock);
+}
+
+/*
+ * qsort comparator for sorting message templates into increasing timestamp
+ * order
+ */
+static int
+message_cmp(const void *lhs, const void *rhs)
+{
+	TimestampTz  l_ts = (*(pgseMessage *const *) lhs)->last_time;
+	TimestampTz  r_ts = (*(pgseMessage *const *) rhs)->last_time;
+
+	if (l_ts < r_ts)
+		return -1;
+	else if (l_ts > r_ts)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * Deallocate the message templates with the oldest errors.
+ *
+ * Caller must hold an exclusive lock on pgse->message_lock.
+ */
+static void
+message_dealloc(void)
+{
+	HASH_SEQ_STATUS  hash_seq;
+	pgseMessage      **messages;
+	pgseMessage      *message;
+	int              nvictims;
+	int              i;
+
+	messages = palloc(hash_get_num_entries(pgse_messages) * sizeof(pgseMessage *));
+
+	i = 0;
+
+	hash_seq_init(&hash_seq, pgse_messages);
+	while ((message = hash_seq_search(&hash_seq)) != NULL)
+	{
+		messages[i++] = message;
+	}
+
+	qsort(messages, i, sizeof(pgseMessage *), message_cmp);
+
+	nvictims = Max(2, i * PGSE_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, i);
+
+	for (i = 0; i < nvictims; i++)
+	{
+		hash_search(pgse_messages, &messages[i]->key, HASH_REMOVE, NULL);
+	}
+
+	pfree(messages);
+}
+
+/*
+ * Count an error by its message template.  The template is hashed by
+ * content: the same format string has different addresses in the
+ * libraries loaded by each backend.
+ */
+static void
+pgse_message_add(const pgseHashKey *ekey, const ErrorData *edata, TimestampTz etm)
+{
+	pgseMessageKey  key;
+	pgseMessage     *message;
+
+	memset(&key, 0, sizeof(key));
+	key.elevel = ekey->elevel;
+	key.ecode = ekey->ecode;
+	key.hash = DatumGetUInt32(hash_any((const unsigned char *) edata->message_id,
+	                                   strlen(edata->message_id)));
+
+	LWLockAcquire(pgse->message_lock, LW_SHARED);
+
+	message = (pgseMessage *) hash_search(pgse_messages, &key, HASH_FIND, NULL);
+	if (!message)
+	{
+		bool    found;
+		int     len;
+
+		/* Need exclusive lock to make a new hashtable entry - promote */
+		LWLockRelease(pgse->message_lock);
+		LWLockAcquire(pgse->message_lock, LW_EXCLUSIVE);
+
+		message = (pgseMessage *) hash_search(pgse_messages, &key, HASH_FIND, NULL);
+		if (!message)
+		{
+			while (hash_get_num_entries(pgse_messages) >= pgse_max_messages)
+				message_dealloc();
+
+			message = (pgseMessage *) hash_search(pgse_messages, &key, HASH_ENTER, &found);
+			SpinLockInit(&message->mutex);
+			message->errors = 0;
+			message->last_time = 0;
+			len = get_clipped_len(edata->message_id, PGSE_MESSAGE_LEN - 1);
+			memcpy(message->message_id, edata->message_id, len);
+			message->message_id[len] = '\0';
+			len = 0;
+			if (edata->message)
+			{
+				len = get_clipped_len(edata->message, PGSE_MESSAGE_LEN - 1);
+				memcpy(message->example, edata->message, len);
+			}
+			message->example[len] = '\0';
+		}
+	}
+
+	/* volatile block */
+	{
+		volatile pgseMessage *m = (volatile pgseMessage *) message;
+
+		SpinLockAcquire(&m->mutex);
+		m->errors++;
+		if (etm > m->last_time)
+			m->last_time = etm;
+		SpinLockRelease(&m->mutex);
+	}
+
+	LWLockRelease(pgse->message_lock);
+}
+
+/*
+ * Release all message templates
+ */
+static void
+messages_reset(void)
+{
+	HASH_SEQ_STATUS  hash_seq;
+	pgseMessage      *message;
+
+	if (!pgse_messages)
+		return;
+
+	LWLockAcquire(pgse->message_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, pgse_messages);
+	while ((message = hash_seq_search(&hash_seq)) != NULL)
+	{
+		hash_search(pgse_messages, &message->key, HASH_REMOVE, NULL);
+	}
+
+	LWLockRelease(pgse->message_lock);
+}
+
+
+/*
+ * Subscribers of the error events, see pg_stat_errors.h
+ */
+static int
+pgse_subscribe(const pgseSqlstateMask *mask, pgse_error_callback callback, void *arg)
+{
+	int     id;
+
+	for (id = 0; id < PGSE_MAX_SUBSCRIBERS; id++)
+	{
+		if (subscribers[id].callback == NULL)
+		{
+			subscribers[id].mask = *mask;
+			subscribers[id].arg = arg;
+			subscribers[id].callback = callback;
+			num_subscribers = Max(num_subscribers, id + 1);
+			return id;
+		}
+	}
+
+	return -1;
+}
+
+static void
+pgse_unsubscribe(int id)
+{
+	if (id < 0 || id >= PGSE_MAX_SUBSCRIBERS)
+		return;
+
+	subscribers[id].callback = NULL;
+	while (num_subscribers > 0 && subscribers[num_subscribers - 1].callback == NULL)
+		num_subscribers--;
+}
+
+/*
+ * Pass an error to the subscribers of its class.  An error raised by a
+ * callback is not passed to the subscribers again.
+ */
+static void
+pgse_notify_subscribers(const TimestampTz etm, const pgseHashKey *key, const char *query,
+                        const ErrorData *edata, bool counters, bool last)
+{
+	pgseErrorEvent  event;
+	int             id;
+
+	if (in_subscribers)
+		return;
+
+	event.etime = etm;
+	event.userid = key->userid;
+	event.dbid = key->dbid;
+	event.elevel = key->elevel;
+	event.sqlerrcode = key->ecode;
+	event.query = query;
+	event.message = edata->message ? edata->message : "";
+	event.counted = counters;
+	event.kept = last;
+
+	/* a callback raising an error must not leave the subscribers disabled */
+	in_subscribers = true;
+	PG_TRY();
+	{
+		for (id = 0; id < num_subscribers; id++)
+		{
+			pgseSubscriber *s = &subscribers[id];
+
+			if (s->callback != NULL && pgse_mask_test(&s->mask, key->ecode))
+				s->callback(&event, s->arg);
+		}
+	}
+	PG_CATCH();
+	{
+		in_subscribers = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	in_subscribers = false;
+}
+
+/*
+ * Whether an error is a lock conflict, enriched with the lock waited for
+ */
+static bool
+is_lock_error(int ecode)
+{
+	return ecode == ERRCODE_T_R_DEADLOCK_DETECTED ||
+	       ecode == ERRCODE_LOCK_NOT_AVAILABLE ||
+	       ecode == ERRCODE_T_R_SERIALIZATION_FAILURE;
+}
+
+static void
+lock_add_relation(pgseLockInfo *lock, Oid relid)
+{
+	int     i;
+
+	for (i = 0; i < lock->nrelations; i++)
+		if (lock->relations[i] == relid)
+			return;
+
+	if (lock->nrelations < PGSE_LOCK_MAX_RELATIONS)
+		lock->relations[lock->nrelations++] = relid;
+}
+
+static void
+lock_add_blocker(pgseLockInfo *lock, int pid)
+{
+	int     i;
+
+	for (i = 0; i < lock->nblockers; i++)
+		if (lock->blockers[i] == pid)
+			return;
+
+	if (lock->nblockers < PGSE_LOCK_MAX_BLOCKERS)
+		lock->blockers[lock->nblockers++] = pid;
+}
+
+/*
+ * The descriptions of the locks on a relation, see DescribeLockTag(), with
+ * the position of the relation in their arguments
+ */
+static const struct
+{
+	const char  *format;
+	int         relarg;
+} relation_lock_formats[] =
+{
+	{gettext_noop("relation %u of database %u"), 0},
+	{gettext_noop("extension of relation %u of database %u"), 0},
+	{gettext_noop("page %u of relation %u of database %u"), 1},
+	{gettext_noop("tuple (%u,%u) of relation %u of database %u"), 2}
+};
+
+/*
+ * Match a string against a format of the server, as translated, with %d,
+ * %u and %s conversions, numbered like %2$d or not.  A %s extends up to the
+ * text following it in the format.  The arguments are stored by position.
+ */
+static bool
+match_format(const char *fmt, const char *str, pgseFormatArg *args, int nargs)
+{
+	int     next = 0;
+
+	while (*fmt != '\0')
+	{
+		int     argno;
+		char    conv;
+
+		if (*fmt != '%' || fmt[1] == '%')
+		{
+			if (*str != *fmt)
+				return false;
+			fmt += (*fmt == '%') ? 2 : 1;
+			str++;
+			continue;
+		}
+
+		fmt++;
+		argno = next++;
+		if (isdigit((unsigned char) *fmt))
+		{
+			char    *p;
+			long    n = strtol(fmt, &p, 10);
+
+			if (*p == '$')
+			{
+				argno = (int) n - 1;
+				fmt = p + 1;
+			}
+		}
+		conv = *fmt++;
+
+		if (argno < 0 || argno >= nargs)
+			return false;
+
+		if (conv == 'd' || conv == 'u')
+		{
+			char    *p;
+
+			args[argno].value = strtol(str, &p, 10);
+			if (p == str)
+				return false;
+			str = p;
+		}
+		else if (conv == 's')
+		{
+			size_t      len = strcspn(fmt, "%");
+			const char  *p = str;
+
+			if (len > 0)
+			{
+				while (*p != '\0' && strncmp(p, fmt, len) != 0)
+					p++;
+				if (*p == '\0')
+					return false;
+			}
+			else
+				p += strlen(p);
+
+			args[argno].str = str;
+			args[argno].len = p - str;
+			str = p;
+		}
+		else
+			return false;
+	}
+
+	return *str == '\0';
+}
+
+/*
+ * Collect the relation and the blocking process of a line of the report of
+ * a deadlock, like "Process 123 waits for ShareLock on relation 16384 of
+ * database 5; blocked by process 456."
+ */
+static void
+parse_deadlock_line(const pgseFormatArg *args, pgseLockInfo *lock)
+{
+	char    tag[PGSE_DEADLOCK_LINE_LEN];
+	int     i;
+
+	if (args[2].len < sizeof(tag))
+	{
+		memcpy(tag, args[2].str, args[2].len);
+		tag[args[2].len] = '\0';
+
+		for (i = 0; i < (int) lengthof(relation_lock_formats); i++)
+		{
+			pgseFormatArg   tag_args[PGSE_FORMAT_MAX_ARGS];
+
+			if (match_format(_(relation_lock_formats[i].format), tag, tag_args, PGSE_FORMAT_MAX_ARGS))
+			{
+				lock_add_relation(lock, (Oid) tag_args[relation_lock_formats[i].relarg].value);
+				break;
+			}
+		}
+	}
+
+	if (args[3].value != MyProcPid)
+		lock_add_blocker(lock, (int) args[3].value);
+}
+
+/*
+ * Collect the relations and the processes of a deadlock from its report,
+ * the lines of this backend first.  The report is translated, so are the
+ * formats it is matched against.
+ */
+static void
+parse_deadlock_report(const char *report, pgseLockInfo *lock)
+{
+	const char  *waits = _("Process %d waits for %s on %s; blocked by process %d.");
+	int         pass;
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		const char *line = report;
+
+		while (*line != '\0')
+		{
+			const char      *end = strchr(line, '\n');
+			char            buf[PGSE_DEADLOCK_LINE_LEN];
+			pgseFormatArg   args[PGSE_FORMAT_MAX_ARGS];
+
+			if (end == NULL)
+				end = line + strlen(line);
+
+			if ((size_t) (end - line) < sizeof(buf))
+			{
+				memcpy(buf, line, end - line);
+				buf[end - line] = '\0';
+
+				if (match_format(waits, buf, args, PGSE_FORMAT_MAX_ARGS) &&
+				    (args[0].value == MyProcPid) == (pass == 0))
+					parse_deadlock_line(args, lock);
+			}
+
+			line = (*end != '\0') ? end + 1 : end;
+		}
+	}
+}
+
+/*
+ * Collect the lock conflict of an error.  The mode waited for and the
+ * duration of the wait are only known when the error ends the wait: a
+ * deadlock, detected by the wait itself, and a lock timeout.  Both remove
+ * MyProc from the wait queue before the error is reported, which clears
+ * its waitLock but leaves its waitLockMode.  Every lock wait arms the
+ * deadlock timeout and the lock timeout, whose start is the start of the
+ * wait.  The indicator of the lock timeout is reset before the report: the
+ * timeout is recognized by a wait of the statement at least as long as
+ * lock_timeout.  A serialization failure, or a lock not available with
+ * NOWAIT, does not end a wait: they are left unknown.  Only the report of a
+ * deadlock names the relations and the blocking processes.  Returns false
+ * if the error is not a lock conflict.
+ */
+static bool
+get_lock_info(const TimestampTz etm, const ErrorData *edata, pgseLockInfo *lock)
+{
+	TimestampTz stmt_start = GetCurrentStatementStartTimestamp();
+	TimestampTz wait_start = 0;
+
+	if (!is_lock_error(edata->sqlerrcode))
+		return false;
+
+	memset(lock, 0, sizeof(pgseLockInfo));
+	lock->lockmode = NoLock;
+	lock->wait_time = -1;
+
+	if (MyProc == NULL)
+		return true;
+
+	if (edata->sqlerrcode == ERRCODE_T_R_DEADLOCK_DETECTED)
+		wait_start = get_timeout_start_time(DEADLOCK_TIMEOUT);
+	else if (edata->sqlerrcode == ERRCODE_LOCK_NOT_AVAILABLE && LockTimeout > 0)
+	{
+		wait_start = get_timeout_start_time(LOCK_TIMEOUT);
+		if (wait_start == 0 ||
+		    etm - wait_start < (int64) LockTimeout * 1000)
+			wait_start = 0;
+	}
+
+	if (wait_start != 0 && wait_start >= stmt_start && wait_start <= etm)
+	{
+		lock->lockmode = MyProc->waitLockMode;
+		lock->wait_time = etm - wait_start;
+	}
+	else if (edata->sqlerrcode == ERRCODE_T_R_DEADLOCK_DETECTED)
+		lock->lockmode = MyProc->waitLockMode;
+
+	if (edata->sqlerrcode == ERRCODE_T_R_DEADLOCK_DETECTED && edata->detail_log)
+		parse_deadlock_report(edata->detail_log, lock);
+
+	return true;
+}
+
+/*
+ * qsort comparator for sorting relations into increasing timestamp order
+ */
+static int
+relation_cmp(const void *lhs, const void *rhs)
+{
+	TimestampTz  l_ts = (*(pgseRelation *const *) lhs)->last_time;
+	TimestampTz  r_ts = (*(pgseRelation *const *) rhs)->last_time;
+
+	if (l_ts < r_ts)
+		return -1;
+	else if (l_ts > r_ts)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * Deallocate the relations with the oldest errors.
+ *
+ * Caller must hold an exclusive lock on pgse->relation_lock.
+ */
+static void
+relation_dealloc(void)
+{
+	HASH_SEQ_STATUS  hash_seq;
+	pgseRelation     **relations;
+	pgseRelation     *relation;
+	int              nvictims;
+	int              i;
+
+	relations = palloc(hash_get_num_entries(pgse_relations) * sizeof(pgseRelation *));
+
+	i = 0;
+
+	hash_seq_init(&hash_seq, pgse_relations);
+	while ((relation = hash_seq_search(&hash_seq)) != NULL)
+	{
+		relations[i++] = relation;
+	}
+
+	qsort(relations, i, sizeof(pgseRelation *), relation_cmp);
+
+	nvictims = Max(2, i * PGSE_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, i);
+
+	for (i = 0; i < nvictims; i++)
+	{
+		hash_search(pgse_relations, &relations[i]->key, HASH_REMOVE, NULL);
+	}
+
+	pfree(relations);
+}
+
+/*
+ * Count a lock conflict of each relation of an error
+ */
+static void
+pgse_relations_add(const pgseHashKey *key, const pgseLockInfo *lock, TimestampTz etm)
+{
+	int     r;
+
+	LWLockAcquire(pgse->relation_lock, LW_EXCLUSIVE);
+
+	for (r = 0; r < lock->nrelations; r++)
+	{
+		pgseRelationKey rkey;
+		pgseRelation    *relation;
+		bool            found;
+
+		memset(&rkey, 0, sizeof(rkey));
+		rkey.relid = lock->relations[r];
+		rkey.dbid = key->dbid;
+		rkey.ecode = key->ecode;
+
+		relation = (pgseRelation *) hash_search(pgse_relations, &rkey, HASH_FIND, NULL);
+		if (!relation)
+		{
+			while (hash_get_num_entries(pgse_relations) >= pgse_max_relations)
+				relation_dealloc();
+
+			relation = (pgseRelation *) hash_search(pgse_relations, &rkey, HASH_ENTER, &found);
+			relation->errors = 0;
+			relation->waits = 0;
+			relation->wait_time = 0;
+			relation->last_time = 0;
+		}
+
+		relation->errors++;
+		if (lock->wait_time >= 0)
+		{
+			relation->waits++;
+			relation->wait_time += lock->wait_time;
+		}
+		if (etm > relation->last_time)
+			relation->last_time = etm;
+	}
+
+	LWLockRelease(pgse->relation_lock);
+}
+
+/*
+ * Release all relations
+ */
+static void
+relations_reset(void)
+{
+	HASH_SEQ_STATUS  hash_seq;
+	pgseRelation     *relation;
+
+	if (!pgse_relations)
+		return;
+
+	LWLockAcquire(pgse->relation_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, pgse_relations);
+	while ((relation = hash_seq_search(&hash_seq)) != NULL)
+	{
+		hash_search(pgse_relations, &relation->key, HASH_REMOVE, NULL);
+	}
+
+	LWLockRelease(pgse->relation_lock);
+}
+
+/*
+ * Columns of a value in the rows of the sketch, by double hashing
+ */
+static void
+sketch_columns(const char *value, uint32 *columns)
+{
+	uint32  h1 = DatumGetUInt32(hash_any((const unsigned char *) value, strlen(value)));
+	uint32  h2 = DatumGetUInt32(hash_uint32(h1)) | 1;
+	int     row;
+
+	for (row = 0; row < PGSE_SKETCH_DEPTH; row++)
+		columns[row] = (h1 + row * h2) % pgse_sketch_width;
+}
+
+/*
+ * Estimated number of errors of a value of the dimension, without any lock
+ */
+static uint64
+sketch_estimate(int dim, const char *value)
+{
+	uint32  columns[PGSE_SKETCH_DEPTH];
+	uint64  result;
+	int     row;
+
+	sketch_columns(value, columns);
+	result = pg_atomic_read_u64(pgse_sketch_counter(dim, 0, columns[0]));
+	for (row = 1; row < PGSE_SKETCH_DEPTH; row++)
+	{
+		uint64  count = pg_atomic_read_u64(pgse_sketch_counter(dim, row, columns[row]));
+
+		result = Min(result, count);
+	}
+
+	return result;
+}
+
+/*
+ * Count an error for a value of the dimension and put the value into the
+ * ring of recent values
+ */
+static void
+sketch_add(int dim, const char *value)
+{
+	uint32  columns[PGSE_SKETCH_DEPTH];
+	uint64  seqno;
+	int     row;
+
+	sketch_columns(value, columns);
+	for (row = 0; row < PGSE_SKETCH_DEPTH; row++)
+		pg_atomic_fetch_add_u64(pgse_sketch_counter(dim, row, columns[row]), 1);
+
+	seqno = pg_atomic_fetch_add_u64(&pgse_sketch->head, 1) + 1;
+
+	/* volatile block */
+	{
+		volatile pgseSketchValue *v = &pgse_sketch->recent[seqno % PGSE_SKETCH_RECENT];
+
+		SpinLockAcquire(&v->mutex);
+		v->seqno = seqno;
+		v->dim = dim;
+		strlcpy((char *) v->value, value, PGSE_SKETCH_VALUE_LEN);
+		SpinLockRelease(&v->mutex);
+	}
+}
+
+/*
+ * Count an error in the sketch for every dimension it has
+ */
+static void
+pgse_sketch_add_error(const ErrorData *edata)
+{
+	char    value[PGSE_SKETCH_VALUE_LEN];
+
+	if (edata->table_name)
+	{
+		if (edata->schema_name)
+			snprintf(value, sizeof(value), "%s.%s", edata->schema_name, edata->table_name);
+		else
+			strlcpy(value, edata->table_name, sizeof(value));
+		sketch_add(PGSE_DIM_RELATION, value);
+	}
+
+	if (edata->constraint_name)
+		sketch_add(PGSE_DIM_CONSTRAINT, edata->constraint_name);
+
+	if (MyProcPort && MyProcPort->remote_host)
+		sketch_add(PGSE_DIM_CLIENT, MyProcPort->remote_host);
+}
+
+/*
+ * Keep the recent values with the highest estimates as candidates.  Only
+ * the background worker writes the candidates, so it reads them without the
+ * lock.
+ */
+static void
+pgse_sketch_update_candidates(void)
+{
+	pgseSketch  *sk = pgse_sketch;
+	uint64      head = pg_atomic_read_u64(&sk->head);
+	uint64      s;
+
+	/* the older values have been overwritten, or the sketch was reset */
+	if (sk->drained > head || head - sk->drained > PGSE_SKETCH_RECENT)
+		sk->drained = (head > PGSE_SKETCH_RECENT) ? head - PGSE_SKETCH_RECENT : 0;
+
+	for (s = sk->drained + 1; s <= head; s++)
+	{
+		volatile pgseSketchValue *v = &sk->recent[s % PGSE_SKETCH_RECENT];
+		char        value[PGSE_SKETCH_VALUE_LEN];
+		int         dim;
+		int         n;
+		int         i;
+		int         victim = -1;
+		uint64      estimate;
+		uint64      lowest = 0;
+		bool        copied;
+
+		SpinLockAcquire(&v->mutex);
+		copied = (v->seqno == s);
+		if (copied)
+		{
+			dim = v->dim;
+			memcpy(value, (char *) v->value, PGSE_SKETCH_VALUE_LEN);
+		}
+		SpinLockRelease(&v->mutex);
+
+		/* the slot is claimed but not filled yet, continue from it next time */
+		if (!copied)
+			break;
+
+		sk->drained = s;
+
+		n = sk->ncandidates[dim];
+		for (i = 0; i < n; i++)
+			if (strcmp(sk->candidates[dim][i], value) == 0)
+				break;
+		if (i < n)
+			continue;
+
+		if (n < PGSE_SKETCH_CANDIDATES)
+			victim = n;
+		else
+		{
+			estimate = sketch_estimate(dim, value);
+			for (i = 0; i < n; i++)
+			{
+				uint64  e = sketch_estimate(dim, sk->candidates[dim][i]);
+
+				if (victim < 0 || e < lowest)
+				{
+					lowest = e;
+					victim = i;
+				}
+			}
+			if (estimate <= lowest)
+				continue;
+		}
+
+		SpinLockAcquire(&sk->mutex);
+		strlcpy(sk->candidates[dim][victim], value, PGSE_SKETCH_VALUE_LEN);
+		if (victim == n)
+			sk->ncandidates[dim]++;
+		SpinLockRelease(&sk->mutex);
+	}
+}
+
+/*
+ * Zero the sketch and forget the candidates
+ */
+static void
+sketch_reset(void)
+{
+	Size    ncounters = (Size) PGSE_SKETCH_DIMS * PGSE_SKETCH_DEPTH * pgse_sketch_width;
+	Size    c;
+
+	if (!pgse_sketch)
+		return;
+
+	for (c = 0; c < ncounters; c++)
+		pg_atomic_write_u64(&pgse_sketch->counters[c], 0);
+
+	SpinLockAcquire(&pgse_sketch->mutex);
+	memset(pgse_sketch->ncandidates, 0, sizeof(pgse_sketch->ncandidates));
+	SpinLockRelease(&pgse_sketch->mutex);
+}
+
+/*
+ * Find the slot of rollups for the error class, without any lock.
+ * Returns -1 if the class has not been seen yet.
+ */
+static int
+rollup_find_class(int eclass)
+{
+	volatile pgseRollups *r = &pgse->rollups;
+	int     n = r->nclasses;
+	int     i;
+
+	pg_read_barrier();
+
+	for (i = 0; i < n; i++)
+		if (r->classes[i] == eclass)
+			return i;
+
+	return -1;
+}
+
+/*
+ * Find the slot of rollups for the database, without any lock.
+ * Returns -1 if the database has not been seen yet.
+ */
+static int
+rollup_find_database(Oid dbid)
+{
+	volatile pgseRollups *r = &pgse->rollups;
+	int     n = r->ndatabases;
+	int     i;
+
+	pg_read_barrier();
+
+	for (i = 0; i < n; i++)
+		if (r->databases[i] == dbid)
+			return i;
+
+	return -1;
+}
+
+/*
+ * Claim the slot of rollups for the class or the database (the other one
+ * must be InvalidOid/-1).  Returns -1 if all slots are used.
+ */
+static int
+rollup_claim(int eclass, Oid dbid)
+{
+	volatile pgseSharedState *s = (volatile pgseSharedState *) pgse;
+	volatile pgseRollups *r = &s->rollups;
+	int     result;
+
+	SpinLockAcquire(&s->mutex);
+
+	/* somebody could claim it since our lock-free search */
+	result = (eclass >= 0) ? rollup_find_class(eclass) : rollup_find_database(dbid);
+
+	if (result < 0 && eclass >= 0 && r->nclasses < PGSE_MAX_CLASSES)
+	{
+		result = r->nclasses;
+		r->classes[result] = eclass;
+		pg_write_barrier();
+		r->nclasses = result + 1;
+	}
+	else if (result < 0 && eclass < 0 && r->ndatabases < PGSE_MAX_DATABASES)
+	{
+		result = r->ndatabases;
+		r->databases[result] = dbid;
+		pg_write_barrier();
+		r->ndatabases = result + 1;
+	}
+
+	SpinLockRelease(&s->mutex);
+
+	return result;
+}
+
+/*
+ * Find or claim the slot of rollups for the database, -1 if all slots are
+ * used.
+ */
+static int
+rollup_get_database(Oid dbid)
+{
+	int     slot = rollup_find_database(dbid);
+
+	if (slot < 0)
+		slot = rollup_claim(-1, dbid);
+
+	return slot;
+}
+
+/*
+ * Whether the database holds its quota of slots of the last errors.  The
+ * check is done before claiming a slot, so concurrent backends may exceed
+ * the quota by a few slots.
+ */
+static bool
+last_quota_full(Oid dbid)
+{
+	int     slot;
+
+	if (pgse_max_last_per_database <= 0)
+		return false;
+
+	slot = rollup_get_database(dbid);
+	if (slot < 0)
+		return false;
+
+	return pg_atomic_read_u32(&pgse->rollups.db_last[slot]) >= (uint32) pgse_max_last_per_database;
+}
+
+/*
+ * The oldest slot of the last errors of a database, searched among the
+ * PGSE_QUOTA_SCAN slots which follow the claimed one, the oldest of the
+ * ring.  Returns -1 if none is found.  The slots are read without lock,
+ * *seqno tells whether the error found is replaced meanwhile.
+ */
+static int
+last_quota_oldest(Oid dbid, uint32 c_eid, uint64 *seqno)
+{
+	int     n = Min(PGSE_QUOTA_SCAN, pgse_max_last - 1);
+	int     i;
+
+	for (i = 1; i <= n; i++)
+	{
+		uint32  eid = (c_eid + i) % pgse_max_last;
+		volatile pgseEntryError *e = (volatile pgseEntryError *) pgse_error_slot(eid);
+		uint64  s = e->error.seqno;
+
+		if (s != 0 && e->error.dbid == dbid)
+		{
+			*seqno = s;
+			return (int) eid;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Store the error of a database holding its quota of the last errors.  The
+ * error takes the claimed slot like any other one, so the slots stay in the
+ * order of their sequence numbers, and the error of another database held
+ * by that slot moves into the oldest slot of the database, whose error is
+ * dropped.  The error moved keeps its sequence number: the export worker
+ * does not find it again.
+ *
+ * Returns false when the claimed slot is empty or holds an error of the
+ * database, or when no slot of the database is among the oldest ones: the
+ * error is stored as any other one then.
+ */
+static bool
+last_quota_replace(uint32 c_eid, uint64 seqno, ErrorInfo *error,
+                   const char *query, const char *message)
+{
+	pgseEntryError *slot = pgse_error_slot(c_eid);
+	volatile pgseEntryError *e = (volatile pgseEntryError *) slot;
+	volatile pgseEntryError *o;
+	uint64      old_seqno;
+	int         old_eid;
+	bool        done = false;
+	int         d;
+
+	if (e->error.seqno == 0 || e->error.dbid == error->dbid)
+		return false;
+
+	old_eid = last_quota_oldest(error->dbid, c_eid, &old_seqno);
+	if (old_eid < 0)
+		return false;
+	o = (volatile pgseEntryError *) pgse_error_slot(old_eid);
+
+	/* the two slots are locked in the order of the ring */
+	if ((uint32) old_eid < c_eid)
+	{
+		SpinLockAcquire(&o->mutex);
+		SpinLockAcquire(&e->mutex);
+	}
+	else
+	{
+		SpinLockAcquire(&e->mutex);
+		SpinLockAcquire(&o->mutex);
+	}
+
+	if (o->error.seqno == old_seqno && o->error.dbid == error->dbid &&
+	    e->error.seqno != 0 && e->error.dbid != error->dbid)
+	{
+		pgse_begin_write(o);
+		memcpy((void *) &o->error, (const void *) &e->error,
+		       pgse_slot_size - offsetof(pgseEntryError, error));
+		pgse_end_write(o);
+
+		pgse_begin_write(e);
+		error->seqno = seqno;
+		memcpy((void *) &e->error, error, sizeof(ErrorInfo));
+		memcpy(pgse_error_query(slot), query, error->query_len);
+		memcpy(pgse_error_message(slot), message, error->message_len);
+		pgse_end_write(e);
+
+		done = true;
+	}
+
+	SpinLockRelease(&o->mutex);
+	SpinLockRelease(&e->mutex);
+
+	if (done && (d = rollup_find_database(error->dbid)) >= 0)
+		pg_atomic_fetch_add_u64(&pgse->rollups.db_last_replaced[d], 1);
+
+	return done;
+}
+
+/*
+ * Account a slot of the last errors moving from a database to another one,
+ * old_dbid is InvalidOid if the slot was empty.
+ */
+static void
+last_quota_move(Oid old_dbid, Oid dbid)
+{
+	int     slot;
+
+	if (OidIsValid(old_dbid) && (slot = rollup_find_database(old_dbid)) >= 0)
+	{
+		pg_atomic_uint32 *count = &pgse->rollups.db_last[slot];
+		uint32      old = pg_atomic_read_u32(count);
+
+		/* the slot may have been filled before the database had a rollup */
+		while (old > 0 && !pg_atomic_compare_exchange_u32(count, &old, old - 1))
+			;
+	}
+
+	if ((slot = rollup_get_database(dbid)) >= 0)
+		pg_atomic_fetch_add_u32(&pgse->rollups.db_last[slot], 1);
+}
+
+/*
+ * Total errors of a series of the history: the rollup of a class or of a
+ * database, summed over the levels
+ */
+static uint64
+history_series_total(int series)
+{
+	uint64  total = 0;
+	int     l;
+
+	for (l = 0; l < PGSE_NUM_LEVELS; l++)
+	{
+		if (series < PGSE_MAX_CLASSES)
+			total += pg_atomic_read_u64(&pgse->rollups.class_errors[l][series]);
+		else
+			total += pg_atomic_read_u64(&pgse->rollups.db_errors[series - PGSE_MAX_CLASSES][l]);
+	}
+
+	return total;
+}
+
+/*
+ * Claim the bucket of the time for all series, zeroing it if it held an
+ * older time.
+ *
+ * Caller must hold an exclusive lock on pgse->history_lock.
+ */
+static int
+history_bucket(int64 *starts, uint32 *counts, int nbuckets, int64 start)
+{
+	int     b = (int) (start % nbuckets);
+
+	if (starts[b] != start)
+	{
+		memset(&counts[b * PGSE_HISTORY_SERIES], 0, sizeof(uint32) * PGSE_HISTORY_SERIES);
+		starts[b] = start;
+	}
+
+	return b;
+}
+
+/*
+ * Roll the rollups up into the history: the errors since the last call are
+ * added to the buckets of the current minute and hour.  Called by the
+ * background worker, the errors themselves never touch the history.
+ */
+static void
+pgse_history_roll(void)
+{
+	volatile pgseRollups *r = &pgse->rollups;
+	pgseHistory *h = pgse_history;
+	TimestampTz now = GetCurrentTimestamp();
+	int         nclasses = r->nclasses;
+	int         ndatabases = r->ndatabases;
+	int         mb, hb;
+	int         s;
+
+	pg_read_barrier();
+
+	LWLockAcquire(pgse->history_lock, LW_EXCLUSIVE);
+
+	mb = history_bucket(h->minute_start, &h->minutes[0][0], PGSE_HISTORY_MINUTES,
+	                    now / USECS_PER_MINUTE);
+	hb = history_bucket(h->hour_start, &h->hours[0][0], PGSE_HISTORY_HOURS,
+	                    now / USECS_PER_HOUR);
+
+	for (s = 0; s < PGSE_HISTORY_SERIES; s++)
+	{
+		uint64  total;
+		uint64  delta;
+
+		if (s < PGSE_MAX_CLASSES ? s >= nclasses : s - PGSE_MAX_CLASSES >= ndatabases)
+			continue;
+
+		total = history_series_total(s);
+		/* the rollups have been reset */
+		delta = (total >= h->prev[s]) ? total - h->prev[s] : total;
+		h->prev[s] = total;
+
+		if (delta == 0)
+			continue;
+
+		h->minutes[mb][s] = (uint32) Min((uint64) h->minutes[mb][s] + delta, (uint64) PG_UINT32_MAX);
+		h->hours[hb][s] = (uint32) Min((uint64) h->hours[hb][s] + delta, (uint64) PG_UINT32_MAX);
+	}
+
+	LWLockRelease(pgse->history_lock);
+}
+
+/*
+ * Empty the history, with the rollups
+ */
+static void
+history_reset(void)
+{
+	if (!pgse_history)
+		return;
+
+	LWLockAcquire(pgse->history_lock, LW_EXCLUSIVE);
+	init_history();
+	LWLockRelease(pgse->history_lock);
+}
+
+/*
+ * Mark the buckets of the history as empty
+ */
+static void
+init_history(void)
+{
+	int     b;
+
+	memset(pgse_history, 0, sizeof(pgseHistory));
+	for (b = 0; b < PGSE_HISTORY_MINUTES; b++)
+		pgse_history->minute_start[b] = -1;
+	for (b = 0; b < PGSE_HISTORY_HOURS; b++)
+		pgse_history->hour_start[b] = -1;
+}
+
+/*
+ * Claim again the slots of rollups of the stats file, maybe with other
+ * numbers as the loaded entries and last errors have claimed theirs: map
+ * is indexed by the series of the file, see pgseHistory, and gives their
+ * new series, -1 if all slots are taken.
+ */
+static void
+rollups_map(const pgseRollups *rollups, int *map)
+{
+	int     s;
+
+	for (s = 0; s < PGSE_HISTORY_SERIES; s++)
+	{
+		if (s < PGSE_MAX_CLASSES)
+			map[s] = (s < rollups->nclasses) ?
+				rollup_claim(rollups->classes[s], InvalidOid) : -1;
+		else if (s - PGSE_MAX_CLASSES < rollups->ndatabases)
+		{
+			int     d = rollup_get_database(rollups->databases[s - PGSE_MAX_CLASSES]);
+
+			map[s] = (d >= 0) ? PGSE_MAX_CLASSES + d : -1;
+		}
+		else
+			map[s] = -1;
+	}
+}
+
+/*
+ * Add the counters of the rollups of the stats file to their new slots, the
+ * ones of a class or a database left without a slot to the others.  The
+ * entries and the last errors held by the databases are counted by their
+ * loading.
+ */
+static void
+rollups_load(pgseRollups *rollups, const int *map)
+{
+	pgseRollups *r = &pgse->rollups;
+	int         c, d, l;
+
+	for (l = 0; l < PGSE_NUM_LEVELS; l++)
+	{
+		pg_atomic_fetch_add_u64(&r->level_errors[l],
+		                        pg_atomic_read_u64(&rollups->level_errors[l]));
+		pg_atomic_fetch_add_u64(&r->class_other_errors[l],
+		                        pg_atomic_read_u64(&rollups->class_other_errors[l]));
+		pg_atomic_fetch_add_u64(&r->db_other_errors[l],
+		                        pg_atomic_read_u64(&rollups->db_other_errors[l]));
+
+		for (c = 0; c < rollups->nclasses; c++)
+		{
+			if (map[c] >= 0)
+				pg_atomic_fetch_add_u64(&r->class_errors[l][map[c]],
+				                        pg_atomic_read_u64(&rollups->class_errors[l][c]));
+			else
+				pg_atomic_fetch_add_u64(&r->class_other_errors[l],
+				                        pg_atomic_read_u64(&rollups->class_errors[l][c]));
+		}
+
+		for (d = 0; d < rollups->ndatabases; d++)
+		{
+			int     slot = map[PGSE_MAX_CLASSES + d];
+
+			if (slot >= 0)
+				pg_atomic_fetch_add_u64(&r->db_errors[slot - PGSE_MAX_CLASSES][l],
+				                        pg_atomic_read_u64(&rollups->db_errors[d][l]));
+			else
+				pg_atomic_fetch_add_u64(&r->db_other_errors[l],
+				                        pg_atomic_read_u64(&rollups->db_errors[d][l]));
+		}
+	}
+
+	for (d = 0; d < rollups->ndatabases; d++)
+	{
+		int     slot = map[PGSE_MAX_CLASSES + d];
+
+		if (slot < 0)
+			continue;
+		pg_atomic_fetch_add_u64(&r->db_evicted[slot - PGSE_MAX_CLASSES],
+		                        pg_atomic_read_u64(&rollups->db_evicted[d]));
+		pg_atomic_fetch_add_u64(&r->db_last_replaced[slot - PGSE_MAX_CLASSES],
+		                        pg_atomic_read_u64(&rollups->db_last_replaced[d]));
+	}
+}
+
+/*
+ * Merge the history of the stats file into the shared one, its series moved
+ * to their new slots of rollups, see rollups_map().  The rollups are loaded
+ * with it, so the series continue from their loaded totals.
+ */
+static void
+history_load(const int *map, const pgseHistory *loaded)
+{
+	int     s, b;
+
+	memcpy(pgse_history->minute_start, loaded->minute_start, sizeof(loaded->minute_start));
+	memcpy(pgse_history->hour_start, loaded->hour_start, sizeof(loaded->hour_start));
+
+	for (s = 0; s < PGSE_HISTORY_SERIES; s++)
+	{
+		if (map[s] < 0)
+			continue;
+		pgse_history->prev[map[s]] = loaded->prev[s];
+		for (b = 0; b < PGSE_HISTORY_MINUTES; b++)
+			pgse_history->minutes[b][map[s]] = loaded->minutes[b][s];
+		for (b = 0; b < PGSE_HISTORY_HOURS; b++)
+			pgse_history->hours[b][map[s]] = loaded->hours[b][s];
+	}
+}
+
+/*
+ * Update the rollups of errors.  No lock is taken but the first time the
+ * backend sees the class or the database.
+ */
+static void
+pgse_update_rollups(const pgseHashKey *key)
+{
+	int     level = get_level_index(key->elevel);
+	int     eclass = ERRCODE_TO_CATEGORY(key->ecode);
+	int     slot;
+
+	if (level < 0)
+		return;
+
+	pg_atomic_fetch_add_u64(&pgse->rollups.level_errors[level], 1);
+
+	/* by level and class */
+	if (class_slots[eclass] == 0)
+	{
+		slot = rollup_find_class(eclass);
+		if (slot < 0)
+			slot = rollup_claim(eclass, InvalidOid);
+		class_slots[eclass] = (slot >= 0) ? slot + 1 : PGSE_NO_SLOT;
+	}
+	if (class_slots[eclass] != PGSE_NO_SLOT)
+		pg_atomic_fetch_add_u64(&pgse->rollups.class_errors[level][class_slots[eclass] - 1], 1);
+	else
+		pg_atomic_fetch_add_u64(&pgse->rollups.class_other_errors[level], 1);
+
+	/* by database and level */
+	if (db_slot == 0 || db_slot_dbid != key->dbid)
+	{
+		slot = rollup_find_database(key->dbid);
+		if (slot < 0)
+			slot = rollup_claim(-1, key->dbid);
+		db_slot = (slot >= 0) ? slot + 1 : PGSE_NO_SLOT;
+		db_slot_dbid = key->dbid;
+	}
+	if (db_slot != PGSE_NO_SLOT)
+		pg_atomic_fetch_add_u64(&pgse->rollups.db_errors[db_slot - 1][level], 1);
+	else
+		pg_atomic_fetch_add_u64(&pgse->rollups.db_other_errors[level], 1);
+}
+
+/*
+ * Add the cost of a timed call of the hook, started at start
+ */
+static void
+pgse_governor_add(instr_time start)
+{
+	pgseShard   *shard = get_shard();
+	instr_time  duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	pg_atomic_fetch_add_u64(&shard->c.hook_cost,
+	                        (uint64) (INSTR_TIME_GET_DOUBLE(duration) * 1000000000.0));
+	pg_atomic_fetch_add_u64(&shard->c.hook_samples, 1);
+}
+
+/*
+ * Close the window of the governor if it is over, and move the tier.
+ *
+ * The CPU time of the hook per second is estimated from the timed calls,
+ * one in PGSE_GOVERNOR_SAMPLE.  Over pg_stat_errors.governor_budget, the
+ * governor steps one tier down; under it, it steps up while the last cost
+ * measured in the upper tier, at the current rate of errors, would fit in
+ * PGSE_GOVERNOR_STEP_UP of the budget.  Only the backend which moves the
+ * start of the window does it, no lock is taken.  The background worker
+ * also closes the windows without errors, so that the tier steps back up
+ * once the errors stop.
+ */
+static void
+pgse_governor_update(TimestampTz etm)
+{
+	pgseGovernor    *gov = &pgse->governor;
+	uint64          start = pg_atomic_read_u64(&gov->window_start);
+	uint64          cost = 0;
+	uint64          samples = 0;
+	double          elapsed;        /* s */
+	double          rate;           /* errors per second */
+	double          load;           /* ms of CPU per second */
+	double          budget = pgse_governor_budget;
+	uint32          tier;
+	uint32          new_tier;
+	int             shard;
+
+	if ((int64) start + PGSE_GOVERNOR_WINDOW > etm)
+		return;
+	if (!pg_atomic_compare_exchange_u64(&gov->window_start, &start, (uint64) etm))
+		return;
+
+	for (shard = 0; shard < PGSE_NUM_SHARDS; shard++)
+	{
+		cost += pg_atomic_exchange_u64(&pgse->shards[shard].c.hook_cost, 0);
+		samples += pg_atomic_exchange_u64(&pgse->shards[shard].c.hook_samples, 0);
+	}
+
+	/* the first window starts now */
+	if (start == 0)
+		return;
+
+	elapsed = (double) (etm - (int64) start) / USECS_PER_SEC;
+	rate = (double) samples * PGSE_GOVERNOR_SAMPLE / elapsed;
+	load = (double) cost * PGSE_GOVERNOR_SAMPLE / elapsed / 1000000.0;
+
+	tier = pg_atomic_read_u32(&gov->tier);
+	if (samples > 0)
+	{
+		pg_atomic_write_u64(&gov->cost, cost / samples);
+		pg_atomic_write_u64(&gov->tier_cost[tier], cost / samples);
+	}
+	else
+		pg_atomic_write_u64(&gov->cost, 0);
+
+	new_tier = tier;
+	if (load > budget)
+	{
+		if (new_tier < PGSE_TIER_SHARDED)
+			new_tier++;
+	}
+	else
+	{
+		while (new_tier > PGSE_TIER_FULL)
+		{
+			uint64  upper_cost = pg_atomic_read_u64(&gov->tier_cost[new_tier - 1]);
+
+			if (rate * upper_cost / 1000000.0 >= budget * PGSE_GOVERNOR_STEP_UP)
+				break;
+			new_tier--;
+		}
+	}
+
+	if (new_tier != tier)
+	{
+		pg_atomic_write_u32(&gov->tier, new_tier);
+		pg_atomic_fetch_add_u64(&gov->transitions, 1);
+		pg_atomic_write_u64(&gov->changed, (uint64) etm);
+	}
+}
+
+/*
+ * Store some statistics for key and whole database cluster, as much as the
+ * tier of the governor allows
+ */
+static void
+pgse_store(const TimestampTz etm, const char *query, const ErrorData *edata,
+           const pgseHashKey *key, bool counters, bool last, int tier)
+{
+	pgseEntry        *entry;
+	pgseLockInfo     lock;
+	bool             has_lock;
+	ErrorInfo        error;
+	const char       *message;
+
+	/* Safety check ... */
+	if ( !isInitialized() || !edata )
+		return;
+
+	message = edata->message ? edata->message : "";
+
+	/* The cheapest tier keeps the counters updated without any lock only */
+	if (tier == PGSE_TIER_SHARDED)
+	{
+		if (counters)
+		{
+			pgse_update_rollups(key);
+			pg_atomic_fetch_add_u64(&get_shard()->c.total_errors, 1);
+		}
+		return;
+	}
+
+	has_lock = get_lock_info(etm, edata, &lock);
+
+	/* The lock conflicts by relation have their own lock */
+	if (counters && has_lock && pgse_relations && lock.nrelations > 0)
+		pgse_relations_add(key, &lock, etm);
+
+	/* The rollups are maintained without the lock */
+	if (counters)
+		pgse_update_rollups(key);
+
+	/* The heavy hitters have their own lock */
+	if (counters && pgse_topk_state)
+		pgse_topk_add(key);
+
+	/* The sketch is maintained without any lock */
+	if (counters && pgse_sketch)
+		pgse_sketch_add_error(edata);
+
+	if (last)
+	{
+		init_error_info(&error, etm, key->dbid, key->userid, query, message, edata,
+		                has_lock ? &lock : NULL);
+
+		/* a retry of the same failing statement only bumps its slot */
+		if (pgse_dedup_window > 0)
+		{
+			LWLockAcquire(pgse->lock, LW_SHARED);
+			last = !pgse_repeat_error(&error, query, message);
+			LWLockRelease(pgse->lock);
+		}
+
+		/* a new slot: compress its query before taking the lock */
+		if (last)
+			query = pack_query(&error, query, get_compress_buffer());
+	}
+
+	if (!counters && !last)
+		return;
+
+	/* Lookup the hash table entry with shared lock. */
+	LWLockAcquire(pgse->lock, LW_SHARED);
+
+	if (counters)
+	{
+		entry = (pgseEntry *) hash_search(pgse_hash, key, HASH_FIND, NULL);
+
+		/* Create new entry, if not present */
+		if (!entry)
+		{
+			/* Need exclusive lock to make a new hashtable entry - promote */
+			LWLockRelease(pgse->lock);
+			LWLockAcquire(pgse->lock, LW_EXCLUSIVE);
+
+			/* OK to create a new hashtable entry */
+			entry = entry_alloc((pgseHashKey *) key);
+		}
+
+		pgse_update_counters(etm, entry, edata);
+	}
+
+	/* store last errors */
+	if (last)
+		pgse_store_error(&error, query, message);
+
+	LWLockRelease(pgse->lock);
+}
+
+
+
+
+/*
+ * Total errors
+ */
+Datum
+pg_stat_errors_total_errors(PG_FUNCTION_ARGS)
+{
+	uint64 result;
+	pgseGlobalStats stats;
+
+	get_global_stats(&result, &stats);
+
+	PG_RETURN_INT64((int64) result);
+}
+
+
+/*
+ * Build an array of OIDs
+ */
+static ArrayType *
+get_oid_array(const Oid *oids, int n)
+{
+	Datum  *elems = (Datum *) palloc(sizeof(Datum) * n);
+	int     i;
+
+	for (i = 0; i < n; i++)
+		elems[i] = ObjectIdGetDatum(oids[i]);
+
+	return construct_array(elems, n, OIDOID, sizeof(Oid), true, 'i');
+}
+
+/*
+ * Build an array of integers
+ */
+static ArrayType *
+get_int4_array(const int32 *ints, int n)
+{
+	Datum  *elems = (Datum *) palloc(sizeof(Datum) * n);
+	int     i;
+
+	for (i = 0; i < n; i++)
+		elems[i] = Int32GetDatum(ints[i]);
+
+	return construct_array(elems, n, INT4OID, sizeof(int32), true, 'i');
+}
+
+
+/*
+ * Get error code as text
+ */
+static char *
+get_code_as_text(int ecode)
+{
+	static char    ecode_text[SQLSTATE_LEN] = {0};
+
+	snprintf(ecode_text, SQLSTATE_LEN, "%s", unpack_sql_state(ecode));
+
+	return ecode_text;
+}
+
+/*
+ * Get error message
+ */
+static char *
+get_message_by_code(int ecode)
+{
+	char    *result = "";
+
+	switch (ecode)
+	{
+#include "ecodes.inc"
+		default:
+			result = "unknown";
+	}
+
+	return result;
+}
+
+/*
+ * Get error level as text
+ * WARNING, ERROR, FATAL, PANIC error level codes are allowed
+ */
+static char *
+get_level_as_text(int elevel)
+{
+	char    *elevel_text = "";
+
+	switch (elevel)
+	{
+		case WARNING:
+			elevel_text = "WARNING";
+			break;
+		case ERROR:
+			elevel_text = "ERROR";
+			break;
+		case FATAL:
+			elevel_text = "FATAL";
+			break;
+		case PANIC:
+			elevel_text = "PANIC";
+			break;
+		/* should never happen */
+		default:
+			elog(LOG, "pg_stat_errors: %s(): incorrect error level code. [%d]", __FUNCTION__, elevel);
+	}
+
+	return elevel_text;
+}
+
+
+/*
+ * Get the index of the error level in the rollups, -1 for other levels
+ */
+static int
+get_level_index(int elevel)
+{
+	switch (elevel)
+	{
+		case WARNING:
+			return 0;
+		case ERROR:
+			return 1;
+		case FATAL:
+			return 2;
+		case PANIC:
+			return 3;
+		default:
+			return -1;
+	}
+}
+
+
+/* Number of output arguments (columns) for pg_stat_errors_info */
+#define PG_STAT_ERRORS_INFO_COLS    9
+
+/*
+ * Return statistics of pg_stat_errors.
+ */
+Datum
+pg_stat_errors_info(PG_FUNCTION_ARGS)
+{
+	pgseGlobalStats stats;
+	uint64          total_errors;
+	TupleDesc       tupdesc;
+	Datum           values[PG_STAT_ERRORS_INFO_COLS];
+	bool            nulls[PG_STAT_ERRORS_INFO_COLS];
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		        errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	/* Read global statistics for pg_stat_errors */
+	get_global_stats(&total_errors, &stats);
+
+	values[0] = Int64GetDatum(stats.dealloc);
+	values[1] = TimestampTzGetDatum(stats.stats_reset);
+
+	/* compression of the queries of the last errors */
+	{
+		uint64  raw_bytes = 0;
+		uint64  stored_bytes = 0;
+		uint64  compress_time = 0;
+		int     shard;
+
+		for (shard = 0; shard < PGSE_NUM_SHARDS; shard++)
+		{
+			raw_bytes += pg_atomic_read_u64(&pgse->shards[shard].c.query_raw_bytes);
+			stored_bytes += pg_atomic_read_u64(&pgse->shards[shard].c.query_stored_bytes);
+			compress_time += pg_atomic_read_u64(&pgse->shards[shard].c.compress_time);
+		}
+
+		if (pgse_query_compression == PGSE_COMPRESSION_OFF || stored_bytes == 0)
+			nulls[2] = true;
+		else
+			values[2] = Float8GetDatum((double) raw_bytes / stored_bytes);
+
+		if (pgse_query_compression == PGSE_COMPRESSION_OFF)
+			nulls[3] = true;
+		else
+			values[3] = Float8GetDatum((double) compress_time / 1000.0);
+	}
+
+	/* overhead governor */
+	if (pgse_governor_budget > 0)
+	{
+		uint64  degraded = 0;
+		uint64  changed = pg_atomic_read_u64(&pgse->governor.changed);
+		int     shard;
+
+		for (shard = 0; shard < PGSE_NUM_SHARDS; shard++)
+			degraded += pg_atomic_read_u64(&pgse->shards[shard].c.degraded);
+
+		values[4] = CStringGetTextDatum(pgse_tier_names[pg_atomic_read_u32(&pgse->governor.tier)]);
+		values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&pgse->governor.transitions));
+		if (changed == 0)
+			nulls[6] = true;
+		else
+			values[6] = TimestampTzGetDatum((TimestampTz) changed);
+		values[7] = Float8GetDatum((double) pg_atomic_read_u64(&pgse->governor.cost) / 1000.0);
+		values[8] = Int64GetDatum((int64) degraded);
+	}
+	else
+	{
+		nulls[4] = true;
+		nulls[5] = true;
+		nulls[6] = true;
+		nulls[7] = true;
+		nulls[8] = true;
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+#define PG_STAT_ERRORS_DATABASES_COLS   5
+
+/*
+ * Return the usage of the quotas by database
+ */
+Datum
+pg_stat_errors_databases(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	HASH_SEQ_STATUS     hash_seq;
+	pgseEntry           *entry;
+	int64               entries[PGSE_MAX_DATABASES];
+	int                 ndatabases;
+	int                 d;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_DATABASES_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* count the entries of the databases having a slot of rollups */
+	memset(entries, 0, sizeof(entries));
+
+	LWLockAcquire(pgse->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pgse_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		d = rollup_find_database(entry->key.dbid);
+		if (d >= 0)
+			entries[d]++;
+	}
+
+	LWLockRelease(pgse->lock);
+
+	ndatabases = ((volatile pgseRollups *) &pgse->rollups)->ndatabases;
+	pg_read_barrier();
+
+	for (d = 0; d < ndatabases; d++)
+	{
+		Datum           values[PG_STAT_ERRORS_DATABASES_COLS];
+		bool            nulls[PG_STAT_ERRORS_DATABASES_COLS];
+		int             i = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(pgse->rollups.databases[d]);
+		values[i++] = Int64GetDatumFast(entries[d]);
+		values[i++] = Int64GetDatum((int64) pg_atomic_read_u64(&pgse->rollups.db_evicted[d]));
+		values[i++] = Int64GetDatum((int64) pg_atomic_read_u32(&pgse->rollups.db_last[d]));
+		values[i++] = Int64GetDatum((int64) pg_atomic_read_u64(&pgse->rollups.db_last_replaced[d]));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum)0;
+}
+
+
+/*
+ * Rollups of errors by class, by level and by database
+ *
+ * They are maintained by pgse_update_rollups() for every error counted,
+ * independently of the entries of pgse_hash, so they stay exact when the
+ * entries are evicted.  Reading them costs O(classes) or O(databases),
+ * without any lock.
+ */
+static const int rollup_levels[PGSE_NUM_LEVELS] = {WARNING, ERROR, FATAL, PANIC};
+
+#define PG_STAT_ERRORS_BY_CLASS_COLS    4
+
+/*
+ * Return the errors by level and class.  The classes beyond the first 64
+ * are summed in a row with a NULL class.
+ */
+Datum
+pg_stat_errors_by_class(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	int                 nclasses;
+	int                 l, c;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_BY_CLASS_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	nclasses = ((volatile pgseRollups *) &pgse->rollups)->nclasses;
+	pg_read_barrier();
+
+	for (l = 0; l < PGSE_NUM_LEVELS; l++)
+	{
+		for (c = 0; c <= nclasses; c++)
+		{
+			Datum           values[PG_STAT_ERRORS_BY_CLASS_COLS];
+			bool            nulls[PG_STAT_ERRORS_BY_CLASS_COLS];
+			uint64          errors;
+			int             i = 0;
+
+			if (c < nclasses)
+				errors = pg_atomic_read_u64(&pgse->rollups.class_errors[l][c]);
+			else
+				errors = pg_atomic_read_u64(&pgse->rollups.class_other_errors[l]);
+			if (errors == 0)
+				continue;
+
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			values[i++] = CStringGetTextDatum(get_level_as_text(rollup_levels[l]));
+			if (c < nclasses)
+			{
+				int     eclass = pgse->rollups.classes[c];
+				char    eclass_text[4] = {0};
+
+				strncpy(eclass_text, get_code_as_text(eclass), 2);
+				values[i++] = CStringGetTextDatum(eclass_text);
+				values[i++] = CStringGetTextDatum(get_message_by_code(eclass));
+			}
+			else
+			{
+				nulls[i++] = true;
+				nulls[i++] = true;
+			}
+			values[i++] = Int64GetDatum((int64) errors);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum)0;
+}
+
+
+#define PG_STAT_ERRORS_BY_LEVEL_COLS    2
+
+/*
+ * Return the errors by level
+ */
+Datum
+pg_stat_errors_by_level(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	int                 l;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_BY_LEVEL_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (l = 0; l < PGSE_NUM_LEVELS; l++)
+	{
+		Datum           values[PG_STAT_ERRORS_BY_LEVEL_COLS];
+		bool            nulls[PG_STAT_ERRORS_BY_LEVEL_COLS];
+		int             i = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = CStringGetTextDatum(get_level_as_text(rollup_levels[l]));
+		values[i++] = Int64GetDatum((int64) pg_atomic_read_u64(&pgse->rollups.level_errors[l]));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum)0;
+}
+
+
+#define PG_STAT_ERRORS_BY_DATABASE_COLS 3
+
+/*
+ * Return the errors by database and level.  The databases beyond the
+ * first 64 are summed in a row with a NULL dbid.
+ */
+Datum
+pg_stat_errors_by_database(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	int                 ndatabases;
+	int                 l, d;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_BY_DATABASE_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	ndatabases = ((volatile pgseRollups *) &pgse->rollups)->ndatabases;
+	pg_read_barrier();
+
+	for (d = 0; d <= ndatabases; d++)
+	{
+		for (l = 0; l < PGSE_NUM_LEVELS; l++)
+		{
+			Datum           values[PG_STAT_ERRORS_BY_DATABASE_COLS];
+			bool            nulls[PG_STAT_ERRORS_BY_DATABASE_COLS];
+			uint64          errors;
+			int             i = 0;
+
+			if (d < ndatabases)
+				errors = pg_atomic_read_u64(&pgse->rollups.db_errors[d][l]);
+			else
+				errors = pg_atomic_read_u64(&pgse->rollups.db_other_errors[l]);
+			if (errors == 0)
+				continue;
+
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			if (d < ndatabases)
+				values[i++] = ObjectIdGetDatum(pgse->rollups.databases[d]);
+			else
+				nulls[i++] = true;
+			values[i++] = CStringGetTextDatum(get_level_as_text(rollup_levels[l]));
+			values[i++] = Int64GetDatum((int64) errors);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum)0;
+}
+
+
+#define PG_STAT_ERRORS_HISTORY_COLS     4
+
+/*
+ * Return the errors by class and by database of the buckets of the history
+ * ending after since, the oldest first.  Only the buckets with errors are
+ * returned.
+ */
+Datum
+pg_stat_errors_history(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	char                *resolution = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	TimestampTz         since = PG_GETARG_TIMESTAMPTZ(1);
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	volatile pgseRollups *r;
+	int                 nbuckets;
+	int64               unit;
+	int64               *starts;
+	uint32              *counts;
+	int                 nclasses, ndatabases;
+	int64               latest = -1;
+	int                 b, k, s;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	if (pg_strcasecmp(resolution, "minute") == 0)
+	{
+		nbuckets = PGSE_HISTORY_MINUTES;
+		unit = USECS_PER_MINUTE;
+	}
+	else if (pg_strcasecmp(resolution, "hour") == 0)
+	{
+		nbuckets = PGSE_HISTORY_HOURS;
+		unit = USECS_PER_HOUR;
+	}
+	else
+		ereport(ERROR,
+		        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		         errmsg("invalid resolution \"%s\"", resolution),
+		         errhint("Valid resolutions are \"minute\" and \"hour\".")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_HISTORY_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (!pgse_history)
+		return (Datum) 0;
+
+	r = &pgse->rollups;
+	nclasses = r->nclasses;
+	ndatabases = r->ndatabases;
+	pg_read_barrier();
+
+	/* copy the buckets of the resolution */
+	starts = (int64 *) palloc(sizeof(int64) * nbuckets);
+	counts = (uint32 *) palloc(sizeof(uint32) * nbuckets * PGSE_HISTORY_SERIES);
+
+	LWLockAcquire(pgse->history_lock, LW_SHARED);
+	if (nbuckets == PGSE_HISTORY_MINUTES)
+	{
+		memcpy(starts, pgse_history->minute_start, sizeof(int64) * nbuckets);
+		memcpy(counts, pgse_history->minutes, sizeof(uint32) * nbuckets * PGSE_HISTORY_SERIES);
+	}
+	else
+	{
+		memcpy(starts, pgse_history->hour_start, sizeof(int64) * nbuckets);
+		memcpy(counts, pgse_history->hours, sizeof(uint32) * nbuckets * PGSE_HISTORY_SERIES);
+	}
+	LWLockRelease(pgse->history_lock);
+
+	for (b = 0; b < nbuckets; b++)
+		latest = Max(latest, starts[b]);
+
+	/* from the bucket after the latest one, i.e. the oldest one */
+	for (k = 1; latest >= 0 && k <= nbuckets; k++)
+	{
+		b = (int) ((latest + k) % nbuckets);
+
+		/* a bucket can hold an older time than the ring covers */
+		if (starts[b] < 0 || starts[b] <= latest - nbuckets ||
+		    (starts[b] + 1) * unit <= since)
+			continue;
+
+		for (s = 0; s < PGSE_HISTORY_SERIES; s++)
+		{
+			Datum       values[PG_STAT_ERRORS_HISTORY_COLS];
+			bool        nulls[PG_STAT_ERRORS_HISTORY_COLS];
+			uint32      errors = counts[b * PGSE_HISTORY_SERIES + s];
+			int         i = 0;
+
+			if (errors == 0)
+				continue;
+
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			values[i++] = TimestampTzGetDatum(starts[b] * unit);
+			if (s < PGSE_MAX_CLASSES)
+			{
+				char    eclass_text[3];
+
+				if (s >= nclasses)
+					continue;
+				strlcpy(eclass_text, get_code_as_text(r->classes[s]), sizeof(eclass_text));
+				values[i++] = CStringGetTextDatum(eclass_text);
+				nulls[i++] = true;
+			}
+			else
+			{
+				if (s - PGSE_MAX_CLASSES >= ndatabases)
+					continue;
+				nulls[i++] = true;
+				values[i++] = ObjectIdGetDatum(r->databases[s - PGSE_MAX_CLASSES]);
+			}
+			values[i++] = Int64GetDatum((int64) errors);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum)0;
+}
+
+
+#define PG_STAT_ERRORS_FUNCTIONS_COLS   5
+
+/*
+ * Return the errors by function
+ */
+Datum
+pg_stat_errors_functions(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	HASH_SEQ_STATUS     hash_seq;
+	pgseFunction        *function;
+	pgseFunction        *functions;
+	long                n = 0;
+	long                j;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_FUNCTIONS_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (!pgse_functions)
+		return (Datum) 0;
+
+	/* copy the functions, the tuples are formed after releasing the lock */
+	LWLockAcquire(pgse->function_lock, LW_SHARED);
+
+	functions = (pgseFunction *)
+		palloc(sizeof(pgseFunction) * Max(hash_get_num_entries(pgse_functions), 1));
+
+	hash_seq_init(&hash_seq, pgse_functions);
+	while ((function = hash_seq_search(&hash_seq)) != NULL)
+	{
+		volatile pgseFunction *f = (volatile pgseFunction *) function;
+
+		functions[n].key = function->key;
+		SpinLockAcquire(&f->mutex);
+		functions[n].errors = f->errors;
+		functions[n].last_time = f->last_time;
+		SpinLockRelease(&f->mutex);
+		n++;
+	}
+
+	LWLockRelease(pgse->function_lock);
+
+	for (j = 0; j < n; j++)
+	{
+		Datum           values[PG_STAT_ERRORS_FUNCTIONS_COLS];
+		bool            nulls[PG_STAT_ERRORS_FUNCTIONS_COLS];
+		int             i = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(functions[j].key.funcid);
+		values[i++] = ObjectIdGetDatum(functions[j].key.dbid);
+		values[i++] = CStringGetTextDatum(get_code_as_text(functions[j].key.ecode));
+		values[i++] = Int64GetDatumFast(functions[j].errors);
+		values[i++] = TimestampTzGetDatum(functions[j].last_time);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum)0;
+}
+
+
+#define PG_STAT_ERRORS_MESSAGES_COLS    6
+
+/*
+ * Return the errors by message template
+ */
+Datum
+pg_stat_errors_messages(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	HASH_SEQ_STATUS     hash_seq;
+	pgseMessage         *message;
+	pgseMessage         *messages;
+	long                n = 0;
+	long                j;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_MESSAGES_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (!pgse_messages)
+		return (Datum) 0;
+
+	/* copy the templates, the tuples are formed after releasing the lock */
+	LWLockAcquire(pgse->message_lock, LW_SHARED);
+
+	messages = (pgseMessage *)
+		palloc(sizeof(pgseMessage) * Max(hash_get_num_entries(pgse_messages), 1));
+
+	hash_seq_init(&hash_seq, pgse_messages);
+	while ((message = hash_seq_search(&hash_seq)) != NULL)
+	{
+		volatile pgseMessage *m = (volatile pgseMessage *) message;
+
+		memcpy(&messages[n], message, sizeof(pgseMessage));
+		SpinLockAcquire(&m->mutex);
+		messages[n].errors = m->errors;
+		messages[n].last_time = m->last_time;
+		SpinLockRelease(&m->mutex);
+		n++;
+	}
+
+	LWLockRelease(pgse->message_lock);
+
+	for (j = 0; j < n; j++)
+	{
+		Datum           values[PG_STAT_ERRORS_MESSAGES_COLS];
+		bool            nulls[PG_STAT_ERRORS_MESSAGES_COLS];
+		int             i = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = CStringGetTextDatum(get_level_as_text(messages[j].key.elevel));
+		values[i++] = CStringGetTextDatum(get_code_as_text(messages[j].key.ecode));
+		values[i++] = CStringGetTextDatum(messages[j].message_id);
+		values[i++] = Int64GetDatumFast(messages[j].errors);
+		values[i++] = TimestampTzGetDatum(messages[j].last_time);
+		values[i++] = CStringGetTextDatum(messages[j].example);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum)0;
+}
+
+
+#define PG_STAT_ERRORS_RELATIONS_COLS   7
+
+/*
+ * Return the lock conflicts by relation
+ */
+Datum
+pg_stat_errors_relations(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	HASH_SEQ_STATUS     hash_seq;
+	pgseRelation        *relation;
+	pgseRelation        *relations;
+	long                n = 0;
+	long                j;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_RELATIONS_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (!pgse_relations)
+		return (Datum) 0;
+
+	/* copy the relations, the tuples are formed after releasing the lock */
+	LWLockAcquire(pgse->relation_lock, LW_SHARED);
+
+	relations = (pgseRelation *)
+		palloc(sizeof(pgseRelation) * Max(hash_get_num_entries(pgse_relations), 1));
+
+	hash_seq_init(&hash_seq, pgse_relations);
+	while ((relation = hash_seq_search(&hash_seq)) != NULL)
+		relations[n++] = *relation;
+
+	LWLockRelease(pgse->relation_lock);
+
+	for (j = 0; j < n; j++)
+	{
+		Datum           values[PG_STAT_ERRORS_RELATIONS_COLS];
+		bool            nulls[PG_STAT_ERRORS_RELATIONS_COLS];
+		int             i = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(relations[j].key.relid);
+		values[i++] = ObjectIdGetDatum(relations[j].key.dbid);
+		values[i++] = CStringGetTextDatum(get_code_as_text(relations[j].key.ecode));
+		values[i++] = Int64GetDatumFast(relations[j].errors);
+		values[i++] = Float8GetDatum((double) relations[j].wait_time / 1000.0);
+		if (relations[j].waits > 0)
+			values[i++] = Float8GetDatum((double) relations[j].wait_time / 1000.0 /
+			                             relations[j].waits);
+		else
+			nulls[i++] = true;
+		values[i++] = TimestampTzGetDatum(relations[j].last_time);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum)0;
+}
+
+
+
+#define PG_STAT_ERRORS_COLS	16
+
+/*
+ * Estimate the percentile of durations from the histogram, in milliseconds.
+ * The durations are assumed to be spread evenly within a bucket.  Returns
+ * false if there is no duration.
+ */
+static bool
+get_duration_percentile(const Counters *counters, double percentile, double *result)
+{
+	uint64  total = 0;
+	uint64  cumulative = 0;
+	double  target;
+	int     b;
+
+	for (b = 0; b < PGSE_HIST_BUCKETS; b++)
+		total += counters->duration_hist[b];
+
+	if (total == 0)
+		return false;
+
+	target = percentile * total;
+	for (b = 0; b < PGSE_HIST_BUCKETS; b++)
+	{
+		uint32  count = counters->duration_hist[b];
+
+		if (count > 0 && cumulative + count >= target)
+		{
+			double  lower = (b == 0) ? 0.0 : (double) ((uint64) 1 << (b - 1));
+			double  upper = (b == 0) ? 1.0 : (double) ((uint64) 1 << b);
+
+			*result = (lower + (upper - lower) * (target - cumulative) / count) / 1000.0;
+			return true;
+		}
+		cumulative += count;
+	}
+
+	/* not reached */
+	return false;
+}
+
+/*
+ * Retrieve statistics of errors per key, one per call
+ */
+Datum
+pg_stat_errors(PG_FUNCTION_ARGS)
+{
+	FuncCallContext     *funcctx;
+	pgseEntrySnapshot   *entries;
+
+	/* hash table must exist already */
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext       oldcontext;
+		TupleDesc           tupdesc;
+		HASH_SEQ_STATUS     hash_seq;
+		pgseEntry           *entry;
+		long                n = 0;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		if (tupdesc->natts != PG_STAT_ERRORS_COLS)
+			elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/*
+		 * Only copy the raw entries while holding the lock, the datums and
+		 * the tuples are formed one per call after it is released.
+		 */
+		LWLockAcquire(pgse->lock, LW_SHARED);
+
+		entries = (pgseEntrySnapshot *)
+			palloc(sizeof(pgseEntrySnapshot) * Max(hash_get_num_entries(pgse_hash), 1));
+
+		hash_seq_init(&hash_seq, pgse_hash);
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		{
+			entries[n].key = entry->key;
+			read_entry_counters(entry, &entries[n].counters);
+			n++;
+		}
+
+		LWLockRelease(pgse->lock);
+
+		funcctx->user_fctx = entries;
+		funcctx->max_calls = n;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	entries = (pgseEntrySnapshot *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		pgseEntrySnapshot   *entry = &entries[funcctx->call_cntr];
+		Counters            *tmp = &entry->counters;
+		Datum               values[PG_STAT_ERRORS_COLS];
+		bool                nulls[PG_STAT_ERRORS_COLS];
+		int                 i = 0;
+		int                 eclass;
+		char                eclass_text[4] = {0};
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(entry->key.userid);
+		values[i++] = ObjectIdGetDatum(entry->key.dbid);
+
+		/* level */
+		values[i++] = CStringGetTextDatum(get_level_as_text(entry->key.elevel));
+
+		/* class */
+		eclass = ERRCODE_TO_CATEGORY(entry->key.ecode);
+		strncpy(eclass_text, get_code_as_text(eclass), 2);
+		values[i++] = CStringGetTextDatum(eclass_text);
+
+		/* class_message */
+		values[i++] = CStringGetTextDatum(get_message_by_code(eclass));
+
+		/* state */
+		values[i++] = CStringGetTextDatum(get_code_as_text(entry->key.ecode));
+
+		/* state_message */
+		values[i++] = CStringGetTextDatum(get_message_by_code(entry->key.ecode));
+
+		values[i++] = Int64GetDatumFast(tmp->errors);
+		values[i++] = TimestampTzGetDatum(tmp->_last_change);
+
+		/* durations of the failed statements */
+		{
+			static const double percentiles[] = {0.50, 0.95, 0.99};
+			int     p;
+
+			for (p = 0; p < (int) lengthof(percentiles); p++)
+			{
+				double  duration;
+
+				if (get_duration_percentile(tmp, percentiles[p], &duration))
+					values[i++] = Float8GetDatum(duration);
+				else
+					nulls[i++] = true;
+			}
+		}
+		values[i++] = Float8GetDatum((double) tmp->wasted_time / USECS_PER_SEC);
+		values[i++] = Int64GetDatum(hll_estimate(tmp->sessions));
+		values[i++] = Int64GetDatum(hll_estimate(tmp->clients));
+		values[i++] = Int64GetDatumFast(tmp->parallel_errors);
+
+		SRF_RETURN_NEXT(funcctx,
+		                HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+
+/*
+ * Get the dimension of the sketch by name
+ */
+static int
+get_sketch_dim(const char *name)
+{
+	int     dim;
+
+	for (dim = 0; dim < PGSE_SKETCH_DIMS; dim++)
+		if (pg_strcasecmp(name, pgse_sketch_dims[dim]) == 0)
+			return dim;
+
+	ereport(ERROR,
+	        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	         errmsg("invalid dimension \"%s\"", name),
+	         errhint("Valid dimensions are \"relation\", \"constraint\" and \"client\".")));
+	return -1;                  /* keep compiler quiet */
+}
+
+/*
+ * Estimated number of errors of a value of a dimension, NULL if the
+ * sketch is disabled
+ */
+Datum
+pg_stat_errors_sketch(PG_FUNCTION_ARGS)
+{
+	char    *dimension = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char    *value = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char    key[PGSE_SKETCH_VALUE_LEN];
+	int     dim;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	dim = get_sketch_dim(dimension);
+
+	if (!pgse_sketch)
+		PG_RETURN_NULL();
+
+	/* the values are counted as truncated */
+	strlcpy(key, value, sizeof(key));
+
+	PG_RETURN_INT64((int64) sketch_estimate(dim, key));
+}
+
+
+#define PG_STAT_ERRORS_SKETCH_TOP_COLS     3
+
+/*
+ * Retrieve the candidates of the sketch with their estimates
+ */
+Datum
+pg_stat_errors_sketch_top(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	int                 ncandidates[PGSE_SKETCH_DIMS];
+	char                (*candidates)[PGSE_SKETCH_CANDIDATES][PGSE_SKETCH_VALUE_LEN];
+	int                 dim, j;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_SKETCH_TOP_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(ncandidates, 0, sizeof(ncandidates));
+	candidates = palloc(sizeof(pgse_sketch->candidates));
+
+	/* copy the candidates to keep locking time short, nothing if disabled */
+	if (pgse_sketch)
+	{
+		volatile pgseSketch *sk = pgse_sketch;
+
+		SpinLockAcquire(&sk->mutex);
+		memcpy(ncandidates, (int32 *) sk->ncandidates, sizeof(ncandidates));
+		memcpy(candidates, (char *) sk->candidates, sizeof(pgse_sketch->candidates));
+		SpinLockRelease(&sk->mutex);
+	}
+
+	for (dim = 0; dim < PGSE_SKETCH_DIMS; dim++)
+	{
+		for (j = 0; j < ncandidates[dim]; j++)
+		{
+			Datum           values[PG_STAT_ERRORS_SKETCH_TOP_COLS];
+			bool            nulls[PG_STAT_ERRORS_SKETCH_TOP_COLS];
+			int             i = 0;
+
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			values[i++] = CStringGetTextDatum(pgse_sketch_dims[dim]);
+			values[i++] = CStringGetTextDatum(candidates[dim][j]);
+			values[i++] = Int64GetDatum((int64) sketch_estimate(dim, candidates[dim][j]));
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum)0;
+}
+
+
+#define PG_STAT_ERRORS_TOPK_COLS     6
+
+/*
+ * A heavy hitter copied out of the shared memory
+ */
+typedef struct pgseTopKRow
+{
+	pgseTopKKey     key;
+	int64           count;
+	int64           error;
+} pgseTopKRow;
+
+/*
+ * Compare heavy hitters by count, descending
+ */
+static int
+topk_cmp(const void *lhs, const void *rhs)
+{
+	int64   l = ((const pgseTopKRow *) lhs)->count;
+	int64   r = ((const pgseTopKRow *) rhs)->count;
+
+	if (l > r)
+		return -1;
+	else if (l < r)
+		return +1;
+	return 0;
+}
+
+/*
+ * Retrieve the heavy hitters, the most frequent first
+ */
+Datum
+pg_stat_errors_topk(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	pgseTopKRow         *items = NULL;
+	int                 j, nitems = 0;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_TOPK_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* copy the items to keep locking time short, nothing if disabled */
+	if (pgse_topk_state)
+	{
+		items = (pgseTopKRow *) palloc(sizeof(pgseTopKRow) * pgse_topk);
+
+		LWLockAcquire(pgse->topk_lock, LW_SHARED);
+		nitems = pgse_topk_state->nitems;
+		for (j = 0; j < nitems; j++)
+		{
+			items[j].key = pgse_topk_state->items[j].key;
+			items[j].count = (int64) topk_count(pgse_topk_state, j);
+			items[j].error = pgse_topk_state->items[j].error;
+		}
+		LWLockRelease(pgse->topk_lock);
+
+		qsort(items, nitems, sizeof(pgseTopKRow), topk_cmp);
+	}
+
+	for (j = 0; j < nitems; j++)
+	{
+		Datum           values[PG_STAT_ERRORS_TOPK_COLS];
+		bool            nulls[PG_STAT_ERRORS_TOPK_COLS];
+		int             i = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		if (items[j].key.queryid == 0)
+			nulls[i++] = true;
+		else
+			values[i++] = Int64GetDatum((int64) items[j].key.queryid);
+		values[i++] = ObjectIdGetDatum(items[j].key.userid);
+		values[i++] = ObjectIdGetDatum(items[j].key.dbid);
+		values[i++] = CStringGetTextDatum(get_code_as_text(items[j].key.ecode));
+		values[i++] = Int64GetDatumFast(items[j].count);
+		values[i++] = Int64GetDatumFast(items[j].error);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum)0;
+}
+
+
+#define PG_STAT_ERRORS_LAST_COLS     13
+
+/*
+ * Retrieve last N errors, one per call
+ */
+Datum
+pg_stat_errors_last(PG_FUNCTION_ARGS)
+{
+	FuncCallContext     *funcctx;
+	pgseEntryError      *local;
+
+	/* array of errors must exist already */
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext       oldcontext;
+		TupleDesc           tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		if (tupdesc->natts != PG_STAT_ERRORS_LAST_COLS)
+			elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/*
+		 * The ring is streamed one slot per call into a single copy, the
+		 * slots are never all copied at once.  Output only the actual number
+		 * of errors if the number of errors is less than pgse_max_last.
+		 */
+		funcctx->user_fctx = palloc(pgse_slot_size);
+		funcctx->max_calls = get_num_last(pg_atomic_read_u64(&pgse->eid.seqno));
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	local = (pgseEntryError *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		LWLockAcquire(pgse->lock, LW_SHARED);
+		read_error_slot(pgse_error_slot(funcctx->call_cntr), local);
+		LWLockRelease(pgse->lock);
+	}
+
+	/*
+	 * A reset since the first call empties the ring, which is then filled
+	 * again from its first slot: the errors end at the first empty slot.
+	 */
+	if (funcctx->call_cntr < funcctx->max_calls && local->error.seqno != 0)
+	{
+		ErrorInfo       *tmp = &local->error;
+		Datum           values[PG_STAT_ERRORS_LAST_COLS];
+		bool            nulls[PG_STAT_ERRORS_LAST_COLS];
+		char            *query;
+		uint32          query_len;
+		int             i = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = TimestampTzGetDatum(tmp->etime);
+		values[i++] = ObjectIdGetDatum(tmp->userid);
+		values[i++] = ObjectIdGetDatum(tmp->dbid);
+
+		query = unpack_query(local, &query_len);
+		if (query_len == 0)
+			nulls[i++] = true;
+		else
+			values[i++] = PointerGetDatum(cstring_to_text_with_len(query, query_len));
+
+		values[i++] = CStringGetTextDatum(get_level_as_text(tmp->elevel));
+		values[i++] = CStringGetTextDatum(get_code_as_text(tmp->ecode));
+		values[i++] = PointerGetDatum(cstring_to_text_with_len(pgse_error_message(local), tmp->message_len));
+		values[i++] = Int64GetDatum((int64) Max(tmp->repeat_count, 1));
+		values[i++] = TimestampTzGetDatum(tmp->repeat_count > 0 ? tmp->last_time : tmp->etime);
+
+		/* the lock conflict */
+		if (is_lock_error(tmp->ecode) && tmp->lock.nrelations > 0)
+			values[i++] = PointerGetDatum(get_oid_array(tmp->lock.relations,
+			                                            tmp->lock.nrelations));
+		else
+			nulls[i++] = true;
+		if (is_lock_error(tmp->ecode) && tmp->lock.lockmode != NoLock)
+			values[i++] = CStringGetTextDatum(GetLockmodeName(DEFAULT_LOCKMETHOD,
+			                                                  tmp->lock.lockmode));
+		else
+			nulls[i++] = true;
+		if (is_lock_error(tmp->ecode) && tmp->lock.nblockers > 0)
+			values[i++] = PointerGetDatum(get_int4_array(tmp->lock.blockers,
+			                                             tmp->lock.nblockers));
+		else
+			nulls[i++] = true;
+		if (is_lock_error(tmp->ecode) && tmp->lock.wait_time >= 0)
+			values[i++] = Float8GetDatum((double) tmp->lock.wait_time / 1000.0);
+		else
+			nulls[i++] = true;
+
+		SRF_RETURN_NEXT(funcctx,
+		                HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+
+/*
+ * Export and merge of statistics
+ *
+ * An export is a bytea independent of the build and of the cluster: the
+ * users and the databases are given by name, the levels and the SQLSTATEs
+ * as text, and every field is written in network byte order.  Exports are
+ * merged additively: the counters and the histograms are summed, the
+ * registers of HyperLogLog take the maximum, the last errors are kept by
+ * time.
+ */
+#define PGSE_EXPORT_MAGIC       0x50475345  /* "PGSE" */
+#define PGSE_EXPORT_VERSION     3
+
+#if PG_VERSION_NUM < 110000
+#define pq_sendint32(buf, i)    pq_sendint(buf, i, 4)
+#endif
+
+typedef struct pgseExportKey
+{
+	NameData        rolname;
+	NameData        datname;
+	int             elevel;
+	int             ecode;
+} pgseExportKey;
+
+typedef struct pgseExportEntry
+{
+	pgseExportKey   key;            /* hash key of entry - MUST BE FIRST */
+	Counters        counters;
+} pgseExportEntry;
+
+typedef struct pgseExportError
+{
+	TimestampTz     etime;
+	NameData        rolname;
+	NameData        datname;
+	int             elevel;
+	int             ecode;
+	char            *query;         /* NULL if none */
+	char            *message;
+	uint32          repeat_count;
+	TimestampTz     last_time;
+} pgseExportError;
+
+typedef struct pgseExport
+{
+	int32           sources;        /* # of merged exports */
+	HTAB            *entries;
+	int             nerrors;
+	int             maxerrors;
+	pgseExportError *errors;
+} pgseExport;
+
+static pgseExport *
+export_create(void)
+{
+	pgseExport  *exp = (pgseExport *) palloc0(sizeof(pgseExport));
+	HASHCTL     info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgseExportKey);
+	info.entrysize = sizeof(pgseExportEntry);
+	info.hcxt = CurrentMemoryContext;
+	exp->entries = hash_create("pg_stat_errors export", 256, &info,
+	                           HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	return exp;
+}
+
+/*
+ * Name of a user or a database, its OID if it does not exist anymore
+ */
+static void
+export_set_name(Name name, const char *value, Oid oid)
+{
+	if (value)
+		namestrcpy(name, value);
+	else
+		snprintf(NameStr(*name), NAMEDATALEN, "%u", oid);
+}
+
+/*
+ * Get the error level from its name, -1 if unknown
+ */
+static int
+get_level_by_text(const char *text)
+{
+	static const int levels[] = {WARNING, ERROR, FATAL, PANIC};
+	int     i;
+
+	for (i = 0; i < (int) lengthof(levels); i++)
+		if (strcmp(text, get_level_as_text(levels[i])) == 0)
+			return levels[i];
+
+	return -1;
+}
+
+static void
+export_add_entry(pgseExport *exp, const pgseExportKey *key, const Counters *counters)
+{
+	pgseExportEntry *entry;
+	bool            found;
+	int             i;
+
+	entry = (pgseExportEntry *) hash_search(exp->entries, key, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->counters = *counters;
+		return;
+	}
+
+	entry->counters.errors += counters->errors;
+	entry->counters.wasted_time += counters->wasted_time;
+	entry->counters.parallel_errors += counters->parallel_errors;
+	for (i = 0; i < PGSE_HIST_BUCKETS; i++)
+		entry->counters.duration_hist[i] += counters->duration_hist[i];
+	for (i = 0; i < PGSE_HLL_REGISTERS; i++)
+	{
+		entry->counters.sessions[i] = Max(entry->counters.sessions[i], counters->sessions[i]);
+		entry->counters.clients[i] = Max(entry->counters.clients[i], counters->clients[i]);
+	}
+	if (counters->_first_change != 0 &&
+	    (entry->counters._first_change == 0 ||
+	     counters->_first_change < entry->counters._first_change))
+		entry->counters._first_change = counters->_first_change;
+	if (counters->_last_change > entry->counters._last_change)
+		entry->counters._last_change = counters->_last_change;
+}
+
+static void
+export_add_error(pgseExport *exp, const pgseExportError *error)
+{
+	if (exp->nerrors >= exp->maxerrors)
+	{
+		exp->maxerrors = Max(exp->maxerrors * 2, 64);
+		if (exp->errors)
+			exp->errors = (pgseExportError *)
+				repalloc(exp->errors, sizeof(pgseExportError) * exp->maxerrors);
+		else
+			exp->errors = (pgseExportError *)
+				palloc(sizeof(pgseExportError) * exp->maxerrors);
+	}
+	exp->errors[exp->nerrors++] = *error;
+}
+
+/*
+ * Compare exported errors by time, the oldest first
+ */
+static int
+export_error_cmp(const void *lhs, const void *rhs)
+{
+	TimestampTz l = ((const pgseExportError *) lhs)->etime;
+	TimestampTz r = ((const pgseExportError *) rhs)->etime;
+
+	if (l < r)
+		return -1;
+	else if (l > r)
+		return +1;
+	return 0;
+}
+
+/*
+ * Keep the latest PGSE_EXPORT_MAX_LAST errors once there are twice as many
+ */
+static void
+export_trim_errors(pgseExport *exp)
+{
+	int     first;
+	int     i;
+
+	if (exp->nerrors <= 2 * PGSE_EXPORT_MAX_LAST)
+		return;
+
+	qsort(exp->errors, exp->nerrors, sizeof(pgseExportError), export_error_cmp);
+	first = exp->nerrors - PGSE_EXPORT_MAX_LAST;
+	for (i = 0; i < first; i++)
+	{
+		if (exp->errors[i].query)
+			pfree(exp->errors[i].query);
+		pfree(exp->errors[i].message);
+	}
+	memmove(exp->errors, exp->errors + first, sizeof(pgseExportError) * PGSE_EXPORT_MAX_LAST);
+	exp->nerrors = PGSE_EXPORT_MAX_LAST;
+}
+
+static void
+export_send_text(StringInfo buf, const char *text)
+{
+	int     len = text ? (int) strlen(text) : -1;
+
+	pq_sendint32(buf, len);
+	if (len > 0)
+		pq_sendbytes(buf, text, len);
+}
+
+static char *
+export_get_text(StringInfo msg)
+{
+	int     len = (int) pq_getmsgint(msg, 4);
+	char    *result;
+
+	if (len < 0)
+		return NULL;
+	if (len > msg->len - msg->cursor)
+		ereport(ERROR,
+		        (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+		         errmsg("invalid pg_stat_errors export")));
+
+	result = (char *) palloc(len + 1);
+	memcpy(result, pq_getmsgbytes(msg, len), len);
+	result[len] = '\0';
+
+	return result;
+}
+
+static void
+export_get_name(StringInfo msg, Name name)
+{
+	char    *text = export_get_text(msg);
+
+	if (text == NULL)
+		ereport(ERROR,
+		        (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+		         errmsg("invalid pg_stat_errors export")));
+	namestrcpy(name, text);
+	pfree(text);
+}
+
+static void
+export_get_level_code(StringInfo msg, int *elevel, int *ecode)
+{
+	char    *level = export_get_text(msg);
+	char    *state = export_get_text(msg);
+
+	if (level == NULL || state == NULL || strlen(state) != 5 ||
+	    (*elevel = get_level_by_text(level)) < 0)
+		ereport(ERROR,
+		        (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+		         errmsg("invalid pg_stat_errors export")));
+	*ecode = MAKE_SQLSTATE(state[0], state[1], state[2], state[3], state[4]);
+}
+
+/*
+ * Serialize an export, with at most PGSE_EXPORT_MAX_LAST of the latest errors
+ */
+static bytea *
+export_serialize(pgseExport *exp)
+{
+	StringInfoData  buf;
+	HASH_SEQ_STATUS hash_seq;
+	pgseExportEntry *entry;
+	int             first = 0;
+	int             i;
+
+	qsort(exp->errors, exp->nerrors, sizeof(pgseExportError), export_error_cmp);
+	if (exp->nerrors > PGSE_EXPORT_MAX_LAST)
+		first = exp->nerrors - PGSE_EXPORT_MAX_LAST;
+
+	pq_begintypsend(&buf);
+	pq_sendint32(&buf, PGSE_EXPORT_MAGIC);
+	pq_sendint32(&buf, PGSE_EXPORT_VERSION);
+	pq_sendint32(&buf, exp->sources);
+
+	pq_sendint32(&buf, hash_get_num_entries(exp->entries));
+	hash_seq_init(&hash_seq, exp->entries);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Counters    *c = &entry->counters;
+
+		export_send_text(&buf, NameStr(entry->key.rolname));
+		export_send_text(&buf, NameStr(entry->key.datname));
+		export_send_text(&buf, get_level_as_text(entry->key.elevel));
+		export_send_text(&buf, unpack_sql_state(entry->key.ecode));
+		pq_sendint64(&buf, c->errors);
+		pq_sendint64(&buf, c->wasted_time);
+		pq_sendint64(&buf, c->parallel_errors);
+		pq_sendint64(&buf, c->_first_change);
+		pq_sendint64(&buf, c->_last_change);
+		for (i = 0; i < PGSE_HIST_BUCKETS; i++)
+			pq_sendint32(&buf, c->duration_hist[i]);
+		pq_sendbytes(&buf, (char *) c->sessions, PGSE_HLL_REGISTERS);
+		pq_sendbytes(&buf, (char *) c->clients, PGSE_HLL_REGISTERS);
+	}
+
+	pq_sendint32(&buf, exp->nerrors - first);
+	for (i = first; i < exp->nerrors; i++)
+	{
+		pgseExportError *error = &exp->errors[i];
+
+		pq_sendint64(&buf, error->etime);
+		export_send_text(&buf, NameStr(error->rolname));
+		export_send_text(&buf, NameStr(error->datname));
+		export_send_text(&buf, get_level_as_text(error->elevel));
+		export_send_text(&buf, unpack_sql_state(error->ecode));
+		export_send_text(&buf, error->query);
+		export_send_text(&buf, error->message);
+		pq_sendint32(&buf, error->repeat_count);
+		pq_sendint64(&buf, error->last_time);
+	}
+
+	return pq_endtypsend(&buf);
+}
+
+/*
+ * Merge a serialized export into an export
+ */
+static void
+export_deserialize(pgseExport *exp, bytea *data)
+{
+	StringInfoData  msg;
+	int             n;
+	int             i, j;
+
+	msg.data = VARDATA_ANY(data);
+	msg.len = VARSIZE_ANY_EXHDR(data);
+	msg.maxlen = msg.len;
+	msg.cursor = 0;
+
+	if (msg.len < 8 ||
+	    (uint32) pq_getmsgint(&msg, 4) != PGSE_EXPORT_MAGIC ||
+	    pq_getmsgint(&msg, 4) != PGSE_EXPORT_VERSION)
+		ereport(ERROR,
+		        (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+		         errmsg("invalid pg_stat_errors export"),
+		         errdetail("The export was made by an unsupported version of pg_stat_errors.")));
+
+	exp->sources += (int32) pq_getmsgint(&msg, 4);
+
+	n = (int) pq_getmsgint(&msg, 4);
+	for (i = 0; i < n; i++)
+	{
+		pgseExportKey   key;
+		Counters        c;
+
+		memset(&key, 0, sizeof(key));
+		memset(&c, 0, sizeof(c));
+		export_get_name(&msg, &key.rolname);
+		export_get_name(&msg, &key.datname);
+		export_get_level_code(&msg, &key.elevel, &key.ecode);
+		c.errors = pq_getmsgint64(&msg);
+		c.wasted_time = pq_getmsgint64(&msg);
+		c.parallel_errors = pq_getmsgint64(&msg);
+		c._first_change = pq_getmsgint64(&msg);
+		c._last_change = pq_getmsgint64(&msg);
+		for (j = 0; j < PGSE_HIST_BUCKETS; j++)
+			c.duration_hist[j] = pq_getmsgint(&msg, 4);
+		pq_copymsgbytes(&msg, (char *) c.sessions, PGSE_HLL_REGISTERS);
+		pq_copymsgbytes(&msg, (char *) c.clients, PGSE_HLL_REGISTERS);
+
+		export_add_entry(exp, &key, &c);
+	}
+
+	n = (int) pq_getmsgint(&msg, 4);
+	for (i = 0; i < n; i++)
+	{
+		pgseExportError error;
+
+		memset(&error, 0, sizeof(error));
+		error.etime = pq_getmsgint64(&msg);
+		export_get_name(&msg, &error.rolname);
+		export_get_name(&msg, &error.datname);
+		export_get_level_code(&msg, &error.elevel, &error.ecode);
+		error.query = export_get_text(&msg);
+		error.message = export_get_text(&msg);
+		if (error.message == NULL)
+			error.message = pstrdup("");
+		error.repeat_count = pq_getmsgint(&msg, 4);
+		error.last_time = pq_getmsgint64(&msg);
+
+		export_add_error(exp, &error);
+	}
+
+	pq_getmsgend(&msg);
+}
+
+/*
+ * Export the statistics of this cluster, with the last errors if asked
+ */
+Datum
+pg_stat_errors_export(PG_FUNCTION_ARGS)
+{
+	bool                with_last = PG_GETARG_BOOL(0);
+	pgseExport          *exp;
+	pgseEntrySnapshot   *entries;
+	HASH_SEQ_STATUS     hash_seq;
+	pgseEntry           *entry;
+	pgseEntryError      *slot;
+	long                n = 0;
+	long                i;
+	uint32              j, num_last = 0;
+
+	if ( !isInitialized() )
+		ereport(ERROR,
+		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+
+	/* copy the raw entries, the names are looked up afterwards */
+	LWLockAcquire(pgse->lock, LW_SHARED);
+
+	entries = (pgseEntrySnapshot *)
+		palloc(sizeof(pgseEntrySnapshot) * Max(hash_get_num_entries(pgse_hash), 1));
+
+	hash_seq_init(&hash_seq, pgse_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		entries[n].key = entry->key;
+		read_entry_counters(entry, &entries[n].counters);
+		n++;
+	}
+
+	if (with_last)
+		num_last = get_num_last(pg_atomic_read_u64(&pgse->eid.seqno));
+
+	LWLockRelease(pgse->lock);
+
+	exp = export_create();
+	exp->sources = 1;
+
+	for (i = 0; i < n; i++)
+	{
+		pgseExportKey   key;
+
+		memset(&key, 0, sizeof(key));
+		export_set_name(&key.rolname, GetUserNameFromId(entries[i].key.userid, true),
+		                entries[i].key.userid);
+		export_set_name(&key.datname, get_database_name(entries[i].key.dbid),
+		                entries[i].key.dbid);
+		key.elevel = entries[i].key.elevel;
+		key.ecode = entries[i].key.ecode;
+
+		export_add_entry(exp, &key, &entries[i].counters);
+	}
+
+	/*
+	 * The last errors are copied one slot at a time, the latest
+	 * PGSE_EXPORT_MAX_LAST of them are kept as they are added.
+	 */
+	slot = (pgseEntryError *) palloc(pgse_slot_size);
+	for (j = 0; j < num_last; j++)
+	{
+		pgseExportError error;
+
+		LWLockAcquire(pgse->lock, LW_SHARED);
+		read_error_slot(pgse_error_slot(j), slot);
+		LWLockRelease(pgse->lock);
+
+		/* emptied by a reset */
+		if (slot->error.seqno == 0)
+			break;
+
+		memset(&error, 0, sizeof(error));
+		error.etime = slot->error.etime;
+		export_set_name(&error.rolname, GetUserNameFromId(slot->error.userid, true),
+		                slot->error.userid);
+		export_set_name(&error.datname, get_database_name(slot->error.dbid),
+		                slot->error.dbid);
+		error.elevel = slot->error.elevel;
+		error.ecode = slot->error.ecode;
+		if (slot->error.query_len > 0)
+		{
+			uint32  query_len;
+			char    *query = unpack_query(slot, &query_len);
+
+			error.query = pnstrdup(query, query_len);
+		}
+		error.message = pnstrdup(pgse_error_message(slot), slot->error.message_len);
+		error.repeat_count = slot->error.repeat_count;
+		error.last_time = slot->error.last_time;
+
+		export_add_error(exp, &error);
+		export_trim_errors(exp);
+	}
+
+	PG_RETURN_BYTEA_P(export_serialize(exp));
+}
+
+/*
+ * The aggregate pg_stat_errors_merge
+ *
+ * The state is an export in the aggregate memory context, each input is
+ * merged into it once: the last errors are trimmed to the latest
+ * PGSE_EXPORT_MAX_LAST from time to time, so the state does not grow with
+ * the number of inputs.  The state is serialized for the parallel
+ * aggregation only, and by the final function.
+ */
+static pgseExport *
+merge_get_state(FunctionCallInfo fcinfo, int argno, MemoryContext *aggcontext)
+{
+	if (!AggCheckCallContext(fcinfo, aggcontext))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	if (PG_ARGISNULL(argno))
+	{
+		MemoryContext   oldcontext = MemoryContextSwitchTo(*aggcontext);
+		pgseExport      *exp = export_create();
+
+		MemoryContextSwitchTo(oldcontext);
+		return exp;
+	}
+
+	return (pgseExport *) PG_GETARG_POINTER(argno);
+}
+
+/*
+ * Transition function: merge an export into the state
+ */
+Datum
+pg_stat_errors_merge_accum(PG_FUNCTION_ARGS)
+{
+	MemoryContext   aggcontext;
+	MemoryContext   oldcontext;
+	pgseExport      *exp;
+
+	/* NULL until the first export */
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+
+	exp = merge_get_state(fcinfo, 0, &aggcontext);
+	if (!PG_ARGISNULL(1))
+	{
+		bytea   *input = PG_GETARG_BYTEA_PP(1);
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+		export_deserialize(exp, input);
+		export_trim_errors(exp);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	PG_RETURN_POINTER(exp);
+}
+
+/*
+ * Combine function: merge the second state into the first one
+ */
+Datum
+pg_stat_errors_merge_combine(PG_FUNCTION_ARGS)
+{
+	MemoryContext       aggcontext;
+	MemoryContext       oldcontext;
+	pgseExport          *exp;
+	pgseExport          *other;
+	HASH_SEQ_STATUS     hash_seq;
+	pgseExportEntry     *entry;
+	int                 i;
+
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+
+	exp = merge_get_state(fcinfo, 0, &aggcontext);
+	other = (pgseExport *) PG_GETARG_POINTER(1);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	exp->sources += other->sources;
+
+	hash_seq_init(&hash_seq, other->entries);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		export_add_entry(exp, &entry->key, &entry->counters);
+
+	for (i = 0; i < other->nerrors; i++)
+	{
+		pgseExportError error = other->errors[i];
+
+		if (error.query)
+			error.query = pstrdup(error.query);
+		error.message = pstrdup(error.message);
+		export_add_error(exp, &error);
+	}
+	export_trim_errors(exp);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(exp);
+}
+
+/*
+ * Serialization function of the state, for the parallel aggregation
+ */
+Datum
+pg_stat_errors_merge_serialize(PG_FUNCTION_ARGS)
+{
+	pgseExport  *exp = (pgseExport *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_BYTEA_P(export_serialize(exp));
+}
+
+/*
+ * Deserialization function of the state
+ */
+Datum
+pg_stat_errors_merge_deserialize(PG_FUNCTION_ARGS)
+{
+	bytea           *input = PG_GETARG_BYTEA_PP(0);
+	MemoryContext   aggcontext;
+	MemoryContext   oldcontext;
+	pgseExport      *exp;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "aggregate function called in non-aggregate context");
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+	exp = export_create();
+	export_deserialize(exp, input);
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(exp);
+}
+
+/*
+ * Final function: the merged export, NULL without any input
+ */
+Datum
+pg_stat_errors_merge_final(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	PG_RETURN_BYTEA_P(export_serialize((pgseExport *) PG_GETARG_POINTER(0)));
+}
+
+
+#define PG_STAT_ERRORS_DECODE_COLS     14
+
+/*
+ * Retrieve the statistics of an export
+ */
+Datum
+pg_stat_errors_decode(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	pgseExport          *exp;
+	HASH_SEQ_STATUS     hash_seq;
+	pgseExportEntry     *entry;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_DECODE_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	exp = export_create();
+	export_deserialize(exp, PG_GETARG_BYTEA_PP(0));
+
+	hash_seq_init(&hash_seq, exp->entries);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum           values[PG_STAT_ERRORS_DECODE_COLS];
+		bool            nulls[PG_STAT_ERRORS_DECODE_COLS];
+		Counters        *tmp = &entry->counters;
+		int             i = 0;
+		int             p;
+		static const double percentiles[] = {0.50, 0.95, 0.99};
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = CStringGetTextDatum(NameStr(entry->key.rolname));
+		values[i++] = CStringGetTextDatum(NameStr(entry->key.datname));
+		values[i++] = CStringGetTextDatum(get_level_as_text(entry->key.elevel));
+		values[i++] = CStringGetTextDatum(get_code_as_text(entry->key.ecode));
+		values[i++] = Int64GetDatumFast(tmp->errors);
+		values[i++] = TimestampTzGetDatum(tmp->_first_change);
+		values[i++] = TimestampTzGetDatum(tmp->_last_change);
+		for (p = 0; p < (int) lengthof(percentiles); p++)
+		{
+			double  duration;
+
+			if (get_duration_percentile(tmp, percentiles[p], &duration))
+				values[i++] = Float8GetDatum(duration);
+			else
+				nulls[i++] = true;
+		}
+		values[i++] = Float8GetDatum((double) tmp->wasted_time / USECS_PER_SEC);
+		values[i++] = Int64GetDatum(hll_estimate(tmp->sessions));
+		values[i++] = Int64GetDatum(hll_estimate(tmp->clients));
+		values[i++] = Int64GetDatumFast(tmp->parallel_errors);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
 
-	PG_RETURN_INT64(result);
+	return (Datum)0;
 }
 
 
+#define PG_STAT_ERRORS_DECODE_LAST_COLS     9
+
 /*
- * Get error code as text
+ * Retrieve the last errors of an export, the oldest first
  */
-static char *
-get_code_as_text(int ecode)
+Datum
+pg_stat_errors_decode_last(PG_FUNCTION_ARGS)
 {
-	static char    ecode_text[SQLSTATE_LEN] = {0};
+	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc           tupdesc;
+	Tuplestorestate     *tupstore;
+	MemoryContext       per_query_ctx;
+	MemoryContext       oldcontext;
+	pgseExport          *exp;
+	int                 j;
 
-	snprintf(ecode_text, SQLSTATE_LEN, "%s", unpack_sql_state(ecode));
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("materialize mode required, but it is not allowed in this context")));
 
-	return ecode_text;
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != PG_STAT_ERRORS_DECODE_LAST_COLS)
+		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	exp = export_create();
+	export_deserialize(exp, PG_GETARG_BYTEA_PP(0));
+	qsort(exp->errors, exp->nerrors, sizeof(pgseExportError), export_error_cmp);
+
+	for (j = 0; j < exp->nerrors; j++)
+	{
+		pgseExportError *error = &exp->errors[j];
+		Datum           values[PG_STAT_ERRORS_DECODE_LAST_COLS];
+		bool            nulls[PG_STAT_ERRORS_DECODE_LAST_COLS];
+		int             i = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = TimestampTzGetDatum(error->etime);
+		values[i++] = CStringGetTextDatum(NameStr(error->rolname));
+		values[i++] = CStringGetTextDatum(NameStr(error->datname));
+		if (error->query == NULL)
+			nulls[i++] = true;
+		else
+			values[i++] = CStringGetTextDatum(error->query);
+		values[i++] = CStringGetTextDatum(get_level_as_text(error->elevel));
+		values[i++] = CStringGetTextDatum(get_code_as_text(error->ecode));
+		values[i++] = CStringGetTextDatum(error->message);
+		values[i++] = Int64GetDatum((int64) error->repeat_count);
+		values[i++] = TimestampTzGetDatum(error->last_time);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+#if PG_VERSION_NUM <= 140000
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum)0;
 }
 
+
 /*
- * Get error message
+ * Signal handlers of the background worker
  */
-static char *
-get_message_by_code(int ecode)
+static void
+pgse_worker_sighup(SIGNAL_ARGS)
 {
-	char    *result = "";
+	int         save_errno = errno;
 
-	switch (ecode)
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+pgse_worker_sigterm(SIGNAL_ARGS)
+{
+	int         save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+
+/*
+ * Background worker main loop
+ *
+ * The worker runs the export of the last errors, the evaluation of the
+ * alert rules and its other tasks, each one with its own naptime.
+ */
+void
+pgse_worker_main(Datum main_arg)
+{
+	MemoryContext   worker_ctx;
+	TimestampTz     next_export = 0;
+	TimestampTz     next_alerts = 0;
+	TimestampTz     next_sketch = 0;
+	TimestampTz     next_history = 0;
+	TimestampTz     next_snapshot = 0;
+	TimestampTz     next_governor = 0;
+
+	pqsignal(SIGHUP, pgse_worker_sighup);
+	pqsignal(SIGTERM, pgse_worker_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	/* the alert rules are read from a table */
+	if (pgse_alerts)
+#if PG_VERSION_NUM >= 110000
+		BackgroundWorkerInitializeConnection(pgse_alert_database, NULL, 0);
+#else
+		BackgroundWorkerInitializeConnection(pgse_alert_database, NULL);
+#endif
+
+	/* everything allocated during one cycle is thrown away at its end */
+	worker_ctx = AllocSetContextCreate(TopMemoryContext,
+	                                   "pg_stat_errors worker",
+	                                   ALLOCSET_DEFAULT_SIZES);
+
+	while (!got_sigterm)
 	{
-#include "ecodes.inc"
-		default:
-			result = "unknown";
+		int             rc;
+		MemoryContext   oldcontext;
+		TimestampTz     now = GetCurrentTimestamp();
+		TimestampTz     next = 0;
+		long            timeout;
+
+		if (pgse_export != PGSE_EXPORT_OFF)
+			next = next_export;
+		if (pgse_alerts && (next == 0 || next_alerts < next))
+			next = next_alerts;
+		if (pgse_sketch_width > 0 && (next == 0 || next_sketch < next))
+			next = next_sketch;
+		if (pgse_history_enabled && (next == 0 || next_history < next))
+			next = next_history;
+		if (pgse_snapshot && (next == 0 || next_snapshot < next))
+			next = next_snapshot;
+		if (pgse_governor_budget > 0 && (next == 0 || next_governor < next))
+			next = next_governor;
+		/* the governor may be enabled again by a reload */
+		if (next == 0)
+			next = TimestampTzPlusMilliseconds(now, PGSE_GOVERNOR_WINDOW / 1000);
+
+		timeout = (next > now) ? TimestampDifferenceMilliseconds(now, next) : 0;
+
+		if (timeout > 0)
+		{
+#if PG_VERSION_NUM >= 100000
+			rc = WaitLatch(MyLatch,
+			               WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+			               timeout,
+			               PG_WAIT_EXTENSION);
+#else
+			rc = WaitLatch(MyLatch,
+			               WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+			               timeout);
+#endif
+			ResetLatch(MyLatch);
+
+			/* emergency bailout if postmaster has died */
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if ( !isInitialized() )
+			continue;
+
+		now = GetCurrentTimestamp();
+
+		oldcontext = MemoryContextSwitchTo(worker_ctx);
+
+		if (pgse_export != PGSE_EXPORT_OFF && now >= next_export)
+		{
+			pgse_export_errors();
+			next_export = TimestampTzPlusMilliseconds(now, pgse_export_naptime);
+		}
+
+		if (pgse_alerts && now >= next_alerts)
+		{
+			pgse_evaluate_alerts();
+			next_alerts = TimestampTzPlusMilliseconds(now, pgse_alert_naptime);
+		}
+
+		if (pgse_sketch && now >= next_sketch)
+		{
+			pgse_sketch_update_candidates();
+			next_sketch = TimestampTzPlusMilliseconds(now, PGSE_SKETCH_NAPTIME);
+		}
+
+		if (pgse_history && now >= next_history)
+		{
+			pgse_history_roll();
+			next_history = TimestampTzPlusMilliseconds(now, PGSE_HISTORY_NAPTIME);
+		}
+
+		if (pgse_snapshot && now >= next_snapshot)
+		{
+			pgse_snapshot_write();
+			next_snapshot = TimestampTzPlusMilliseconds(now, pgse_snapshot_naptime);
+		}
+
+		if (pgse_governor_budget > 0 && now >= next_governor)
+		{
+			pgse_governor_update(now);
+			next_governor = TimestampTzPlusMilliseconds(now, PGSE_GOVERNOR_WINDOW / 1000);
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(worker_ctx);
+	}
+
+	/* make the last export file durable before exit */
+	pgse_export_close();
+
+	proc_exit(0);
+}
+
+
+/*
+ * Append a value to the buffer as a CSV field
+ */
+static void
+append_csv_literal(StringInfo buf, const char *data)
+{
+	const char *p = data;
+	char        c;
+
+	appendStringInfoCharMacro(buf, '"');
+	while ((c = *p++) != '\0')
+	{
+		if (c == '"')
+			appendStringInfoCharMacro(buf, '"');
+		appendStringInfoCharMacro(buf, c);
+	}
+	appendStringInfoCharMacro(buf, '"');
+}
+
+
+/*
+ * Format one error as a line of the export file
+ */
+static void
+pgse_export_format(StringInfo buf, const pgseEntryError *slot)
+{
+	const ErrorInfo *error = &slot->error;
+	uint32  query_len;
+	char    *query = unpack_query(slot, &query_len);
+	char    *message = pnstrdup(pgse_error_message(slot), error->message_len);
+
+	query = pnstrdup(query, query_len);
+
+	if (pgse_export == PGSE_EXPORT_JSONL)
+	{
+		appendStringInfo(buf, "{\"seqno\":" UINT64_FORMAT ",\"error_time\":", error->seqno);
+		escape_json(buf, timestamptz_to_str(error->etime));
+		appendStringInfo(buf, ",\"userid\":%u,\"dbid\":%u,\"error_level\":",
+		                 error->userid, error->dbid);
+		escape_json(buf, get_level_as_text(error->elevel));
+		appendStringInfoString(buf, ",\"error_state\":");
+		escape_json(buf, get_code_as_text(error->ecode));
+		appendStringInfoString(buf, ",\"query\":");
+		if (query[0] == '\0')
+			appendStringInfoString(buf, "null");
+		else
+			escape_json(buf, query);
+		appendStringInfoString(buf, ",\"error_message\":");
+		escape_json(buf, message);
+		appendStringInfo(buf, ",\"repeat_count\":%u,\"last_time\":", error->repeat_count);
+		escape_json(buf, timestamptz_to_str(error->last_time));
+		appendStringInfoString(buf, "}\n");
+	}
+	else
+	{
+		appendStringInfo(buf, UINT64_FORMAT ",", error->seqno);
+		append_csv_literal(buf, timestamptz_to_str(error->etime));
+		appendStringInfo(buf, ",%u,%u,%s,%s,",
+		                 error->userid, error->dbid,
+		                 get_level_as_text(error->elevel),
+		                 get_code_as_text(error->ecode));
+		if (query[0] != '\0')
+			append_csv_literal(buf, query);
+		appendStringInfoCharMacro(buf, ',');
+		append_csv_literal(buf, message);
+		appendStringInfo(buf, ",%u,", error->repeat_count);
+		append_csv_literal(buf, timestamptz_to_str(error->last_time));
+		appendStringInfoCharMacro(buf, '\n');
+	}
+
+	pfree(query);
+	pfree(message);
+}
+
+
+/*
+ * Open a new export file named after the current time
+ */
+static bool
+pgse_export_open(void)
+{
+	char        filename[MAXPGPATH];
+	char        stamp[64];
+	pg_time_t   now = (pg_time_t) time(NULL);
+
+	if (mkdir(pgse_export_directory, S_IRWXU) < 0 && errno != EEXIST)
+	{
+		ereport(LOG,
+		        (errcode_for_file_access(),
+		         errmsg("could not create pg_stat_errors export directory \"%s\": %m",
+		                pgse_export_directory)));
+		return false;
+	}
+
+	pg_strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", pg_localtime(&now, log_timezone));
+	snprintf(filename, MAXPGPATH, "%s/%s-%s.%s",
+	         pgse_export_directory, PGSE_EXPORT_FILE_PREFIX, stamp,
+	         pgse_export == PGSE_EXPORT_JSONL ? "jsonl" : "csv");
+
+	export_fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | PG_BINARY, S_IRUSR | S_IWUSR);
+	if (export_fd < 0)
+	{
+		ereport(LOG,
+		        (errcode_for_file_access(),
+		         errmsg("could not open pg_stat_errors export file \"%s\": %m",
+		                filename)));
+		return false;
+	}
+
+	export_file_ctime = now;
+	export_file_size = lseek(export_fd, 0, SEEK_END);
+	if (export_file_size < 0)
+		export_file_size = 0;
+
+	/* a fresh CSV file starts with the names of columns */
+	if (pgse_export == PGSE_EXPORT_CSV && export_file_size == 0)
+	{
+		const char *header = "seqno,error_time,userid,dbid,error_level,error_state,query,error_message,repeat_count,last_time\n";
+
+		if (write(export_fd, header, strlen(header)) == (ssize_t) strlen(header))
+			export_file_size += strlen(header);
+	}
+
+	return true;
+}
+
+
+/*
+ * Close the current export file.  The file is synced to disk once, here.
+ */
+static void
+pgse_export_close(void)
+{
+	if (export_fd < 0)
+		return;
+
+	if (pg_fsync(export_fd) != 0)
+		ereport(LOG,
+		        (errcode_for_file_access(),
+		         errmsg("could not fsync pg_stat_errors export file: %m")));
+	close(export_fd);
+
+	export_fd = -1;
+	export_file_size = 0;
+}
+
+
+/*
+ * Write the buffered lines into the current export file, rotating it when
+ * needed.  The buffer is reset on return.
+ */
+static void
+pgse_export_flush(StringInfo buf)
+{
+	if (buf->len == 0)
+		return;
+
+	if (export_fd < 0 && !pgse_export_open())
+	{
+		resetStringInfo(buf);
+		return;
+	}
+
+	if (write(export_fd, buf->data, buf->len) != buf->len)
+	{
+		ereport(LOG,
+		        (errcode_for_file_access(),
+		         errmsg("could not write pg_stat_errors export file: %m")));
+		/* start a new file next time */
+		pgse_export_close();
+	}
+	else
+		export_file_size += buf->len;
+
+	resetStringInfo(buf);
+
+	if (export_fd >= 0 &&
+	    pgse_export_rotation_size > 0 &&
+	    export_file_size >= (off_t) pgse_export_rotation_size * 1024)
+		pgse_export_close();
+}
+
+
+/*
+ * Write the errors recorded since the previous call into the export file.
+ *
+ * The errors are copied out of the ring one slot at a time under the lock,
+ * so that the formatting and the file I/O never delay the backends.
+ */
+static void
+pgse_export_errors(void)
+{
+	pgseEntryError  *copy;
+	StringInfoData  buf;
+	uint64          claimed;
+	uint64          last;
+	uint64          lower;
+	uint64          s;
+	int             max_last = pgse_max_last;
+
+	if (pgse_export == PGSE_EXPORT_OFF)
+		return;
+
+	/* rotate an old file even if nothing new has happened */
+	if (export_fd >= 0 &&
+	    pgse_export_rotation_age > 0 &&
+	    (pg_time_t) time(NULL) - export_file_ctime >= (pg_time_t) pgse_export_rotation_age * SECS_PER_MINUTE)
+		pgse_export_close();
+
+	copy = (pgseEntryError *) palloc(pgse_slot_size);
+	initStringInfo(&buf);
+
+	claimed = pg_atomic_read_u64(&pgse->eid.seqno);
+
+	/* the statistics have been reset since the last call */
+	last = pgse->export_seqno;
+	if (claimed < last)
+		last = 0;
+
+	/* the ring holds only the latest errors, older ones are lost */
+	lower = last + 1;
+	if (claimed > (uint64) max_last && lower < claimed - max_last + 1)
+	{
+		ereport(LOG,
+		        (errmsg("pg_stat_errors: " UINT64_FORMAT " errors were not exported",
+		                claimed - max_last + 1 - lower),
+		         errhint("Consider increasing pg_stat_errors.max_last or decreasing pg_stat_errors.export_naptime.")));
+		lower = claimed - max_last + 1;
+		last = lower - 1;
+	}
+
+	for (s = lower; s <= claimed; s++)
+	{
+		pgseEntryError *slot = pgse_error_slot((s - 1) % max_last);
+		uint64      seqno;
+
+		LWLockAcquire(pgse->lock, LW_SHARED);
+
+		/* the later repeats of the error go to a new slot, exported next time */
+		{
+			volatile pgseEntryError *e = (volatile pgseEntryError *) slot;
+
+			SpinLockAcquire(&e->mutex);
+			if (e->error.seqno == s)
+				e->error.exported = true;
+			SpinLockRelease(&e->mutex);
+		}
+
+		read_error_slot(slot, copy);
+
+		LWLockRelease(pgse->lock);
+
+		/* the slot is claimed but not filled yet, continue from it next time */
+		seqno = copy->error.seqno;
+		if (seqno < s)
+			break;
+
+		if (seqno == s)
+		{
+			pgse_export_format(&buf, copy);
+
+			if (buf.len >= PGSE_EXPORT_FLUSH_SIZE)
+				pgse_export_flush(&buf);
+		}
+
+		last = s;
 	}
 
-	return result;
+	pgse->export_seqno = last;
+
+	pgse_export_flush(&buf);
 }
 
+
 /*
- * Get error level as text
- * WARNING, ERROR, FATAL, PANIC error level codes are allowed
+ * Snapshot file for the monitoring agents, see pg_stat_errors_snapshot.h
  */
-static char *
-get_level_as_text(int elevel)
+
+/* Microseconds since the Unix epoch */
+static int64
+snapshot_time(TimestampTz t)
 {
-	char    *elevel_text = "";
+	if (t == 0)
+		return 0;
 
-	switch (elevel)
-	{
-		case WARNING:
-			elevel_text = "WARNING";
-			break;
-		case ERROR:
-			elevel_text = "ERROR";
-			break;
-		case FATAL:
-			elevel_text = "FATAL";
-			break;
-		case PANIC:
-			elevel_text = "PANIC";
-			break;
-		/* should never happen */
-		default:
-			elog(LOG, "pg_stat_errors: %s(): incorrect error level code. [%d]", __FUNCTION__, elevel);
-	}
+	return (int64) t + (int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY;
+}
 
-	return elevel_text;
+/* Copy a text into a fixed field, clipped and NUL-terminated */
+static void
+snapshot_text(char *dst, int size, const char *src, int len)
+{
+	if (len >= size)
+		len = pg_mbcliplen(src, len, size - 1);
+	memcpy(dst, src, len);
+	dst[len] = '\0';
 }
 
+/* qsort comparator for sorting entries into decreasing errors order */
+static int
+snapshot_entry_cmp(const void *lhs, const void *rhs)
+{
+	int64   l_errors = ((const pgseEntrySnapshot *) lhs)->counters.errors;
+	int64   r_errors = ((const pgseEntrySnapshot *) rhs)->counters.errors;
 
-/* Number of output arguments (columns) for pg_stat_errors_info */
-#define PG_STAT_ERRORS_INFO_COLS    2
+	if (l_errors > r_errors)
+		return -1;
+	else if (l_errors < r_errors)
+		return +1;
+	else
+		return 0;
+}
 
 /*
- * Return statistics of pg_stat_errors.
+ * Map the snapshot file, created if it does not exist or has another
+ * layout.  A snapshot file left by a previous worker is continued, so the
+ * sequence numbers seen by the readers keep increasing.
  */
-Datum
-pg_stat_errors_info(PG_FUNCTION_ARGS)
+static bool
+pgse_snapshot_open(void)
 {
-	pgseGlobalStats stats;
-	TupleDesc       tupdesc;
-	Datum           values[PG_STAT_ERRORS_INFO_COLS];
-	bool            nulls[PG_STAT_ERRORS_INFO_COLS];
-
-	if ( !isInitialized() )
-		ereport(ERROR,
-		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-		        errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
-
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+#ifndef WIN32
+	int             fd;
+	struct stat     st;
+	void            *map;
 
-	memset(values, 0, sizeof(values));
-	memset(nulls, 0, sizeof(nulls));
-
-	/* Read global statistics for pg_stat_errors */
+	fd = open(PGSE_SNAPSHOT_FILE, O_RDWR | O_CREAT | PG_BINARY, S_IRUSR | S_IWUSR | S_IRGRP);
+	if (fd < 0)
 	{
-		volatile pgseSharedState *s = (volatile pgseSharedState *) pgse;
+		ereport(LOG,
+		        (errcode_for_file_access(),
+		         errmsg("could not open pg_stat_errors snapshot file \"%s\": %m",
+		                PGSE_SNAPSHOT_FILE)));
+		return false;
+	}
 
-		SpinLockAcquire(&s->mutex);
-		stats = s->stats;
-		SpinLockRelease(&s->mutex);
+	if (fstat(fd, &st) < 0 ||
+	    (st.st_size != sizeof(pgseSnapshotFile) &&
+	     ftruncate(fd, sizeof(pgseSnapshotFile)) < 0))
+	{
+		ereport(LOG,
+		        (errcode_for_file_access(),
+		         errmsg("could not resize pg_stat_errors snapshot file \"%s\": %m",
+		                PGSE_SNAPSHOT_FILE)));
+		close(fd);
+		return false;
 	}
 
-	values[0] = Int64GetDatum(stats.dealloc);
-	values[1] = TimestampTzGetDatum(stats.stats_reset);
+	map = mmap(NULL, sizeof(pgseSnapshotFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		ereport(LOG,
+		        (errmsg("could not map pg_stat_errors snapshot file \"%s\": %m",
+		                PGSE_SNAPSHOT_FILE)));
+		return false;
+	}
 
-	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
-}
+	snapshot_file = (pgseSnapshotFile *) map;
 
+	if (snapshot_file->magic != PGSE_SNAPSHOT_MAGIC ||
+	    snapshot_file->version != PGSE_SNAPSHOT_VERSION ||
+	    snapshot_file->file_size != sizeof(pgseSnapshotFile) ||
+	    snapshot_file->current > 1)
+	{
+		memset(snapshot_file, 0, sizeof(pgseSnapshotFile));
+		snapshot_file->magic = PGSE_SNAPSHOT_MAGIC;
+		snapshot_file->version = PGSE_SNAPSHOT_VERSION;
+		snapshot_file->file_size = sizeof(pgseSnapshotFile);
+	}
 
-#define PG_STAT_ERRORS_COLS	9
+	return true;
+#else
+	ereport(LOG,
+	        (errmsg("pg_stat_errors snapshot file is not supported on this platform")));
+	return false;
+#endif
+}
 
 /*
- * Retrieve statistics of errors per key
+ * Publish the counters and the last errors into the snapshot file
  */
-Datum
-pg_stat_errors(PG_FUNCTION_ARGS)
+static void
+pgse_snapshot_write(void)
 {
-	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	TupleDesc           tupdesc;
-	Tuplestorestate     *tupstore;
-	MemoryContext       per_query_ctx;
-	MemoryContext       oldcontext;
+	pgseSnapshotBuffer  *buf;
+	pgseEntrySnapshot   *entries;
 	HASH_SEQ_STATUS     hash_seq;
 	pgseEntry           *entry;
+	pgseEntryError      *slot;
+	pgseGlobalStats     stats;
+	uint64              total_errors;
+	uint64              seqno;
+	uint64              head;
+	uint64              s;
+	uint32              idx;
+	long                n = 0;
+	long                i;
+
+	if (snapshot_file == NULL && !pgse_snapshot_open())
+		return;
 
-	/* hash table must exist already */
-	if ( !isInitialized() )
-		ereport(ERROR,
-		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
-
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-		         errmsg("set-valued function called in context that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-		         errmsg("materialize mode required, but it is not allowed in this context")));
-
-	/* Switch into long-lived context to construct returned data structures */
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
-
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+	seqno = snapshot_file->seqno + 1;
+	idx = (snapshot_file->seqno == 0) ? 0 : 1 - snapshot_file->current;
+	buf = &snapshot_file->buffers[idx];
 
-	if (tupdesc->natts != PG_STAT_ERRORS_COLS)
-		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+	buf->begin_seqno = seqno;
+	pg_write_barrier();
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+	get_global_stats(&total_errors, &stats);
+	buf->snapshot_time = snapshot_time(GetCurrentTimestamp());
+	buf->stats_reset = snapshot_time(stats.stats_reset);
+	buf->total_errors = total_errors;
+	buf->dealloc = stats.dealloc;
 
-	MemoryContextSwitchTo(oldcontext);
+	slot = (pgseEntryError *) palloc(pgse_slot_size);
 
-	/*
-	 * With a large hash table, we might be holding the lock rather longer
-	 * than one could wish.  However, this only blocks creation of new hash
-	 * table entries, and the larger the hash table the less likely that is to
-	 * be needed.  So we can hope this is okay.  Perhaps someday we'll decide
-	 * we need to partition the hash table to limit the time spent holding any
-	 * one lock.
-	 */
 	LWLockAcquire(pgse->lock, LW_SHARED);
 
+	entries = (pgseEntrySnapshot *)
+		palloc(sizeof(pgseEntrySnapshot) * Max(hash_get_num_entries(pgse_hash), 1));
+
 	hash_seq_init(&hash_seq, pgse_hash);
 	while ((entry = hash_seq_search(&hash_seq)) != NULL)
 	{
-		Datum           values[PG_STAT_ERRORS_COLS];
-		bool            nulls[PG_STAT_ERRORS_COLS];
-		int             i = 0;
-		Counters        tmp;
-		int		eclass;
-		char		eclass_text[4] = {0};
+		entries[n].key = entry->key;
+		read_entry_counters(entry, &entries[n].counters);
+		n++;
+	}
 
-		memset(values, 0, sizeof(values));
-		memset(nulls, 0, sizeof(nulls));
+	LWLockRelease(pgse->lock);
 
-		values[i++] = ObjectIdGetDatum(entry->key.userid);
-		values[i++] = ObjectIdGetDatum(entry->key.dbid);
+	/* the latest errors first, the lock only held to copy each slot */
+	buf->nerrors = 0;
+	head = pg_atomic_read_u64(&pgse->eid.seqno);
+	for (s = head;
+	     s > 0 && head - s < (uint64) pgse_max_last && buf->nerrors < PGSE_SNAPSHOT_MAX_ERRORS;
+	     s--)
+	{
+		pgseSnapshotError *dst = &buf->errors[buf->nerrors];
+		char        *query;
+		uint32      query_len;
 
-		/* level */
-		values[i++] = CStringGetTextDatum(get_level_as_text(entry->key.elevel));
+		LWLockAcquire(pgse->lock, LW_SHARED);
+		read_error_slot(pgse_error_slot((s - 1) % pgse_max_last), slot);
+		LWLockRelease(pgse->lock);
 
-		/* class */
-		eclass = ERRCODE_TO_CATEGORY(entry->key.ecode);
-		strncpy(eclass_text, get_code_as_text(eclass), 2);
-		values[i++] = CStringGetTextDatum(eclass_text);
+		if (slot->error.seqno != s)
+			continue;
 
-		/* class_message */
-		values[i++] = CStringGetTextDatum(get_message_by_code(eclass));
+		dst->error_time = snapshot_time(slot->error.etime);
+		dst->last_time = snapshot_time(slot->error.repeat_count > 0 ?
+		                               slot->error.last_time : slot->error.etime);
+		dst->userid = slot->error.userid;
+		dst->dbid = slot->error.dbid;
+		dst->repeat_count = Max(slot->error.repeat_count, 1);
+		dst->pad = 0;
+		strlcpy(dst->level, get_level_as_text(slot->error.elevel), PGSE_SNAPSHOT_LEVEL_LEN);
+		strlcpy(dst->state, get_code_as_text(slot->error.ecode), PGSE_SNAPSHOT_STATE_LEN);
+		query = unpack_query(slot, &query_len);
+		snapshot_text(dst->query, PGSE_SNAPSHOT_QUERY_LEN, query, query_len);
+		snapshot_text(dst->message, PGSE_SNAPSHOT_MESSAGE_LEN,
+		              pgse_error_message(slot), slot->error.message_len);
+		buf->nerrors++;
+	}
 
-		/* state */
-		values[i++] = CStringGetTextDatum(get_code_as_text(entry->key.ecode));
+	/* keep the entries with most errors */
+	if (n > PGSE_SNAPSHOT_MAX_ENTRIES)
+		qsort(entries, n, sizeof(pgseEntrySnapshot), snapshot_entry_cmp);
 
-		/* state_message */
-		values[i++] = CStringGetTextDatum(get_message_by_code(entry->key.ecode));
+	buf->entries_total = n;
+	buf->nentries = Min(n, PGSE_SNAPSHOT_MAX_ENTRIES);
+	for (i = 0; i < buf->nentries; i++)
+	{
+		pgseSnapshotEntry *dst = &buf->entries[i];
+
+		dst->userid = entries[i].key.userid;
+		dst->dbid = entries[i].key.dbid;
+		strlcpy(dst->level, get_level_as_text(entries[i].key.elevel), PGSE_SNAPSHOT_LEVEL_LEN);
+		strlcpy(dst->state, get_code_as_text(entries[i].key.ecode), PGSE_SNAPSHOT_STATE_LEN);
+		dst->errors = entries[i].counters.errors;
+		dst->wasted_time = entries[i].counters.wasted_time;
+		dst->first_time = snapshot_time(entries[i].counters._first_change);
+		dst->last_time = snapshot_time(entries[i].counters._last_change);
+	}
 
-		/* copy counters to a local variable to keep locking time short */
-		{
-			volatile pgseEntry *e = (volatile pgseEntry *) entry;
+	pg_write_barrier();
+	buf->end_seqno = seqno;
 
-			SpinLockAcquire(&e->mutex);
-			tmp = e->counters;
-			SpinLockRelease(&e->mutex);
-		}
-		values[i++] = Int64GetDatumFast(tmp.errors);
-		values[i++] = TimestampTzGetDatum(tmp._last_change);
+	/* publish the buffer */
+	pg_write_barrier();
+	snapshot_file->current = idx;
+	snapshot_file->seqno = seqno;
+}
 
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+/*
+ * Sum the rollups of errors matching an alert rule: the error class or the
+ * database (at most one of them) and the mask of levels.  Lock-free.
+ */
+static uint64
+pgse_alert_errors(int eclass, Oid dbid, bool any_db, int level_mask)
+{
+	uint64  result = 0;
+	int     level;
+	int     slot;
+
+	if (eclass >= 0)
+	{
+		slot = rollup_find_class(eclass);
+		if (slot < 0)
+			return 0;
+
+		for (level = 0; level < PGSE_NUM_LEVELS; level++)
+			if (level_mask & (1 << level))
+				result += pg_atomic_read_u64(&pgse->rollups.class_errors[level][slot]);
 	}
-	/* clean up and return the tuplestore */
-	LWLockRelease(pgse->lock);
-#if PG_VERSION_NUM <= 140000
-	tuplestore_donestoring(tupstore);
-#endif
+	else if (!any_db)
+	{
+		slot = rollup_find_database(dbid);
+		if (slot < 0)
+			return 0;
 
-	return (Datum) 0;
-}
+		for (level = 0; level < PGSE_NUM_LEVELS; level++)
+			if (level_mask & (1 << level))
+				result += pg_atomic_read_u64(&pgse->rollups.db_errors[slot][level]);
+	}
+	else
+	{
+		int     nclasses = pgse->rollups.nclasses;
+
+		pg_read_barrier();
+
+		for (slot = 0; slot < nclasses; slot++)
+			for (level = 0; level < PGSE_NUM_LEVELS; level++)
+				if (level_mask & (1 << level))
+					result += pg_atomic_read_u64(&pgse->rollups.class_errors[level][slot]);
+	}
 
+	return result;
+}
 
-#define PG_STAT_ERRORS_LAST_COLS     7
 
 /*
- * Retrieve last N errors
+ * Fire an alert: log a single summarized line and notify the channel of the
+ * rule, if any.  The caller is connected to SPI.
  */
-Datum
-pg_stat_errors_last(PG_FUNCTION_ARGS)
+static void
+pgse_alert_fire(const char *rule_name, const char *channel,
+                double rate, double threshold, uint64 errors,
+                TimestampTz breach_start, const char *eclass_text, Oid dbid, bool any_db)
 {
-	ReturnSetInfo       *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	TupleDesc           tupdesc;
-	Tuplestorestate     *tupstore;
-	MemoryContext       per_query_ctx;
-	MemoryContext       oldcontext;
-	int                 j, num_last;
-
-	/* array of errors must exist already */
-	if ( !isInitialized() )
-		ereport(ERROR,
-		        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-		         errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+	StringInfoData  payload;
 
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-		         errmsg("set-valued function called in context that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-		         errmsg("materialize mode required, but it is not allowed in this context")));
+	ereport(LOG,
+	        (errmsg("pg_stat_errors: alert \"%s\" fired: %.1f errors/s exceed %g errors/s since %s",
+	                rule_name, rate, threshold, timestamptz_to_str(breach_start))));
 
-	/* Switch into long-lived context to construct returned data structures */
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	if (channel == NULL)
+		return;
 
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+	/* NOTIFY is not allowed on a standby, the log line has to do */
+	if (RecoveryInProgress())
+		return;
 
-	if (tupdesc->natts != PG_STAT_ERRORS_LAST_COLS)
-		elog(ERROR, "incorrect number of output arguments, required %d", tupdesc->natts);
+	initStringInfo(&payload);
+	appendStringInfoString(&payload, "{\"rule\":");
+	escape_json(&payload, rule_name);
+	appendStringInfo(&payload, ",\"rate\":%.3f,\"threshold\":%g,\"errors\":" UINT64_FORMAT ",\"since\":",
+	                 rate, threshold, errors);
+	escape_json(&payload, timestamptz_to_str(breach_start));
+	appendStringInfoString(&payload, ",\"error_class\":");
+	if (eclass_text)
+		escape_json(&payload, eclass_text);
+	else
+		appendStringInfoString(&payload, "null");
+	if (any_db)
+		appendStringInfoString(&payload, ",\"dbid\":null}");
+	else
+		appendStringInfo(&payload, ",\"dbid\":%u}", dbid);
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+	{
+		Oid     argtypes[2] = {TEXTOID, TEXTOID};
+		Datum   values[2];
 
-	MemoryContextSwitchTo(oldcontext);
+		values[0] = CStringGetTextDatum(channel);
+		values[1] = CStringGetTextDatum(payload.data);
 
-	/*
-	 * With a large array table, we might be holding the lock rather longer
-	 * than one could wish. However, this only blocks creation of new array
-	 * entries, and the larger the array the less likely that is to be needed.
-	 * So we can hope this is okay.  Perhaps someday we'll decide we need to
-	 * partition the array to limit the time spent holding any one lock.
-	 */
-	LWLockAcquire(pgse->lock, LW_SHARED);
+		if (SPI_execute_with_args("SELECT pg_catalog.pg_notify($1, $2)",
+		                          2, argtypes, values, NULL, false, 1) != SPI_OK_SELECT)
+			elog(LOG, "pg_stat_errors: could not notify channel \"%s\"", channel);
+	}
+}
 
-	/* output only the actual number of errors if the number of errors
-	 * is less than pgse_max_last */
-	num_last = pgse->eid.max_eid;
 
-	for (j=0; j<num_last; j++)
+/*
+ * Evaluate the alert rules against the rollups
+ *
+ * The rules are read from the table pg_stat_errors_alert_rules in the
+ * database pg_stat_errors.alert_database.  A rule trips when the rate of
+ * matching errors exceeds its threshold for its whole duration; it fires
+ * once per breach and re-arms when the rate falls back.
+ */
+static void
+pgse_evaluate_alerts(void)
+{
+	TimestampTz     now = GetCurrentTimestamp();
+	StringInfoData  query;
+	HASH_SEQ_STATUS hash_seq;
+	pgseAlertState  *state;
+	uint64          i;
+	int             ret;
+
+	if (alert_states == NULL)
 	{
-		Datum           values[PG_STAT_ERRORS_LAST_COLS];
-		bool            nulls[PG_STAT_ERRORS_LAST_COLS];
-		int             i = 0;
-		ErrorInfo       tmp;
+		HASHCTL     info;
 
-		memset(values, 0, sizeof(values));
-		memset(nulls, 0, sizeof(nulls));
+		memset(&info, 0, sizeof(info));
+		info.keysize = NAMEDATALEN;
+		info.entrysize = sizeof(pgseAlertState);
+		alert_states = hash_create("pg_stat_errors alert states", 32,
+		                           &info, HASH_ELEM | HASH_BLOBS);
+	}
 
-		/* copy counters to a local variable to keep locking time short */
-		{
-			volatile pgseEntryError *e = (volatile pgseEntryError *) &pgse_errors[j];
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "pg_stat_errors: evaluating alert rules");
 
-			SpinLockAcquire(&e->mutex);
-			tmp = e->error;
-			SpinLockRelease(&e->mutex);
+	/* the extension is not relocatable, find its schema first */
+	ret = SPI_execute("SELECT pg_catalog.quote_ident(n.nspname)"
+	                  "  FROM pg_catalog.pg_extension e"
+	                  "  JOIN pg_catalog.pg_namespace n ON n.oid = e.extnamespace"
+	                  " WHERE e.extname = 'pg_stat_errors'", true, 1);
+
+	if (ret != SPI_OK_SELECT || SPI_processed == 0)
+	{
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+		pgstat_report_activity(STATE_IDLE, NULL);
+		return;
+	}
+
+	initStringInfo(&query);
+	appendStringInfo(&query,
+	                 "SELECT rule_name, error_class, dbid,"
+	                 "       (SELECT coalesce(bit_or(CASE l WHEN 'WARNING' THEN 1 WHEN 'ERROR' THEN 2"
+	                 "                                      WHEN 'FATAL' THEN 4 WHEN 'PANIC' THEN 8 END), 15)"
+	                 "          FROM unnest(error_levels) AS l),"
+	                 "       threshold, extract(epoch FROM duration)::float8, channel"
+	                 "  FROM %s.pg_stat_errors_alert_rules"
+	                 " WHERE enabled",
+	                 SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1));
+
+	ret = SPI_execute(query.data, true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "pg_stat_errors: could not read the alert rules");
+
+	/* forget the rules which have been removed */
+	hash_seq_init(&hash_seq, alert_states);
+	while ((state = hash_seq_search(&hash_seq)) != NULL)
+		state->seen = false;
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple   tuple = SPI_tuptable->vals[i];
+		TupleDesc   tupdesc = SPI_tuptable->tupdesc;
+		char        key[NAMEDATALEN];
+		char        *rule_name = SPI_getvalue(tuple, tupdesc, 1);
+		char        *eclass_text = SPI_getvalue(tuple, tupdesc, 2);
+		char        *channel = SPI_getvalue(tuple, tupdesc, 7);
+		bool        isnull;
+		Oid         dbid;
+		bool        any_db;
+		int         level_mask;
+		double      threshold;
+		double      duration;
+		int         eclass = -1;
+		uint64      errors;
+		bool        found;
+
+		dbid = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 3, &any_db));
+		level_mask = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+		threshold = DatumGetFloat8(SPI_getbinval(tuple, tupdesc, 5, &isnull));
+		duration = DatumGetFloat8(SPI_getbinval(tuple, tupdesc, 6, &isnull));
+
+		if (eclass_text)
+			eclass = MAKE_SQLSTATE(eclass_text[0], eclass_text[1], '0', '0', '0');
+
+		errors = pgse_alert_errors(eclass, dbid, any_db, level_mask);
+
+		memset(key, 0, NAMEDATALEN);
+		strlcpy(key, rule_name, NAMEDATALEN);
+		state = (pgseAlertState *) hash_search(alert_states, key, HASH_ENTER, &found);
+		state->seen = true;
+
+		/* the first time, or the statistics have been reset */
+		if (!found || errors < state->prev_errors)
+		{
+			state->prev_errors = errors;
+			state->prev_time = now;
+			state->breach_start = 0;
+			state->fired = false;
+			continue;
 		}
-		values[i++] = TimestampTzGetDatum(tmp.etime);
-		values[i++] = ObjectIdGetDatum(tmp.userid);
-		values[i++] = ObjectIdGetDatum(tmp.dbid);
 
-		if (strlen(tmp.query) == 0)
-			nulls[i++] = true;
-		else
-			values[i++] = CStringGetTextDatum(tmp.query);
+		if (now > state->prev_time)
+		{
+			double  rate = (double) (errors - state->prev_errors) /
+			               ((double) (now - state->prev_time) / USECS_PER_SEC);
+
+			if (rate > threshold)
+			{
+				if (state->breach_start == 0)
+					state->breach_start = state->prev_time;
+
+				if (!state->fired &&
+				    (double) (now - state->breach_start) / USECS_PER_SEC >= duration)
+				{
+					pgse_alert_fire(rule_name, channel, rate, threshold,
+					                errors - state->prev_errors,
+					                state->breach_start, eclass_text, dbid, any_db);
+					state->fired = true;
+				}
+			}
+			else
+			{
+				state->breach_start = 0;
+				state->fired = false;
+			}
+		}
 
-		values[i++] = CStringGetTextDatum(get_level_as_text(tmp.elevel));
-		values[i++] = CStringGetTextDatum(get_code_as_text(tmp.ecode));
-		values[i++] = CStringGetTextDatum(tmp.message);
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		state->prev_errors = errors;
+		state->prev_time = now;
 	}
 
-	/* clean up and return the tuplestore */
-	LWLockRelease(pgse->lock);
-#if PG_VERSION_NUM <= 140000
-	tuplestore_donestoring(tupstore);
-#endif
+	hash_seq_init(&hash_seq, alert_states);
+	while ((state = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (!state->seen)
+			hash_search(alert_states, state->rule_name, HASH_REMOVE, NULL);
+	}
 
-	return (Datum)0;
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
 }
-
@@ -0,0 +1,164 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_stat_errors.h
+ *		API of pg_stat_errors for the other extensions.
+ *
+ * Other extensions subscribe to the errors seen by pg_stat_errors instead of
+ * installing their own emit_log_hook.  The API is a table of functions
+ * published in the rendezvous variable PGSE_API_RENDEZVOUS once
+ * pg_stat_errors is loaded via shared_preload_libraries:
+ *
+ *		const pgseApi *api = pgse_get_api();
+ *		pgseSqlstateMask mask;
+ *
+ *		pgse_mask_clear(&mask);
+ *		pgse_mask_add_class(&mask, ERRCODE_INTEGRITY_CONSTRAINT_VIOLATION);
+ *		pgse_mask_add_code(&mask, ERRCODE_UNDEFINED_COLUMN);
+ *		if (api)
+ *			api->subscribe(&mask, my_callback, NULL);
+ *
+ * A subscriber placed after pg_stat_errors in shared_preload_libraries, or
+ * loaded later, finds the API in its _PG_init; the subscriptions are kept
+ * by each process.  The callbacks are called from emit_log_hook for the
+ * errors of level WARNING and above whose class or SQLSTATE is in their
+ * mask: they must be cheap and must not raise errors.
+ *
+ * Copyright (c) 2021, Alexey E. Konorev <alexey.konorev@gmail.com>
+ *
+ * IDENTIFICATION
+ *	  pg_stat_errors/pg_stat_errors.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_STAT_ERRORS_H
+#define PG_STAT_ERRORS_H
+
+#include "fmgr.h"
+#include "utils/timestamp.h"
+
+#define PGSE_API_RENDEZVOUS     "pg_stat_errors_api"
+#define PGSE_API_VERSION        1
+
+#define PGSE_MAX_SUBSCRIBERS    16
+
+/*
+ * An error, after pg_stat_errors has classified it.  The pointers are only
+ * valid during the callback.
+ */
+typedef struct pgseErrorEvent
+{
+	TimestampTz     etime;          /* time of the error */
+	Oid             userid;
+	Oid             dbid;
+	int             elevel;
+	int             sqlerrcode;     /* encoded SQLSTATE */
+	const char      *query;         /* query of the error, "" if none */
+	const char      *message;       /* primary error message, "" if none */
+	bool            counted;        /* counted in pg_stat_errors */
+	bool            kept;           /* kept in pg_stat_errors_last */
+} pgseErrorEvent;
+
+typedef void (*pgse_error_callback) (const pgseErrorEvent *event, void *arg);
+
+/*
+ * Set of SQLSTATEs: whole classes, indexed by ERRCODE_TO_CATEGORY() of the
+ * SQLSTATE, and up to PGSE_MASK_MAX_CODES single SQLSTATEs of the other
+ * classes, kept sorted
+ */
+#define PGSE_MASK_BITS          (1 << 12)
+#define PGSE_MASK_MAX_CODES     16
+
+typedef struct pgseSqlstateMask
+{
+	uint64          bits[PGSE_MASK_BITS / 64];
+	int             ncodes;
+	int             codes[PGSE_MASK_MAX_CODES];
+} pgseSqlstateMask;
+
+#define pgse_mask_class(sqlerrcode) \
+	((uint32) ERRCODE_TO_CATEGORY(sqlerrcode) & (PGSE_MASK_BITS - 1))
+
+#define pgse_mask_clear(mask) \
+	memset((mask), 0, sizeof(pgseSqlstateMask))
+#define pgse_mask_fill(mask) \
+	(memset((mask)->bits, 0xFF, sizeof((mask)->bits)), (mask)->ncodes = 0)
+#define pgse_mask_add_class(mask, sqlerrcode) \
+	((mask)->bits[pgse_mask_class(sqlerrcode) / 64] |= \
+	 UINT64CONST(1) << (pgse_mask_class(sqlerrcode) % 64))
+#define pgse_mask_test_class(mask, sqlerrcode) \
+	(((mask)->bits[pgse_mask_class(sqlerrcode) / 64] & \
+	  (UINT64CONST(1) << (pgse_mask_class(sqlerrcode) % 64))) != 0)
+
+/*
+ * Add a single SQLSTATE, false if there are too many of them
+ */
+static inline bool
+pgse_mask_add_code(pgseSqlstateMask *mask, int sqlerrcode)
+{
+	int         i;
+
+	for (i = mask->ncodes; i > 0 && mask->codes[i - 1] >= sqlerrcode; i--)
+		if (mask->codes[i - 1] == sqlerrcode)
+			return true;
+
+	if (mask->ncodes >= PGSE_MASK_MAX_CODES)
+		return false;
+
+	memmove(&mask->codes[i + 1], &mask->codes[i], (mask->ncodes - i) * sizeof(int));
+	mask->codes[i] = sqlerrcode;
+	mask->ncodes++;
+	return true;
+}
+
+/*
+ * Whether a SQLSTATE is in the set, by its class or by itself
+ */
+static inline bool
+pgse_mask_test(const pgseSqlstateMask *mask, int sqlerrcode)
+{
+	int         lo = 0;
+	int         hi = mask->ncodes - 1;
+
+	if (pgse_mask_test_class(mask, sqlerrcode))
+		return true;
+
+	while (lo <= hi)
+	{
+		int         mid = (lo + hi) / 2;
+
+		if (mask->codes[mid] == sqlerrcode)
+			return true;
+		if (mask->codes[mid] < sqlerrcode)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return false;
+}
+
+typedef struct pgseApi
+{
+	int             version;        /* PGSE_API_VERSION */
+
+	/* returns the id of the subscription, -1 if there are too many */
+	int             (*subscribe) (const pgseSqlstateMask *mask,
+	                              pgse_error_callback callback, void *arg);
+	void            (*unsubscribe) (int id);
+} pgseApi;
+
+/*
+ * The API of pg_stat_errors, NULL if it is not loaded or of another version
+ */
+static inline const pgseApi *
+pgse_get_api(void)
+{
+	pgseApi   **api = (pgseApi **) find_rendezvous_variable(PGSE_API_RENDEZVOUS);
+
+	if (*api == NULL || (*api)->version != PGSE_API_VERSION)
+		return NULL;
+
+	return *api;
+}
+
+#endif							/* PG_STAT_ERRORS_H */
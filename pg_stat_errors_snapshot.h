@@ -0,0 +1,102 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_stat_errors_snapshot.h
+ *		layout of the snapshot file of pg_stat_errors.
+ *
+ * The background worker publishes the counters and the last errors into a
+ * file of the data directory, which monitoring agents map in memory to read
+ * them without any connection to the server.  This header does not depend
+ * on the headers of PostgreSQL, the readers include it as is.
+ *
+ * The file is a header followed by two buffers.  The worker fills the buffer
+ * not published, sets its begin_seqno before and its end_seqno after, then
+ * publishes it in the header.  A reader copies the published buffer, reading
+ * end_seqno before the copy and begin_seqno after it: the copy is consistent
+ * if they are equal and not zero, otherwise the worker rewrote the buffer
+ * meanwhile and the reader tries again.  The integers are in the byte order
+ * of the server, the times in microseconds since the Unix epoch.
+ *
+ * Copyright (c) 2021, Alexey E. Konorev <alexey.konorev@gmail.com>
+ *
+ * IDENTIFICATION
+ *	  pg_stat_errors/pg_stat_errors_snapshot.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_STAT_ERRORS_SNAPSHOT_H
+#define PG_STAT_ERRORS_SNAPSHOT_H
+
+#include <stdint.h>
+
+#define PGSE_SNAPSHOT_MAGIC         0x50475353  /* "PGSS" */
+#define PGSE_SNAPSHOT_VERSION       1
+
+/* relative to the data directory */
+#define PGSE_SNAPSHOT_FILE          "pg_stat/pg_stat_errors.snap"
+
+#define PGSE_SNAPSHOT_MAX_ENTRIES   1024    /* the ones with most errors */
+#define PGSE_SNAPSHOT_MAX_ERRORS    128     /* the latest ones */
+#define PGSE_SNAPSHOT_LEVEL_LEN     8
+#define PGSE_SNAPSHOT_STATE_LEN     8
+#define PGSE_SNAPSHOT_QUERY_LEN     256
+#define PGSE_SNAPSHOT_MESSAGE_LEN   256
+
+/*
+ * The counters of an entry of pg_stat_errors
+ */
+typedef struct pgseSnapshotEntry
+{
+	uint32_t        userid;
+	uint32_t        dbid;
+	char            level[PGSE_SNAPSHOT_LEVEL_LEN];     /* NUL-terminated */
+	char            state[PGSE_SNAPSHOT_STATE_LEN];     /* NUL-terminated */
+	int64_t         errors;
+	int64_t         wasted_time;    /* total duration of failed statements, in us */
+	int64_t         first_time;
+	int64_t         last_time;
+} pgseSnapshotEntry;
+
+/*
+ * A row of pg_stat_errors_last, the texts are clipped and NUL-terminated
+ */
+typedef struct pgseSnapshotError
+{
+	int64_t         error_time;
+	int64_t         last_time;
+	uint32_t        userid;
+	uint32_t        dbid;
+	uint32_t        repeat_count;
+	uint32_t        pad;
+	char            level[PGSE_SNAPSHOT_LEVEL_LEN];
+	char            state[PGSE_SNAPSHOT_STATE_LEN];
+	char            query[PGSE_SNAPSHOT_QUERY_LEN];
+	char            message[PGSE_SNAPSHOT_MESSAGE_LEN];
+} pgseSnapshotError;
+
+typedef struct pgseSnapshotBuffer
+{
+	volatile uint64_t begin_seqno;  /* set before filling the buffer */
+	int64_t         snapshot_time;
+	int64_t         stats_reset;
+	uint64_t        total_errors;
+	uint64_t        dealloc;
+	uint32_t        nentries;       /* # of entries in the snapshot */
+	uint32_t        entries_total;  /* # of entries of pg_stat_errors */
+	uint32_t        nerrors;        /* # of errors in the snapshot */
+	uint32_t        pad;
+	pgseSnapshotEntry entries[PGSE_SNAPSHOT_MAX_ENTRIES];
+	pgseSnapshotError errors[PGSE_SNAPSHOT_MAX_ERRORS];     /* the latest first */
+	volatile uint64_t end_seqno;    /* set after filling the buffer */
+} pgseSnapshotBuffer;
+
+typedef struct pgseSnapshotFile
+{
+	uint32_t        magic;          /* PGSE_SNAPSHOT_MAGIC */
+	uint32_t        version;        /* PGSE_SNAPSHOT_VERSION */
+	uint32_t        file_size;      /* sizeof(pgseSnapshotFile) */
+	volatile uint32_t current;      /* index of the published buffer */
+	volatile uint64_t seqno;        /* # of snapshots published, 0 if none */
+	pgseSnapshotBuffer buffers[2];
+} pgseSnapshotFile;
+
+#endif							/* PG_STAT_ERRORS_SNAPSHOT_H */
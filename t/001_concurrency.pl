@@ -0,0 +1,137 @@
+# Concurrent errors on many keys with small pg_stat_errors.max and
+# pg_stat_errors.max_last: the totals and the rollups are exact, the ring of
+# the last errors keeps the latest errors of each backend, and the
+# statistics survive a restart, with the ring continuing where it stopped.
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $clients = 8;
+my $transactions = 500;
+my $errors = $clients * $transactions;
+my $max_last = 50;
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'pg_stat_errors'
+pg_stat_errors.max = 20
+pg_stat_errors.max_last = $max_last
+pg_stat_errors.save = on
+});
+$node->start;
+
+# The errors are warnings, so that pgbench does not abort the clients.  The
+# message identifies the run, the client and the rank of the error in it.
+$node->safe_psql(
+	'postgres', q{
+CREATE EXTENSION pg_stat_errors;
+CREATE FUNCTION pgse_raise(code int, run int, client int, seq int) RETURNS void
+LANGUAGE plpgsql SET client_min_messages = error AS $$
+BEGIN
+	RAISE WARNING 'pgse % % %', run, client, seq
+		USING ERRCODE = 'U' || lpad(code::text, 4, '0');
+END
+$$;
+SELECT pg_stat_errors_reset();
+});
+
+# 100 error states for 20 entries: the entries are created, promoted and
+# evicted concurrently
+$node->pgbench(
+	"--no-vacuum --client=$clients --transactions=$transactions --define=seq=0",
+	0,
+	[qr{processed: $errors/$errors}],
+	[qr{^$}],
+	'concurrent errors',
+	{
+		'001_concurrency' => q{
+\set code random(1, 100)
+\set seq :seq + 1
+SELECT pgse_raise(:code, 1, :client_id, :seq);
+}
+	});
+
+is($node->safe_psql('postgres', 'SELECT pg_stat_errors_total_errors()'),
+	$errors, 'total of the errors');
+is( $node->safe_psql(
+		'postgres',
+		q{SELECT errors FROM pg_stat_errors_by_level WHERE error_level = 'WARNING'}),
+	$errors,
+	'rollup by level');
+is( $node->safe_psql(
+		'postgres',
+		q{SELECT sum(errors) FROM pg_stat_errors_by_class WHERE error_class = 'U0'}),
+	$errors,
+	'rollup by class');
+ok( $node->safe_psql(
+		'postgres',
+		'SELECT count(*) <= 20 AND (SELECT dealloc > 0 FROM pg_stat_errors_info) FROM pg_stat_errors'
+	) eq 't',
+	'entries evicted');
+
+# The ring keeps the latest errors: for each client, a suffix of its errors
+my $last = q{
+SELECT split_part(error_message, ' ', 2)::int AS run,
+       split_part(error_message, ' ', 3)::int AS client,
+       split_part(error_message, ' ', 4)::int AS seq,
+       error_time
+  FROM pg_stat_errors_last
+ WHERE error_message LIKE 'pgse %'};
+
+is($node->safe_psql('postgres', "SELECT count(*) FROM ($last) l"),
+	$max_last, 'ring full');
+is( $node->safe_psql(
+		'postgres', qq{
+SELECT count(*)
+  FROM (SELECT client, count(*) AS n, min(seq) AS lo, max(seq) AS hi
+          FROM ($last) l GROUP BY client) c
+ WHERE hi <> $transactions OR hi - lo + 1 <> n}),
+	'0',
+	'ring keeps the latest errors of each client');
+is( $node->safe_psql(
+		'postgres', qq{
+SELECT count(*)
+  FROM (SELECT error_time, lag(error_time) OVER (PARTITION BY client ORDER BY seq) AS prev
+          FROM ($last) l) t
+ WHERE error_time < prev}),
+	'0',
+	'times of the errors of each client in order');
+
+# Wrap the ring from a single backend, then restart
+$node->safe_psql('postgres',
+	'SELECT pgse_raise(1, 2, 0, g) FROM generate_series(1, 60) g');
+
+my $stats = 'SELECT userid, dbid, error_level, error_state, errors FROM pg_stat_errors ORDER BY 1, 2, 3, 4';
+my $rollups = 'SELECT * FROM pg_stat_errors_by_class ORDER BY 1, 2';
+my $ring = "SELECT error_time, run, client, seq FROM ($last) l ORDER BY 1, 2, 3, 4";
+
+my $stats_before = $node->safe_psql('postgres', $stats);
+my $rollups_before = $node->safe_psql('postgres', $rollups);
+my $ring_before = $node->safe_psql('postgres', $ring);
+
+$node->restart;
+
+is($node->safe_psql('postgres', $stats), $stats_before, 'entries reloaded');
+is($node->safe_psql('postgres', $rollups), $rollups_before, 'rollups reloaded');
+is($node->safe_psql('postgres', $ring), $ring_before, 'ring reloaded');
+is($node->safe_psql('postgres', 'SELECT pg_stat_errors_total_errors()'),
+	$errors + 60, 'total reloaded');
+
+# The new errors overwrite the oldest ones of the reloaded ring
+$node->safe_psql('postgres',
+	'SELECT pgse_raise(1, 3, 0, g) FROM generate_series(1, 24) g');
+
+is( $node->safe_psql(
+		'postgres', qq{
+SELECT run, min(seq), max(seq), count(*) FROM ($last) l GROUP BY run ORDER BY run}),
+	"2|35|60|26\n3|1|24|24",
+	'ring continues after the reload');
+
+$node->stop;
+
+done_testing();
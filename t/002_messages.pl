@@ -0,0 +1,65 @@
+# Errors by message template with a small pg_stat_errors.max_messages: the
+# messages of one error state are counted by template, and the templates
+# with the oldest errors are evicted when the limit is reached.
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('main');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'pg_stat_errors'
+pg_stat_errors.max_messages = 4
+});
+$node->start;
+
+$node->safe_psql(
+	'postgres', q{
+CREATE EXTENSION pg_stat_errors;
+SELECT pg_stat_errors_reset();
+});
+
+# Two templates of 22P02, one of them twice
+$node->psql('postgres', q{SELECT 'x'::int});
+$node->psql('postgres', q{SELECT 'y'::int});
+$node->psql('postgres', q{SELECT '{'::int[]});
+
+is( $node->safe_psql(
+		'postgres', q{
+SELECT message_id, errors, example_message
+  FROM pg_stat_errors_messages
+ WHERE error_state = '22P02'
+ ORDER BY message_id}),
+	qq{invalid input syntax for type %s: "%s"|2|invalid input syntax for type integer: "x"
+malformed array literal: "%s"|1|malformed array literal: "{"},
+	'one row by template of an error state');
+
+# Three more templates: the fifth one evicts the two oldest templates, the
+# ones of 22P02
+foreach my $code (1 .. 3)
+{
+	$node->psql('postgres',
+		"DO \$\$ BEGIN RAISE EXCEPTION 'pgse $code' USING ERRCODE = 'U000$code'; END \$\$"
+	);
+}
+
+is( $node->safe_psql(
+		'postgres',
+		'SELECT error_state, errors FROM pg_stat_errors_messages ORDER BY 1'),
+	"U0001|1\nU0002|1\nU0003|1",
+	'oldest templates evicted');
+
+# The counters of the errors keep all of them
+is( $node->safe_psql(
+		'postgres',
+		q{SELECT sum(errors) FROM pg_stat_errors WHERE error_state = '22P02'}),
+	'3',
+	'errors counted after the eviction of their templates');
+
+$node->stop;
+
+done_testing();
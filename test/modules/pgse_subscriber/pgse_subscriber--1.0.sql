@@ -0,0 +1,21 @@
+/* test/modules/pgse_subscriber/pgse_subscriber--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pgse_subscriber" to load this file. \quit
+
+CREATE FUNCTION pgse_subscriber_events(
+    OUT events              bigint,
+    OUT error_level         text,
+    OUT error_state         text,
+    OUT query               text,
+    OUT error_message       text,
+    OUT counted             boolean
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pgse_subscriber_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
@@ -0,0 +1,112 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgse_subscriber.c
+ *		test of the API of pg_stat_errors.
+ *
+ * Subscribes to the integrity constraint violations (class 23), the data
+ * exceptions (class 22) and the undefined columns (42703) when loaded, and
+ * remembers the number of events and the last one.
+ *
+ * Copyright (c) 2021, Alexey E. Konorev <alexey.konorev@gmail.com>
+ *
+ * IDENTIFICATION
+ *	  pg_stat_errors/test/modules/pgse_subscriber/pgse_subscriber.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "funcapi.h"
+#include "utils/builtins.h"
+
+#include "pg_stat_errors.h"
+
+PG_MODULE_MAGIC;
+
+PG_FUNCTION_INFO_V1(pgse_subscriber_events);
+PG_FUNCTION_INFO_V1(pgse_subscriber_reset);
+
+void        _PG_init(void);
+
+#define PGSE_SUBSCRIBER_LEN     256
+
+static int64    events = 0;
+static int      last_elevel;
+static int      last_sqlerrcode;
+static char     last_query[PGSE_SUBSCRIBER_LEN];
+static char     last_message[PGSE_SUBSCRIBER_LEN];
+static bool     last_counted;
+
+/*
+ * Copy the event, the callback must not allocate memory nor raise errors
+ */
+static void
+pgse_subscriber_callback(const pgseErrorEvent *event, void *arg)
+{
+	events++;
+	last_elevel = event->elevel;
+	last_sqlerrcode = event->sqlerrcode;
+	strlcpy(last_query, event->query, sizeof(last_query));
+	strlcpy(last_message, event->message, sizeof(last_message));
+	last_counted = event->counted;
+}
+
+void
+_PG_init(void)
+{
+	const pgseApi   *api = pgse_get_api();
+	pgseSqlstateMask mask;
+
+	if (api == NULL)
+	{
+		ereport(WARNING,
+		        (errmsg("pg_stat_errors must be loaded via shared_preload_libraries")));
+		return;
+	}
+
+	pgse_mask_clear(&mask);
+	pgse_mask_add_class(&mask, ERRCODE_INTEGRITY_CONSTRAINT_VIOLATION);
+	pgse_mask_add_class(&mask, ERRCODE_DATA_EXCEPTION);
+	pgse_mask_add_code(&mask, ERRCODE_UNDEFINED_COLUMN);
+
+	if (api->subscribe(&mask, pgse_subscriber_callback, NULL) < 0)
+		ereport(WARNING,
+		        (errmsg("too many subscribers of pg_stat_errors")));
+}
+
+Datum
+pgse_subscriber_events(PG_FUNCTION_ARGS)
+{
+	TupleDesc   tupdesc;
+	Datum       values[6];
+	bool        nulls[6];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = Int64GetDatum(events);
+	if (events > 0)
+	{
+		values[1] = CStringGetTextDatum(last_elevel == WARNING ? "WARNING" :
+		                                last_elevel == ERROR ? "ERROR" : "FATAL");
+		values[2] = CStringGetTextDatum(unpack_sql_state(last_sqlerrcode));
+		values[3] = CStringGetTextDatum(last_query);
+		values[4] = CStringGetTextDatum(last_message);
+		values[5] = BoolGetDatum(last_counted);
+	}
+	else
+		nulls[1] = nulls[2] = nulls[3] = nulls[4] = nulls[5] = true;
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+Datum
+pgse_subscriber_reset(PG_FUNCTION_ARGS)
+{
+	events = 0;
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,29 @@
+CREATE EXTENSION pgse_subscriber;
+
+-- loads the module, which subscribes to the classes 22 and 23 and to 42703
+SELECT events FROM pgse_subscriber_events();
+
+CREATE TABLE subscriber_t (n int PRIMARY KEY);
+INSERT INTO subscriber_t VALUES (1);
+
+-- unique violation, class 23
+INSERT INTO subscriber_t VALUES (1);
+SELECT * FROM pgse_subscriber_events();
+
+-- division by zero, class 22
+SELECT 1 / 0;
+SELECT * FROM pgse_subscriber_events();
+
+-- undefined table, class 42: not passed to the subscriber
+SELECT * FROM subscriber_missing;
+SELECT events, error_state FROM pgse_subscriber_events();
+
+-- undefined column, 42703 of class 42: passed to the subscriber
+SELECT missing_column FROM subscriber_t;
+SELECT events, error_state FROM pgse_subscriber_events();
+
+SELECT pgse_subscriber_reset();
+SELECT events FROM pgse_subscriber_events();
+
+DROP TABLE subscriber_t;
+DROP EXTENSION pgse_subscriber;
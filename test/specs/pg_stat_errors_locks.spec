@@ -0,0 +1,41 @@
+# Lock conflicts in pg_stat_errors_last: a lock timeout records the mode
+# and the duration of the wait, at least lock_timeout, a deadlock also
+# records the relations and the blocking processes from the report of the
+# deadlock.
+
+setup
+{
+	CREATE EXTENSION pg_stat_errors;
+	CREATE TABLE pgse_t1 ();
+	CREATE TABLE pgse_t2 ();
+	DO $$ BEGIN PERFORM pg_stat_errors_reset(); END $$;
+}
+
+teardown
+{
+	DROP TABLE pgse_t1, pgse_t2;
+	DROP EXTENSION pg_stat_errors;
+}
+
+session s1
+setup			{ SET deadlock_timeout = '10s'; }
+step s1l1		{ BEGIN; LOCK TABLE pgse_t1; }
+step s1l2		{ LOCK TABLE pgse_t2; }
+step s1c		{ COMMIT; }
+
+session s2
+setup			{ SET deadlock_timeout = '100ms'; }
+step s2l2		{ BEGIN; LOCK TABLE pgse_t2; }
+step s2l1		{ LOCK TABLE pgse_t1; }
+step s2c		{ COMMIT; }
+
+session s3
+setup			{ SET lock_timeout = '100ms'; }
+step s3timeout	{ LOCK TABLE pgse_t1; }
+step s3check	{ SELECT error_state, lock_mode, lock_relations::regclass[] AS relations, cardinality(blocking_pids) AS blockers, lock_wait_time >= 100 AS waited FROM pg_stat_errors_last WHERE error_state IN ('40P01', '55P03') ORDER BY error_time; }
+
+# the lock timeout of s3, while s1 holds the lock
+permutation s1l1 s3timeout s3check s1c
+
+# s2 detects the deadlock first, s1 completes once s2 has failed
+permutation s1l1 s2l2 s1l2(s2l1) s2l1 s1c s2c s3check
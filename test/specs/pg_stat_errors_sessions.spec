@@ -0,0 +1,31 @@
+# Errors of the same keys raised by several sessions: the counters are
+# exact whichever backend creates the entry and whichever shard of the
+# global counters the backends update, and a reset from one session clears
+# the errors of all of them.
+
+setup
+{
+	CREATE EXTENSION pg_stat_errors;
+	DO $$ BEGIN PERFORM pg_stat_errors_reset(); END $$;
+}
+
+teardown
+{
+	DROP EXTENSION pg_stat_errors;
+}
+
+session s1
+step s1div		{ SELECT 1/0; }
+step s1undef	{ SELECT * FROM pgse_undefined_table; }
+step s1reset	{ SELECT pg_stat_errors_reset(); }
+
+session s2
+step s2div		{ SELECT 1/0; }
+step s2undef	{ SELECT * FROM pgse_undefined_table; }
+
+session s3
+step s3div		{ SELECT 1/0; }
+step s3check	{ SELECT error_state, errors FROM pg_stat_errors WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database()) ORDER BY error_state; }
+step s3total	{ SELECT pg_stat_errors_total_errors(); }
+
+permutation s1div s2div s3div s1undef s2undef s3check s3total s1reset s2div s3check s3total
@@ -0,0 +1,351 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_stat_errors_snap.c
+ *		read the snapshot file of pg_stat_errors without any connection.
+ *
+ * The file is mapped read-only and the published buffer is copied under
+ * the protocol described in pg_stat_errors_snapshot.h, then printed as a
+ * table, as JSON or as CSV.
+ *
+ * Copyright (c) 2021, Alexey E. Konorev <alexey.konorev@gmail.com>
+ *
+ * IDENTIFICATION
+ *	  pg_stat_errors/tools/pg_stat_errors_snap/pg_stat_errors_snap.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pg_stat_errors_snapshot.h"
+
+#define MAX_TRIES       100
+
+#define read_barrier()  __sync_synchronize()
+
+typedef enum
+{
+	FORMAT_TEXT,
+	FORMAT_JSON,
+	FORMAT_CSV
+} OutputFormat;
+
+static const char *progname;
+
+static void
+usage(void)
+{
+	printf("%s reads the snapshot file of pg_stat_errors.\n\n", progname);
+	printf("Usage:\n  %s [OPTION]...\n\n", progname);
+	printf("Options:\n");
+	printf("  -D DATADIR     data directory, default $PGDATA\n");
+	printf("  -f FILE        snapshot file, default DATADIR/%s\n", PGSE_SNAPSHOT_FILE);
+	printf("  -o FORMAT      output format: text (default), json or csv\n");
+	printf("  -l             print the last errors instead of the counters\n");
+	printf("  -h             show this help, then exit\n");
+}
+
+/*
+ * Copy the published buffer, false if the worker kept rewriting it
+ */
+static int
+read_snapshot(const pgseSnapshotFile *file, pgseSnapshotBuffer *copy)
+{
+	int     tries;
+
+	for (tries = 0; tries < MAX_TRIES; tries++)
+	{
+		const pgseSnapshotBuffer *buf;
+		uint64_t    end;
+		uint64_t    begin;
+
+		if (file->seqno == 0)
+			return 0;
+		read_barrier();
+		buf = &file->buffers[file->current & 1];
+
+		end = buf->end_seqno;
+		read_barrier();
+		memcpy(copy, (const void *) buf, sizeof(pgseSnapshotBuffer));
+		read_barrier();
+		begin = buf->begin_seqno;
+
+		if (begin == end && end != 0)
+			return 1;
+
+		usleep(1000);
+	}
+
+	return 0;
+}
+
+/* Format microseconds since the Unix epoch in UTC */
+static const char *
+format_time(int64_t t, char *dst, size_t size)
+{
+	time_t      secs = (time_t) (t / 1000000);
+	struct tm   tm;
+	size_t      len;
+
+	if (t == 0)
+	{
+		dst[0] = '\0';
+		return dst;
+	}
+
+	gmtime_r(&secs, &tm);
+	len = strftime(dst, size, "%Y-%m-%d %H:%M:%S", &tm);
+	snprintf(dst + len, size - len, ".%06d+00", (int) (t % 1000000));
+	return dst;
+}
+
+/* Print a string as a JSON or a CSV literal */
+static void
+print_literal(OutputFormat format, const char *str)
+{
+	const char *p;
+
+	putchar('"');
+	for (p = str; *p; p++)
+	{
+		unsigned char c = (unsigned char) *p;
+
+		if (format == FORMAT_CSV)
+		{
+			if (c == '"')
+				putchar('"');
+			putchar(c);
+		}
+		else if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c == '\n')
+			printf("\\n");
+		else if (c == '\r')
+			printf("\\r");
+		else if (c == '\t')
+			printf("\\t");
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void
+print_entries(const pgseSnapshotBuffer *buf, OutputFormat format)
+{
+	char        first[64];
+	char        last[64];
+	uint32_t    i;
+
+	if (format == FORMAT_TEXT)
+		printf("%-10s %-10s %-8s %-6s %12s %14s  %-29s  %s\n",
+		       "userid", "dbid", "level", "state", "errors", "wasted_seconds",
+		       "first_time", "last_time");
+	else if (format == FORMAT_CSV)
+		printf("userid,dbid,error_level,error_state,errors,wasted_seconds,first_time,last_time\n");
+
+	for (i = 0; i < buf->nentries && i < PGSE_SNAPSHOT_MAX_ENTRIES; i++)
+	{
+		const pgseSnapshotEntry *e = &buf->entries[i];
+
+		format_time(e->first_time, first, sizeof(first));
+		format_time(e->last_time, last, sizeof(last));
+
+		switch (format)
+		{
+			case FORMAT_TEXT:
+				printf("%-10u %-10u %-8s %-6s %12" PRId64 " %14.3f  %-29s  %s\n",
+				       e->userid, e->dbid, e->level, e->state, e->errors,
+				       (double) e->wasted_time / 1000000.0, first, last);
+				break;
+			case FORMAT_JSON:
+				printf("{\"userid\":%u,\"dbid\":%u,\"error_level\":\"%s\",\"error_state\":\"%s\","
+				       "\"errors\":%" PRId64 ",\"wasted_seconds\":%.6f,"
+				       "\"first_time\":\"%s\",\"last_time\":\"%s\"}\n",
+				       e->userid, e->dbid, e->level, e->state, e->errors,
+				       (double) e->wasted_time / 1000000.0, first, last);
+				break;
+			case FORMAT_CSV:
+				printf("%u,%u,%s,%s,%" PRId64 ",%.6f,%s,%s\n",
+				       e->userid, e->dbid, e->level, e->state, e->errors,
+				       (double) e->wasted_time / 1000000.0, first, last);
+				break;
+		}
+	}
+}
+
+static void
+print_errors(const pgseSnapshotBuffer *buf, OutputFormat format)
+{
+	char        etime[64];
+	char        last[64];
+	uint32_t    i;
+
+	if (format == FORMAT_CSV)
+		printf("error_time,userid,dbid,error_level,error_state,query,error_message,repeat_count,last_time\n");
+
+	for (i = 0; i < buf->nerrors && i < PGSE_SNAPSHOT_MAX_ERRORS; i++)
+	{
+		const pgseSnapshotError *e = &buf->errors[i];
+
+		format_time(e->error_time, etime, sizeof(etime));
+		format_time(e->last_time, last, sizeof(last));
+
+		switch (format)
+		{
+			case FORMAT_TEXT:
+				printf("%s %u %u %s %s (x%u) %s\n  query: %s\n",
+				       etime, e->userid, e->dbid, e->level, e->state,
+				       e->repeat_count, e->message, e->query);
+				break;
+			case FORMAT_JSON:
+				printf("{\"error_time\":\"%s\",\"userid\":%u,\"dbid\":%u,"
+				       "\"error_level\":\"%s\",\"error_state\":\"%s\",\"query\":",
+				       etime, e->userid, e->dbid, e->level, e->state);
+				print_literal(format, e->query);
+				printf(",\"error_message\":");
+				print_literal(format, e->message);
+				printf(",\"repeat_count\":%u,\"last_time\":\"%s\"}\n",
+				       e->repeat_count, last);
+				break;
+			case FORMAT_CSV:
+				printf("%s,%u,%u,%s,%s,", etime, e->userid, e->dbid, e->level, e->state);
+				print_literal(format, e->query);
+				putchar(',');
+				print_literal(format, e->message);
+				printf(",%u,%s\n", e->repeat_count, last);
+				break;
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	const char          *datadir = getenv("PGDATA");
+	const char          *filename = NULL;
+	char                path[4096];
+	OutputFormat        format = FORMAT_TEXT;
+	int                 last = 0;
+	int                 c;
+	int                 fd;
+	struct stat         st;
+	pgseSnapshotFile    *file;
+	pgseSnapshotBuffer  *buf;
+	char                stamp[64];
+
+	progname = argv[0];
+
+	while ((c = getopt(argc, argv, "D:f:o:lh")) != -1)
+	{
+		switch (c)
+		{
+			case 'D':
+				datadir = optarg;
+				break;
+			case 'f':
+				filename = optarg;
+				break;
+			case 'o':
+				if (strcmp(optarg, "text") == 0)
+					format = FORMAT_TEXT;
+				else if (strcmp(optarg, "json") == 0)
+					format = FORMAT_JSON;
+				else if (strcmp(optarg, "csv") == 0)
+					format = FORMAT_CSV;
+				else
+				{
+					fprintf(stderr, "%s: invalid output format \"%s\"\n", progname, optarg);
+					exit(1);
+				}
+				break;
+			case 'l':
+				last = 1;
+				break;
+			case 'h':
+				usage();
+				exit(0);
+			default:
+				fprintf(stderr, "Try \"%s -h\" for more information.\n", progname);
+				exit(1);
+		}
+	}
+
+	if (filename == NULL)
+	{
+		if (datadir == NULL)
+		{
+			fprintf(stderr, "%s: no data directory specified, use -D or PGDATA\n", progname);
+			exit(1);
+		}
+		snprintf(path, sizeof(path), "%s/%s", datadir, PGSE_SNAPSHOT_FILE);
+		filename = path;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		fprintf(stderr, "%s: could not open \"%s\": %s\n", progname, filename, strerror(errno));
+		exit(1);
+	}
+
+	if (st.st_size < (off_t) sizeof(pgseSnapshotFile))
+	{
+		fprintf(stderr, "%s: \"%s\" is not a snapshot file of this version\n", progname, filename);
+		exit(1);
+	}
+
+	file = mmap(NULL, sizeof(pgseSnapshotFile), PROT_READ, MAP_SHARED, fd, 0);
+	if (file == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: could not map \"%s\": %s\n", progname, filename, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+
+	if (file->magic != PGSE_SNAPSHOT_MAGIC ||
+	    file->version != PGSE_SNAPSHOT_VERSION ||
+	    file->file_size != sizeof(pgseSnapshotFile))
+	{
+		fprintf(stderr, "%s: \"%s\" is not a snapshot file of this version\n", progname, filename);
+		exit(1);
+	}
+
+	buf = malloc(sizeof(pgseSnapshotBuffer));
+	if (buf == NULL)
+	{
+		fprintf(stderr, "%s: out of memory\n", progname);
+		exit(1);
+	}
+
+	if (!read_snapshot(file, buf))
+	{
+		fprintf(stderr, "%s: no consistent snapshot in \"%s\"\n", progname, filename);
+		exit(2);
+	}
+
+	if (format == FORMAT_TEXT)
+		printf("snapshot %" PRIu64 " at %s, %" PRIu64 " errors, %u entries\n\n",
+		       buf->end_seqno, format_time(buf->snapshot_time, stamp, sizeof(stamp)),
+		       buf->total_errors, buf->entries_total);
+
+	if (last)
+		print_errors(buf, format);
+	else
+		print_entries(buf, format);
+
+	free(buf);
+	munmap(file, sizeof(pgseSnapshotFile));
+
+	return 0;
+}